@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+// Fixed size memory blocks shared by all queues of a packing job. No more
+// than the memory limit is ever allocated, so peak memory use does not
+// depend on the number of threads. Blocks are allocated on first use and
+// kept around for reuse until the pool is destroyed.
+class BufferPool final {
+public:
+    BufferPool(const int64_t block_size, const int64_t memory_limit)
+        : bsize(block_size), max_blocks(std::max<int64_t>(memory_limit / block_size, 1)) {
+        if(block_size <= 0) {
+            throw std::logic_error("Buffer pool block size must be positive.");
+        }
+    }
+
+    ~BufferPool() {
+        assert(in_use == 0); // Every block must have been released.
+    }
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    int64_t block_size() const { return bsize; }
+    int64_t block_count() const { return max_blocks; }
+
+    // Blocks until a block is available.
+    char *acquire() {
+        std::unique_lock<std::mutex> l(m);
+        cv.wait(l, [this] { return in_use < max_blocks; });
+        return take(l);
+    }
+
+    // Returns null if the memory limit has been reached.
+    char *try_acquire() {
+        std::unique_lock<std::mutex> l(m);
+        if(in_use == max_blocks) {
+            return nullptr;
+        }
+        return take(l);
+    }
+
+    void release(char *block) {
+        {
+            std::lock_guard<std::mutex> l(m);
+            assert(in_use > 0);
+            free_blocks.emplace_back(block);
+            --in_use;
+        }
+        cv.notify_one();
+    }
+
+    // The largest number of blocks that have been in use at the same time.
+    int64_t peak_usage() const {
+        std::lock_guard<std::mutex> l(m);
+        return peak;
+    }
+
+private:
+    char *take(std::unique_lock<std::mutex> &) {
+        char *block;
+        if(free_blocks.empty()) {
+            block = new char[bsize];
+        } else {
+            block = free_blocks.back().release();
+            free_blocks.pop_back();
+        }
+        peak = std::max(peak, ++in_use);
+        return block;
+    }
+
+    mutable std::mutex m;
+    std::condition_variable cv;
+    std::vector<std::unique_ptr<char[]>> free_blocks;
+    const int64_t bsize;
+    const int64_t max_blocks;
+    int64_t in_use = 0;
+    int64_t peak = 0;
+};
@@ -17,9 +17,18 @@
 
 #pragma once
 
+#include "bufferpool.hpp"
+#include "notifier.hpp"
+#include "spillfile.h"
+
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <condition_variable>
+#include <cstring>
+#include <exception>
 #include <future>
+#include <memory>
 #include <mutex>
 #include <stdexcept>
 #include <thread>
@@ -27,118 +36,358 @@
 
 enum class QueueState { EMPTY, HAS_DATA, FULL, SHUTDOWN };
 
+// Queued data handed to the consumer without copying.
+struct QueueBlock {
+    const char *data;
+    int64_t size;
+};
+
 // Single producer
 // Single consumer
+//
+// A ring of blocks taken from a BufferPool. The producer fills the block at
+// the head of the ring, either with push() or by writing straight into
+// space() and calling commit(). The consumer reads blocks from the tail and
+// gives them back. Every block but the last is filled completely, so the
+// place of each byte in the ring follows from its offset in the stream and
+// the two byte counters are all the state the sides share. The lock is only
+// taken when one side has to wait for the other.
+//
+// The queue is full when the ring is or when the pool has run out of
+// blocks. Once a queue has a block it keeps one for itself until it is
+// shut down, so the queue that is being written out can always make
+// progress even if the other queues hold the rest of the pool.
+//
+// If a spill directory has been set, the producer never waits. Instead
+// everything from that point on goes to a SpillFile, which the consumer
+// gets once it has read the blocks in the ring.
 class ByteQueue final {
 public:
-    explicit ByteQueue(const int64_t bsize) : buffer_size(bsize) { buffer.reserve(buffer_size); }
+    // A queue with a private pool, mostly for testing.
+    explicit ByteQueue(const int64_t bsize)
+        : ByteQueue(new BufferPool(std::min<int64_t>(bsize, DEFAULT_BLOCK_SIZE), bsize), bsize) {}
+
+    ByteQueue(BufferPool &pool, const int64_t bsize) : ByteQueue(nullptr, pool, bsize) {}
 
     ~ByteQueue() {
-        assert(buffer.empty()); // Guard against data loss.
+        assert(consumed == written.load()); // Guard against data loss.
+        for(const auto b : ring) {
+            if(b) {
+                pool.release(b);
+            }
+        }
+        if(char *b = spare.exchange(nullptr)) {
+            pool.release(b);
+        }
     }
 
+    // Producer side.
+
     void push(const char *data, int64_t inbuf_size) {
         if(inbuf_size < 0) {
             throw std::logic_error("Negative value used for input buffer size.");
         }
-        std::unique_lock<std::mutex> l(m);
-        if(st == QueueState::SHUTDOWN) {
+        if(closed.load()) {
             throw std::logic_error("Tried to push data to a closed queue.");
         }
-        if((int64_t)buffer.size() + inbuf_size < buffer_size) {
-            buffer.insert(buffer.end(), data, data + inbuf_size);
-            // Buffer did not get full here.
-            if(st == QueueState::EMPTY) {
-                set_state(l, QueueState::HAS_DATA);
+        while(inbuf_size > 0) {
+            if(cur_free == 0 && !next_block()) {
+                // Shut down while waiting for the consumer.
+                return;
             }
-            return;
+            const int64_t this_round_size = std::min(cur_free, inbuf_size);
+            memcpy(cur + block_size - cur_free, data, this_round_size);
+            commit(this_round_size);
+            data += this_round_size;
+            inbuf_size -= this_round_size;
         }
-        push_internal(l, data, inbuf_size);
     }
     void push(const unsigned char *data, int64_t inbuf_size) {
         push(reinterpret_cast<const char *>(data), inbuf_size);
     }
 
-    std::vector<char> pop() {
-        std::vector<char> rv;
+    // Free space in the current block for the producer to write into. Waits
+    // for the consumer if there is none.
+    unsigned char *space() {
+        if(cur_free == 0 && !next_block()) {
+            throw std::logic_error("Tried to push data to a closed queue.");
+        }
+        return reinterpret_cast<unsigned char *>(cur + block_size - cur_free);
+    }
+
+    int64_t space_size() const { return cur_free; }
+
+    // Hands over the first size bytes of space() to the consumer.
+    void commit(const int64_t size) {
+        assert(size >= 0 && size <= cur_free);
+        cur_free -= size;
+        if(spill) {
+            if(cur_free == 0) {
+                spill->write(cur, block_size);
+                cur_free = block_size;
+            }
+            return;
+        }
+        produced += size;
+        written.store(produced);
+        if(cur_free == 0 && consumer_waiting.load()) {
+            std::lock_guard<std::mutex> l(m);
+            cv.notify_all();
+        }
+    }
+
+    // Lets the producer go on in a spill file in dir rather than wait for
+    // the consumer. Must be called before anything is pushed.
+    void set_spill_dir(const std::string &dir) { spill_dir = dir; }
+
+    // Marks the end of the data. Normally called by the producer, after
+    // this the consumer gives every block back once it has read them.
+    void shutdown() {
+        std::exception_ptr spill_error;
+        if(spill && cur_free < block_size) {
+            try {
+                spill->write(cur, block_size - cur_free);
+            } catch(...) {
+                // The queue must be closed anyway or the consumer waits forever.
+                spill_error = std::current_exception();
+            }
+            cur_free = block_size;
+        }
         {
-            std::unique_lock<std::mutex> l(m);
-            rv.reserve(buffer_size);
-            rv.swap(buffer);
-            if(st != QueueState::SHUTDOWN) {
-                set_state(l, QueueState::EMPTY);
+            std::lock_guard<std::mutex> l(m);
+            if(closed.load()) {
+                throw std::runtime_error("Trying to change the state of a closed queue.");
+            }
+            closed.store(true);
+            cv.notify_all();
+            if(listener) {
+                listener->notify();
             }
         }
+        if(char *b = spare.exchange(nullptr)) {
+            pool.release(b);
+        }
+        if(spill_error) {
+            std::rethrow_exception(spill_error);
+        }
+    }
+
+    // Consumer side.
+
+    // Waits until there is a complete block or the queue has been shut down
+    // and passes the data to the consumer function as an array of
+    // QueueBlocks. The blocks go back to the pool after the function
+    // returns. Returns false once all data of a closed queue has been read,
+    // what is left is then in spilled().
+    template<typename F> bool drain(F &&consume) {
+        const uint64_t next_full = (consumed / block_size + 1) * block_size;
+        wait_for_producer(
+            [this, next_full] { return closed.load() || written.load() >= next_full; });
+        if(closed.load() && consumed == written.load()) {
+            release_last();
+            return false;
+        }
+        consume_blocks(true, consume);
+        return true;
+    }
+
+    // Copies out everything that has been pushed so far.
+    std::vector<char> pop() {
+        std::vector<char> rv;
+        consume_blocks(false, [&rv](const QueueBlock *blocks, size_t count) {
+            for(size_t i = 0; i < count; ++i) {
+                rv.insert(rv.end(), blocks[i].data, blocks[i].data + blocks[i].size);
+            }
+        });
         return rv;
     }
 
     void wait_until_full_or_shutdown() const {
-        std::unique_lock<std::mutex> l(m);
-        while(!(st == QueueState::FULL || st == QueueState::SHUTDOWN)) {
-            cv.wait(l);
-        }
+        wait_for_producer([this] {
+            const QueueState st = state();
+            return st == QueueState::FULL || st == QueueState::SHUTDOWN;
+        });
     }
 
-    QueueState state(std::unique_lock<std::mutex> &) const { return st; }
+    // The data that did not fit in the ring, or null. Only valid after the
+    // queue has been shut down.
+    SpillFile *spilled() const { return spill.get(); }
+
+    // The amount of data pushed in total, including what was spilled. Only
+    // valid after the queue has been shut down.
+    uint64_t data_size() const { return written.load() + (spill ? spill->size() : 0); }
 
     QueueState state() const {
-        std::unique_lock<std::mutex> l(m);
-        return state(l);
+        if(closed.load()) {
+            return QueueState::SHUTDOWN;
+        }
+        const uint64_t queued = written.load() - read.load();
+        if(producer_waiting.load() || (!spilling.load() && queued >= capacity)) {
+            return QueueState::FULL;
+        }
+        return queued > 0 ? QueueState::HAS_DATA : QueueState::EMPTY;
     }
 
     int64_t queue_size() const { return buffer_size; }
 
-    void shutdown() {
-        std::unique_lock<std::mutex> l(m);
-        set_state(l, QueueState::SHUTDOWN);
+    // The listener is told whenever the producer has to wait or the queue
+    // is shut down.
+    void set_listener(Notifier *n) {
+        std::lock_guard<std::mutex> l(m);
+        listener = n;
     }
 
 private:
-    void push_internal(std::unique_lock<std::mutex> &l, const char *data, int64_t inbuf_size) {
-        int64_t pushed_so_far = 0;
-        while(pushed_so_far < inbuf_size) {
-            auto this_round_size =
-                std::min(buffer_size - (int64_t)buffer.size(), inbuf_size - pushed_so_far);
-            auto start_point = data + pushed_so_far;
-            auto end_point = start_point + this_round_size;
-            buffer.insert(buffer.end(), start_point, end_point);
-            pushed_so_far += this_round_size;
-            if((int64_t)buffer.size() == queue_size()) {
-                set_state(l, QueueState::FULL);
-                if(pushed_so_far == inbuf_size) {
-                    // Everything is in but we don't need to write any more
-                    // stuff. Return rather than blocking.
-                    return;
-                }
-                // Wait until someone grabs buffer contents.
-                while(st == QueueState::FULL) {
-                    cv.wait(l);
+    static constexpr int64_t DEFAULT_BLOCK_SIZE = 1024 * 1024;
+
+    ByteQueue(BufferPool *own, BufferPool &pool, const int64_t bsize)
+        : own_pool(own), pool(pool), block_size(pool.block_size()), buffer_size(bsize),
+          ring(std::max<int64_t>((bsize + block_size - 1) / block_size, 1), nullptr),
+          capacity(ring.size() * block_size) {}
+    ByteQueue(BufferPool *own, const int64_t bsize) : ByteQueue(own, *own, bsize) {}
+
+    // Puts an empty block at the head of the ring, or returns false if the
+    // queue was shut down while waiting.
+    bool next_block() {
+        while(!closed.load()) {
+            const uint64_t r = read.load();
+            const bool ring_full = produced - r + block_size > capacity;
+            char *b = nullptr;
+            if(!ring_full) {
+                b = spare.exchange(nullptr);
+                if(!b) {
+                    b = pool.try_acquire();
                 }
-                if(st == QueueState::SHUTDOWN) {
-                    return;
+            }
+            if(!b && !spill_dir.empty()) {
+                start_spill();
+                return true;
+            }
+            if(ring_full) {
+                wait_for_consumer(r);
+                continue;
+            }
+            if(!b) {
+                if(produced != r) {
+                    wait_for_consumer(r);
+                    continue;
                 }
-            } else {
-                set_state(l, QueueState::HAS_DATA);
+                // Nothing the consumer could give back, so wait for other
+                // queues to return blocks to the pool.
+                b = pool.acquire();
             }
+            ring[(produced / block_size) % ring.size()] = b;
+            cur = b;
+            cur_free = block_size;
+            return true;
         }
+        return false;
+    }
+
+    void start_spill() {
+        spill.reset(new SpillFile(spill_dir));
+        spill_buffer.reset(new char[block_size]);
+        cur = spill_buffer.get();
+        cur_free = block_size;
+        spilling.store(true);
     }
 
-    // The first argument is only to ensure that this is only called with a held
-    // lock.
-    void set_state(std::unique_lock<std::mutex> &, const QueueState new_state) {
-        const bool should_notify = new_state != st;
-        if(st == QueueState::SHUTDOWN) {
-            throw std::runtime_error("Trying to change the state of a closed queue.");
+    void wait_for_consumer(const uint64_t seen_read) {
+        std::unique_lock<std::mutex> l(m);
+        producer_waiting.store(true);
+        cv.notify_all();
+        if(listener) {
+            listener->notify();
         }
-        st = new_state;
-        if(should_notify) {
-            cv.notify_one();
+        cv.wait(l, [this, seen_read] { return read.load() != seen_read || closed.load(); });
+        producer_waiting.store(false);
+    }
+
+    template<typename P> void wait_for_producer(P &&ready) const {
+        if(ready()) {
+            return;
         }
+        std::unique_lock<std::mutex> l(m);
+        consumer_waiting.store(true);
+        cv.wait(l, ready);
+        consumer_waiting.store(false);
     }
 
+    template<typename F> void consume_blocks(const bool whole_blocks, F &&consume) {
+        const bool is_closed = closed.load();
+        const uint64_t w = written.load();
+        const uint64_t end = whole_blocks && !is_closed ? w - w % block_size : w;
+        if(end > consumed) {
+            batch.clear();
+            for(uint64_t pos = consumed; pos < end;) {
+                const uint64_t block_end = std::min((pos / block_size + 1) * block_size, end);
+                batch.push_back(QueueBlock{slot(pos) + pos % block_size, int64_t(block_end - pos)});
+                pos = block_end;
+            }
+            consume(batch.data(), batch.size());
+            for(uint64_t pos = consumed - consumed % block_size; pos + block_size <= end;
+                pos += block_size) {
+                recycle(slot(pos));
+                slot(pos) = nullptr;
+            }
+            consumed = end;
+            read.store(end);
+            if(producer_waiting.load()) {
+                std::lock_guard<std::mutex> l(m);
+                cv.notify_all();
+            }
+        }
+        if(is_closed && consumed == w) {
+            release_last();
+        }
+    }
+
+    // The producer is done, so the partially filled last block can go.
+    void release_last() {
+        char *&b = slot(consumed);
+        if(b) {
+            pool.release(b);
+            b = nullptr;
+        }
+    }
+
+    // Keeps one block for the producer and gives the rest back to the pool.
+    void recycle(char *b) {
+        char *expected = nullptr;
+        if(closed.load() || !spare.compare_exchange_strong(expected, b)) {
+            pool.release(b);
+        }
+    }
+
+    char *&slot(const uint64_t pos) { return ring[(pos / block_size) % ring.size()]; }
+
+    const std::unique_ptr<BufferPool> own_pool;
+    BufferPool &pool;
+    const int64_t block_size;
+    const int64_t buffer_size;
+    std::vector<char *> ring;
+    const uint64_t capacity;
+
+    // Only touched by the producer until the queue is closed.
+    char *cur = nullptr;
+    int64_t cur_free = 0;
+    uint64_t produced = 0;
+    std::string spill_dir;
+    std::unique_ptr<SpillFile> spill;
+    std::unique_ptr<char[]> spill_buffer;
+
+    // Only touched by the consumer.
+    uint64_t consumed = 0;
+    std::vector<QueueBlock> batch;
+
+    alignas(64) std::atomic<uint64_t> written{0};
+    alignas(64) std::atomic<uint64_t> read{0};
+    std::atomic<char *> spare{nullptr};
+    std::atomic<bool> closed{false};
+    std::atomic<bool> spilling{false};
+    std::atomic<bool> producer_waiting{false};
+    mutable std::atomic<bool> consumer_waiting{false};
     mutable std::mutex m;
     mutable std::condition_variable cv;
-    std::vector<char> buffer;
-    const int64_t buffer_size;
-    QueueState st = QueueState::EMPTY;
+    Notifier *listener = nullptr;
 };
@@ -20,6 +20,7 @@
 #include "fileutils.h"
 #include "mmapper.h"
 #include "taskcontrol.h"
+#include "threadpool.h"
 #include "utils.h"
 #include <portable_endian.h>
 
@@ -35,10 +36,13 @@
 #include <sys/sysmacros.h>
 #endif
 
+#include <algorithm>
 #include <cassert>
 
+#include <deque>
 #include <memory>
 #include <stdexcept>
+#include <vector>
 
 #include <cstdio>
 #include <zlib.h>
@@ -49,7 +53,76 @@ using std::min;
 
 namespace {
 
-compressresult store_file(const fileinfo &fi, ByteQueue &queue);
+// Input goes to the CRC and to the encoder in pieces of this size, so that
+// the encoder reads each piece from cache rather than from memory.
+const constexpr uint64_t CACHE_CHUNK = 256 * 1024;
+
+// Setting up an encoder costs more than compressing a small file, the LZMA
+// encoder alone allocates tens of megabytes. So every thread keeps one of
+// each and resets them between files.
+class EncoderCache final {
+public:
+    EncoderCache() {
+        zstrm.zalloc = Z_NULL;
+        zstrm.zfree = Z_NULL;
+        zstrm.opaque = Z_NULL;
+    }
+    EncoderCache(const EncoderCache &) = delete;
+    EncoderCache &operator=(const EncoderCache &) = delete;
+
+    ~EncoderCache() {
+        if(have_deflate) {
+            deflateEnd(&zstrm);
+        }
+#ifndef _WIN32
+        lzma_end(&lstrm);
+#endif
+    }
+
+    // A raw deflate encoder with the default settings.
+    z_stream &deflater() {
+        if(!have_deflate) {
+            const auto ret =
+                deflateInit2(&zstrm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+            if(ret != Z_OK) {
+                throw std::runtime_error("Zlib init failed.");
+            }
+            have_deflate = true;
+        } else if(deflateReset(&zstrm) != Z_OK) {
+            throw std::runtime_error("Zlib reset failed.");
+        }
+        return zstrm;
+    }
+
+#ifndef _WIN32
+    // Liblzma reuses the memory of the previous encoder if it is big enough.
+    lzma_stream &lzma_encoder(const lzma_filter *filter) {
+        if(lzma_raw_encoder(&lstrm, filter) != LZMA_OK) {
+            throw std::runtime_error("Could not create LZMA encoder.");
+        }
+        lstrm.next_in = nullptr;
+        lstrm.avail_in = 0;
+        return lstrm;
+    }
+#endif
+
+private:
+    z_stream zstrm;
+    bool have_deflate = false;
+#ifndef _WIN32
+    lzma_stream lstrm = LZMA_STREAM_INIT;
+#endif
+};
+
+thread_local EncoderCache encoders;
+
+template<typename Output> compressresult store_file(const fileinfo &fi, Output &out);
+
+void report_format(const FormatCallback &format_known, uint16_t cformat) {
+    if(format_known) {
+        format_known(cformat);
+    }
+}
 
 bool is_compressible(const unsigned char *buf, const size_t bufsize) {
     assert(bufsize > 0);
@@ -62,92 +135,219 @@ bool is_compressible(const unsigned char *buf, const size_t bufsize) {
     // Use zlib for compression test because it is a lot faster than LZMA.
     auto checkpoint =
         buf + bufsize / 2; // Files usually start with some compressible data like an index.
-    z_stream strm;
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    auto ret = deflateInit(&strm, -1);
-    if(ret != Z_OK) {
-        throw std::runtime_error("Zlib init failed.");
-    }
-    std::unique_ptr<z_stream, int (*)(z_stream *)> zcloser(&strm, deflateEnd);
+    z_stream &strm = encoders.deflater();
     strm.next_in = (unsigned char *)checkpoint; // Zlib is const-broken.
     strm.avail_in = blocksize;
     strm.next_out = out.get();
     strm.avail_out = 2 * blocksize;
-    ret = deflate(&strm, Z_FINISH);
-    if(ret != Z_STREAM_END) {
+    if(deflate(&strm, Z_FINISH) != Z_STREAM_END) {
         throw std::runtime_error("Zlib compression test failed.");
     }
     return ((double)strm.total_out) / blocksize < required_ratio;
 }
 
-compressresult compress_zlib(const fileinfo &fi, ByteQueue &queue, const TaskControl &tc) {
-    const int CHUNK = 1024 * 1024;
-    std::unique_ptr<unsigned char[]> out(new unsigned char[CHUNK]);
+template<typename Output>
+compressresult compress_zlib(const fileinfo &fi,
+                             Output &queue,
+                             const FormatCallback &format_known,
+                             const TaskControl &tc) {
     File infile(fi.fname, "rb");
     MMapper buf = infile.mmap();
-    z_stream strm;
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    auto ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
-    if(ret != Z_OK) {
-        throw std::runtime_error("Zlib init failed.");
+    unsigned char *data = buf;
+    const uint64_t size = buf.size();
+    if(size == 0 || !is_compressible(data, size)) {
+        report_format(format_known, ZIP_NO_COMPRESSION);
+        return store_file(fi, queue);
     }
-    std::unique_ptr<z_stream, int (*)(z_stream *)> zcloser(&strm, deflateEnd);
-    compressresult result{FILE_ENTRY, CRC32(buf, buf.size()), ZIP_DEFLATE, ""};
-    strm.avail_in = buf.size();
-    strm.next_in = buf;
-
+    report_format(format_known, ZIP_DEFLATE);
+    z_stream &strm = encoders.deflater();
+    int ret;
+    compressresult result{FILE_ENTRY, CRC32(nullptr, 0), ZIP_DEFLATE, ""};
+    uint64_t pos = 0;
     do {
-        strm.avail_out = CHUNK;
-        strm.next_out = out.get();
-        ret = deflate(&strm, Z_FINISH); /* no bad return value */
-        tc.throw_if_stopped();
-        assert(ret != Z_STREAM_ERROR); /* state not clobbered */
-        int write_size = CHUNK - strm.avail_out;
-        queue.push(out.get(), write_size);
-    } while(strm.avail_out == 0);
-    assert(strm.avail_in == 0); /* all input will be used */
+        const uint64_t step = min(CACHE_CHUNK, size - pos);
+        result.crc32 = CRC32(data + pos, step, result.crc32);
+        strm.next_in = data + pos;
+        strm.avail_in = step;
+        pos += step;
+        const int flush = pos == size ? Z_FINISH : Z_NO_FLUSH;
+        do {
+            // Compress straight into the queue.
+            strm.next_out = queue.space();
+            strm.avail_out = queue.space_size();
+            const uInt space_size = strm.avail_out;
+            ret = deflate(&strm, flush); /* no bad return value */
+            queue.commit(space_size - strm.avail_out);
+            tc.throw_if_stopped();
+            assert(ret != Z_STREAM_ERROR); /* state not clobbered */
+        } while(strm.avail_in > 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+    } while(pos < size);
+
+    return result;
+}
+
+// The segment index of a file must fit in the extra field of its central
+// header along with the other blocks there.
+const constexpr uint64_t MAX_SEGMENTS = 8000;
+
+struct deflateblock {
+    std::vector<unsigned char> data;
+    uint64_t input_size;
+    uint32_t crc32;
+};
 
-    /* done when last data in file processed */
-    assert(ret == Z_STREAM_END); /* stream will be complete */
+// Deflates one block of a larger file so that the results can be concatenated
+// into a single raw deflate stream. The previous 32k of input is used as the
+// dictionary to keep the compression ratio close to that of a single stream.
+deflateblock deflate_block(const unsigned char *block,
+                           uint64_t block_size,
+                           const unsigned char *dict,
+                           uint64_t dict_size,
+                           bool last,
+                           const TaskControl &tc) {
+    tc.throw_if_stopped();
+    z_stream &strm = encoders.deflater();
+    if(dict_size > 0 && deflateSetDictionary(&strm, dict, dict_size) != Z_OK) {
+        throw std::runtime_error("Could not set deflate dictionary.");
+    }
+    deflateblock result;
+    result.input_size = block_size;
+    result.crc32 = CRC32(nullptr, 0);
+    // A sync flush ends the block on a byte boundary without setting the
+    // last block bit. It adds at most a few bytes over the bound.
+    result.data.resize(deflateBound(&strm, block_size) + 16);
+    strm.next_out = result.data.data();
+    strm.avail_out = result.data.size();
+    uint64_t pos = 0;
+    do {
+        const uint64_t step = std::min(CACHE_CHUNK, block_size - pos);
+        result.crc32 = CRC32(block + pos, step, result.crc32);
+        strm.next_in = const_cast<unsigned char *>(block + pos); // Zlib is const-broken.
+        strm.avail_in = step;
+        pos += step;
+        const int flush = pos < block_size ? Z_NO_FLUSH : last ? Z_FINISH : Z_SYNC_FLUSH;
+        const int ret = deflate(&strm, flush);
+        const int expected = flush == Z_FINISH ? Z_STREAM_END : Z_OK;
+        if(ret != expected || strm.avail_in != 0) {
+            throw std::runtime_error("Parallel deflate of block failed.");
+        }
+    } while(pos < block_size);
+    result.data.resize(result.data.size() - strm.avail_out);
+    return result;
+}
 
+// Pigz style compression of one big file on all threads of the pool.
+compressresult compress_zlib_parallel(const fileinfo &fi,
+                                      ByteQueue &queue,
+                                      const PackOptions &opts,
+                                      ThreadPool &pool,
+                                      const FormatCallback &format_known,
+                                      const TaskControl &tc) {
+    const uint64_t DICT_SIZE = 32 * 1024;
+    File infile(fi.fname, "rb");
+    MMapper buf = infile.mmap();
+    const unsigned char *data = buf;
+    const uint64_t size = buf.size();
+    if(size == 0 || !is_compressible(data, size)) {
+        report_format(format_known, ZIP_NO_COMPRESSION);
+        return store_file(fi, queue);
+    }
+    report_format(format_known, ZIP_DEFLATE);
+    uint64_t block_size = std::max(opts.parallel_block_size, DICT_SIZE);
+    if(opts.independent_blocks) {
+        block_size = std::max(block_size, (size + MAX_SEGMENTS - 1) / MAX_SEGMENTS);
+    }
+    bool segments_fit = true;
+    // Enough blocks in flight to keep every thread busy while the
+    // finished ones are being written out in order.
+    const size_t max_in_flight = 2 * pool.size();
+    std::deque<ForkedTask<deflateblock>> in_flight;
+    uint64_t next_block = 0;
+    compressresult result{FILE_ENTRY, CRC32(nullptr, 0), ZIP_DEFLATE, ""};
+    try {
+        while(next_block < size || !in_flight.empty()) {
+            while(next_block < size && in_flight.size() < max_in_flight) {
+                const uint64_t this_size = std::min(block_size, size - next_block);
+                const uint64_t dict_size =
+                    opts.independent_blocks ? 0 : std::min(next_block, DICT_SIZE);
+                const bool last = next_block + this_size == size;
+                in_flight.emplace_back(pool.fork([=, &tc]() {
+                    return deflate_block(data + next_block,
+                                         this_size,
+                                         data + next_block - dict_size,
+                                         dict_size,
+                                         last,
+                                         tc);
+                }));
+                next_block += this_size;
+            }
+            auto block = in_flight.front().join();
+            in_flight.pop_front();
+            result.crc32 = crc32_combine(result.crc32, block.crc32, block.input_size);
+            if(opts.independent_blocks) {
+                segments_fit = segments_fit && block.data.size() <= UINT32_MAX;
+                result.segments.segments.push_back(
+                    deflatesegment{(uint32_t)block.data.size(), block.crc32});
+            }
+            queue.push(block.data.data(), block.data.size());
+        }
+    } catch(...) {
+        // The blocks point to the mapping, they must be done before it goes away.
+        for(auto &t : in_flight) {
+            t.wait();
+        }
+        throw;
+    }
+    if(segments_fit) {
+        result.segments.segment_size = block_size;
+    } else {
+        result.segments.segments.clear();
+    }
     return result;
 }
 
 #ifdef _WIN32
-compressresult compress_lzma(const fileinfo &fi, ByteQueue &queue, const TaskControl &tc) {
+template<typename Output>
+compressresult compress_lzma(const fileinfo &fi,
+                             Output &queue,
+                             const FormatCallback &format_known,
+                             const TaskControl &tc) {
     throw std::runtime_error("Liblzma does not work with VS.");
 }
 
 #else
 
-compressresult compress_lzma(const fileinfo &fi, ByteQueue &queue, const TaskControl &tc) {
-    const int CHUNK = 1024 * 1024;
+template<typename Output>
+compressresult compress_lzma(const fileinfo &fi,
+                             Output &queue,
+                             const FormatCallback &format_known,
+                             const TaskControl &tc) {
     File infile(fi.fname, "rb");
     MMapper buf = infile.mmap();
     if(!is_compressible(buf, buf.size())) {
+        report_format(format_known, ZIP_NO_COMPRESSION);
         return store_file(fi, queue);
     }
-    std::unique_ptr<unsigned char[]> out(new unsigned char[CHUNK]);
+    report_format(format_known, ZIP_LZMA);
     uint32_t filter_size;
-    compressresult result{FILE_ENTRY, CRC32(buf, buf.size()), ZIP_LZMA, ""};
+    compressresult result{FILE_ENTRY, CRC32(nullptr, 0), ZIP_LZMA, ""};
     lzma_options_lzma opt_lzma;
-    lzma_stream strm = LZMA_STREAM_INIT;
     if(lzma_lzma_preset(&opt_lzma, LZMA_PRESET_DEFAULT)) {
         throw std::runtime_error("Unsupported LZMA preset.");
     }
+    // A dictionary bigger than the file does not compress any better, but
+    // it takes longer to set up.
+    uint32_t dict_size = LZMA_DICT_SIZE_MIN;
+    while(dict_size < opt_lzma.dict_size && dict_size < buf.size()) {
+        dict_size *= 2;
+    }
+    opt_lzma.dict_size = std::min(dict_size, opt_lzma.dict_size);
     lzma_filter filter[2];
     filter[0].id = LZMA_FILTER_LZMA1;
     filter[0].options = &opt_lzma;
     filter[1].id = LZMA_VLI_UNKNOWN;
 
-    lzma_ret ret = lzma_raw_encoder(&strm, filter);
-    if(ret != LZMA_OK) {
-        throw std::runtime_error("Could not create LZMA encoder.");
-    }
+    lzma_stream &strm = encoders.lzma_encoder(filter);
     if(lzma_properties_size(&filter_size, filter) != LZMA_OK) {
         throw std::runtime_error("Could not determine LZMA properties size.");
     } else {
@@ -166,27 +366,29 @@ compressresult compress_lzma(const fileinfo &fi, ByteQueue &queue, const TaskCon
         queue.push((char *)&lefilter, sizeof(lefilter));
         queue.push(x.data(), x.size());
     }
-    std::unique_ptr<lzma_stream, void (*)(lzma_stream *)> lcloser(&strm, lzma_end);
-
-    strm.avail_in = buf.size();
-    strm.next_in = buf;
+    const unsigned char *data = buf;
+    const uint64_t size = buf.size();
+    uint64_t pos = 0;
     /* compress until data ends */
     lzma_action action = LZMA_RUN;
     while(true) {
-        if(strm.total_in >= buf.size()) {
-            action = LZMA_FINISH;
-        } else {
-            strm.avail_out = CHUNK;
-            strm.next_out = out.get();
+        if(strm.avail_in == 0 && action == LZMA_RUN) {
+            const uint64_t step = min(CACHE_CHUNK, size - pos);
+            result.crc32 = CRC32(data + pos, step, result.crc32);
+            strm.next_in = data + pos;
+            strm.avail_in = step;
+            pos += step;
+            if(pos == size) {
+                action = LZMA_FINISH;
+            }
         }
-        ret = lzma_code(&strm, action);
+        // Compress straight into the queue.
+        strm.next_out = queue.space();
+        strm.avail_out = queue.space_size();
+        const size_t space_size = strm.avail_out;
+        const lzma_ret ret = lzma_code(&strm, action);
+        queue.commit(space_size - strm.avail_out);
         tc.throw_if_stopped();
-        if(strm.avail_out == 0 || ret == LZMA_STREAM_END) {
-            size_t write_size = CHUNK - strm.avail_out;
-            queue.push(out.get(), write_size);
-            strm.next_out = out.get();
-            strm.avail_out = CHUNK;
-        }
 
         if(ret != LZMA_OK) {
             if(ret == LZMA_STREAM_END) {
@@ -201,26 +403,31 @@ compressresult compress_lzma(const fileinfo &fi, ByteQueue &queue, const TaskCon
 
 #endif
 
-compressresult store_file(const fileinfo &fi, ByteQueue &queue) {
+template<typename Output> compressresult store_file(const fileinfo &fi, Output &queue) {
     FILE *f = fopen(fi.fname.c_str(), "r");
     if(!f) {
         throw_system("Could not open input file: ");
     }
     File infile(f);
 
-    compressresult result{FILE_ENTRY, (uint32_t)-1, ZIP_NO_COMPRESSION, ""};
+    compressresult result{FILE_ENTRY, CRC32(nullptr, 0), ZIP_NO_COMPRESSION, ""};
     auto mmap = infile.mmap();
-    result.crc32 = CRC32(mmap, mmap.size());
-    queue.push(mmap, mmap.size());
+    const unsigned char *data = mmap;
+    for(uint64_t pos = 0; pos < mmap.size(); pos += CACHE_CHUNK) {
+        const uint64_t step = min(CACHE_CHUNK, mmap.size() - pos);
+        result.crc32 = CRC32(data + pos, step, result.crc32);
+        queue.push(data + pos, step);
+    }
     return result;
 }
 
-compressresult create_dir(const fileinfo &, ByteQueue &) {
+template<typename Output> compressresult create_dir(const fileinfo &, Output &) {
     compressresult r{DIRECTORY_ENTRY, CRC32(nullptr, 0), ZIP_NO_COMPRESSION, ""};
     return r;
 }
 
-compressresult create_symlink(const fileinfo &fi, ByteQueue &queue) {
+template<typename Output>
+compressresult create_symlink(const fileinfo &fi, Output &queue) {
 #ifdef _WIN32
     throw std::runtime_error("Symlinks not supported on Windows.");
 #else
@@ -250,7 +457,7 @@ compressresult create_symlink(const fileinfo &fi, ByteQueue &queue) {
 }
 
 #ifndef _WIN32
-compressresult create_chrdev(const fileinfo &fi, ByteQueue &) {
+template<typename Output> compressresult create_chrdev(const fileinfo &fi, Output &) {
     std::string buf(8, 'x');
     FILE *tf = tmpfile();
     if(!tf) {
@@ -271,28 +478,63 @@ compressresult create_chrdev(const fileinfo &fi, ByteQueue &) {
 }
 #endif
 
-} // namespace
-
-compressresult
-compress_entry(const fileinfo &f, ByteQueue &queue, bool use_lzma, const TaskControl &tc) {
+// Everything but the parallel compression of big files, which only makes
+// sense when streaming.
+template<typename Output>
+compressresult compress_single(const fileinfo &f,
+                               Output &out,
+                               bool use_lzma,
+                               const FormatCallback &format_known,
+                               const TaskControl &tc) {
     if(S_ISREG(f.mode)) {
         if(f.fsize < TOO_SMALL_FOR_LZMA) {
-            return store_file(f, queue);
+            report_format(format_known, ZIP_NO_COMPRESSION);
+            return store_file(f, out);
         }
-        return use_lzma ? compress_lzma(f, queue, tc) : compress_zlib(f, queue, tc);
+        if(use_lzma) {
+            return compress_lzma(f, out, format_known, tc);
+        }
+        return compress_zlib(f, out, format_known, tc);
     }
     if(S_ISDIR(f.mode)) {
-        return create_dir(f, queue);
+        return create_dir(f, out);
     }
     if(S_ISLNK(f.mode)) {
-        return create_symlink(f, queue);
+        return create_symlink(f, out);
     }
 #ifndef _WIN32
     if(S_ISCHR(f.mode)) {
-        return create_chrdev(f, queue);
+        return create_chrdev(f, out);
     }
 #endif
     std::string error("Unknown file type: ");
     error += f.fname;
     throw std::runtime_error(error);
 }
+
+} // namespace
+
+compressresult compress_entry(const fileinfo &f,
+                              ByteQueue &queue,
+                              bool use_lzma,
+                              const PackOptions &opts,
+                              ThreadPool &pool,
+                              const TaskControl &tc,
+                              const FormatCallback &format_known) {
+    // One huge file would otherwise keep a single core busy long after
+    // everything else is done, so it gets deflated on all of them. The
+    // choice does not depend on the number of threads, so neither does the
+    // archive. With one thread the blocks are deflated as they are joined.
+    if(S_ISREG(f.mode) && f.fsize >= TOO_SMALL_FOR_LZMA && opts.parallel_threshold > 0 &&
+       f.fsize >= opts.parallel_threshold) {
+        return compress_zlib_parallel(f, queue, opts, pool, format_known, tc);
+    }
+    return compress_single(f, queue, use_lzma, format_known, tc);
+}
+
+compressresult compress_entry(const fileinfo &f,
+                              OutputArena &arena,
+                              bool use_lzma,
+                              const TaskControl &tc) {
+    return compress_single(f, arena, use_lzma, nullptr, tc);
+}
@@ -20,17 +20,60 @@
 #include "file.h"
 #include "zipdefs.h"
 #include "bytequeue.hpp"
+#include "outputarena.hpp"
 
+#include <functional>
 #include <string>
 
 class TaskControl;
+class ThreadPool;
+
+struct PackOptions {
+    // Regular files at least this big are cut into blocks that are deflated
+    // in parallel into one stream. Zero disables this.
+    uint64_t parallel_threshold = 256 * 1024 * 1024;
+    uint64_t parallel_block_size = 4 * 1024 * 1024;
+    // Makes the blocks of parallel deflated files independent of each
+    // other and lists them in the central header, so that they can also be
+    // inflated in parallel. Costs a little in compression ratio.
+    bool independent_blocks = false;
+    // Entries smaller than this are compressed in batches of at most
+    // batch_max_files entries and batch_max_bytes of input, one batch per
+    // thread at a time. Zero disables this.
+    uint64_t batch_file_size = 64 * 1024;
+    uint64_t batch_max_files = 256;
+    uint64_t batch_max_bytes = 1024 * 1024;
+    // Entries are launched in priority order among at most this many that
+    // have been found but not launched yet.
+    uint64_t scan_window = 10000;
+    // Upper limit for compressed data waiting to be written to the archive.
+    uint64_t memory_limit = sizeof(void *) > 4 ? 1024 * 1024 * 1024 : 128 * 1024 * 1024;
+};
 
 struct compressresult {
     filetype entrytype;
     uint32_t crc32;
     uint16_t cformat;
     std::string additional_unix_extra_data;
+    // Independently deflated blocks, for the central header.
+    segmentindex segments = {};
 };
 
-compressresult
-compress_entry(const fileinfo &f, ByteQueue &queue, bool use_lzma, const TaskControl &tc);
+// Gets the compression method of a regular file before any of its data is
+// pushed to the queue, so that its local header can go out while it is
+// still being compressed.
+typedef std::function<void(uint16_t cformat)> FormatCallback;
+
+compressresult compress_entry(const fileinfo &f,
+                              ByteQueue &queue,
+                              bool use_lzma,
+                              const PackOptions &opts,
+                              ThreadPool &pool,
+                              const TaskControl &tc,
+                              const FormatCallback &format_known = nullptr);
+
+// For entries that are compressed in batches. All of them go to the same arena.
+compressresult compress_entry(const fileinfo &f,
+                              OutputArena &arena,
+                              bool use_lzma,
+                              const TaskControl &tc);
@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The carry-less multiplication kernel follows "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction" by Gopal et al. (Intel,
+ * 2009) and the implementation of it in Chromium's zlib. */
+
+#include "crc.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define PARZIP_CRC_PCLMUL
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#define PARZIP_CRC_ARM
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+namespace {
+
+// Zlib counts in uInt so it gets fed at most this much at a time.
+const constexpr uint64_t MAX_ZLIB_STEP = 1024 * 1024 * 1024;
+
+uint32_t crc32_zlib(uint32_t crc, const unsigned char *buf, uint64_t size) {
+    while(size > 0) {
+        const uInt step = std::min(size, MAX_ZLIB_STEP);
+        crc = crc32(crc, buf, step);
+        buf += step;
+        size -= step;
+    }
+    return crc;
+}
+
+#ifdef PARZIP_CRC_PCLMUL
+
+bool has_pclmul() {
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+
+// Works on the bit-inverted CRC and a multiple of 16 bytes, at least 64.
+__attribute__((target("pclmul,sse4.1"))) uint32_t fold_pclmul(const unsigned char *buf,
+                                                              uint64_t size,
+                                                              uint32_t crc) {
+    // The constants for the reflected IEEE polynomial from the paper.
+    alignas(16) static const uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+    alignas(16) static const uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+    alignas(16) static const uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+    alignas(16) static const uint64_t poly[] = {0x01db710641, 0x01f7011641};
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x00));
+    x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x10));
+    x3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x20));
+    x4 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k1k2));
+    buf += 64;
+    size -= 64;
+
+    // Fold four lanes of 128 bits in parallel.
+    while(size >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x00));
+        y6 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x10));
+        y7 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x20));
+        y8 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        size -= 64;
+    }
+
+    // Fold the lanes into one.
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k3k4));
+    for(const __m128i next : {x2, x3, x4}) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, next), x5);
+    }
+    while(size >= 16) {
+        x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf));
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        size -= 16;
+    }
+
+    // 128 bits to 64.
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(k5k0));
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits.
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(poly));
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+
+uint32_t crc32_pclmul(uint32_t crc, const unsigned char *buf, uint64_t size) {
+    if(size >= 64) {
+        const uint64_t bulk = size & ~uint64_t(15);
+        crc = ~fold_pclmul(buf, bulk, ~crc);
+        buf += bulk;
+        size -= bulk;
+    }
+    return crc32_zlib(crc, buf, size);
+}
+
+#endif
+
+#ifdef PARZIP_CRC_ARM
+
+bool has_arm_crc() { return getauxval(AT_HWCAP) & HWCAP_CRC32; }
+
+__attribute__((target("+crc"))) uint32_t crc32_arm(uint32_t crc,
+                                                    const unsigned char *buf,
+                                                    uint64_t size) {
+    crc = ~crc;
+    while(size > 0 && (reinterpret_cast<uintptr_t>(buf) & 7) != 0) {
+        crc = __crc32b(crc, *buf++);
+        --size;
+    }
+    while(size >= 8) {
+        uint64_t v;
+        memcpy(&v, buf, sizeof(v));
+        crc = __crc32d(crc, v);
+        buf += 8;
+        size -= 8;
+    }
+    while(size > 0) {
+        crc = __crc32b(crc, *buf++);
+        --size;
+    }
+    return ~crc;
+}
+
+#endif
+
+crc32_func pick_engine() { return crc32_engines().front().func; }
+
+} // namespace
+
+std::vector<Crc32Engine> crc32_engines() {
+    std::vector<Crc32Engine> engines;
+#ifdef PARZIP_CRC_PCLMUL
+    if(has_pclmul()) {
+        engines.push_back(Crc32Engine{"pclmul", crc32_pclmul});
+    }
+#endif
+#ifdef PARZIP_CRC_ARM
+    if(has_arm_crc()) {
+        engines.push_back(Crc32Engine{"armv8-crc", crc32_arm});
+    }
+#endif
+    engines.push_back(Crc32Engine{"zlib", crc32_zlib});
+    return engines;
+}
+
+uint32_t crc32_update(uint32_t crc, const unsigned char *buf, uint64_t size) {
+    static const crc32_func engine = pick_engine();
+    return engine(crc, buf, size);
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Continues a CRC-32 the same way zlib's crc32() does.
+typedef uint32_t (*crc32_func)(uint32_t crc, const unsigned char *buf, uint64_t size);
+
+struct Crc32Engine {
+    const char *name;
+    crc32_func func;
+};
+
+// The CRC-32 implementations this CPU can run, fastest first. The last one
+// is always plain zlib.
+std::vector<Crc32Engine> crc32_engines();
+
+// Uses the fastest engine, picked on first use.
+uint32_t crc32_update(uint32_t crc, const unsigned char *buf, uint64_t size);
@@ -25,9 +25,14 @@
 
 #include "file.h"
 #include "fileutils.h"
+#include "mmapper.h"
+#include "outputsink.h"
+#include "parallelinflate.h"
 #include "taskcontrol.h"
+#include "threadpool.h"
 #include "utils.h"
 #include "zipdefs.h"
+#include "zipparse.h"
 
 #include "portable_endian.h"
 #include <zlib.h>
@@ -36,6 +41,8 @@
 #include <windows.h>
 #else
 #include <lzma.h> // Disabled on Windows because libxz does not compile with MSVC.
+#include <fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <utime.h>
@@ -44,32 +51,99 @@
 #include <cstdint>
 
 #if defined(__linux__)
+#include <linux/fs.h>
 #include <sys/sysmacros.h>
 #endif
 
 #include <cassert>
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include <memory>
 #include <stdexcept>
-
-#define CHUNK 1024 * 1024
+#include <vector>
 
 namespace {
 
-uint32_t inflate_to_file(const unsigned char *data_start,
+// Outputs at least this big are decoded straight into a mapping of the
+// output file. For smaller ones the mmap calls cost more than the copy.
+const constexpr uint64_t MIN_MAPPED_OUTPUT = 64 * 1024;
+
+// Stored entries at least this big are copied within the kernel, in
+// steps of at most MAX_COPY_STEP so that stopping is not delayed.
+const constexpr uint64_t MIN_KERNEL_COPY = 64 * 1024;
+const constexpr uint64_t MAX_COPY_STEP = 64 * 1024 * 1024;
+
+// Zlib counts in uInt so it gets fed at most this much at a time.
+const constexpr uint64_t MAX_ZLIB_STEP = 1024 * 1024 * 1024;
+
+// Deflate can not expand data more than this, however it is encoded.
+const constexpr uint64_t MAX_DEFLATE_RATIO = 1032;
+
+uint32_t inflate_to_sink(const unsigned char *data_start,
                          uint64_t data_size,
-                         FILE *ofile,
+                         OutputSink &out,
                          const TaskControl &tc);
-uint32_t lzma_to_file(const unsigned char *data_start,
+
+/*
+ * Every thread keeps its decoder state from one entry to the next, so
+ * that decoding a small entry does not allocate and free the window and
+ * tables again. Entries are decoded on many threads at once and each
+ * decoding runs on one thread from start to end.
+ */
+class InflateState final {
+public:
+    ~InflateState() {
+        if(ready) {
+            inflateEnd(&strm);
+        }
+    }
+
+    z_stream &start() {
+        if(ready) {
+            if(inflateReset(&strm) != Z_OK) {
+                throw std::runtime_error("Could not reset zlib.");
+            }
+            return strm;
+        }
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+        strm.avail_in = 0;
+        strm.next_in = Z_NULL;
+        if(inflateInit2(&strm, -15) != Z_OK) {
+            throw std::runtime_error("Could not init zlib.");
+        }
+        ready = true;
+        return strm;
+    }
+
+private:
+    z_stream strm;
+    bool ready = false;
+};
+
+thread_local InflateState thread_inflate;
+
+#ifndef _WIN32
+// Initializing a raw decoder on a used stream reuses its memory.
+struct LzmaState {
+    ~LzmaState() { lzma_end(&strm); }
+
+    lzma_stream strm = LZMA_STREAM_INIT;
+};
+
+thread_local LzmaState thread_lzma;
+#endif
+uint32_t lzma_to_sink(const unsigned char *data_start,
                       uint64_t data_size,
-                      FILE *ofile,
+                      OutputSink &out,
                       const TaskControl &tc);
-uint32_t unstore_to_file(const unsigned char *data_start,
+uint32_t unstore_to_sink(const unsigned char *data_start,
                          uint64_t data_size,
-                         FILE *ofile,
+                         OutputSink &out,
                          const TaskControl &tc);
 
 /* Decompress from file source to file dest until stream ends or EOF.
@@ -78,83 +152,61 @@ uint32_t unstore_to_file(const unsigned char *data_start,
    invalid or incomplete, Z_VERSION_ERROR if the version of zlib.h and
    the version of the library linked do not match, or Z_ERRNO if there
    is an error reading or writing the files. */
-uint32_t inflate_to_file(const unsigned char *data_start,
+uint32_t inflate_to_sink(const unsigned char *data_start,
                          uint64_t data_size,
-                         FILE *ofile,
+                         OutputSink &out,
                          const TaskControl &tc) {
-    uint32_t crcvalue = crc32(0, Z_NULL, 0);
     int ret;
-    unsigned have;
-    z_stream strm;
-    const unsigned char *current = data_start;
-    std::unique_ptr<unsigned char[]> out(new unsigned char[CHUNK]);
-
-    /* allocate inflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-    ret = inflateInit2(&strm, -15);
-    if(ret != Z_OK)
-        throw std::runtime_error("Could not init zlib.");
-    std::unique_ptr<z_stream, int (*)(z_stream_s *)> zcloser(&strm, inflateEnd);
-
-    /* decompress until deflate stream ends or end of file */
-    strm.avail_in = data_size;
-    strm.next_in = const_cast<unsigned char *>(current); // zlib header is const-broken
+    z_stream &strm = thread_inflate.start();
+    uint64_t remaining = data_size;
+
+    strm.next_in = const_cast<unsigned char *>(data_start); // zlib header is const-broken
+    /* decompress until deflate stream ends or no progress is possible */
     do {
-        if(strm.total_in >= data_size) {
-            break;
+        if(strm.avail_in == 0) {
+            strm.avail_in = std::min(remaining, MAX_ZLIB_STEP);
+            remaining -= strm.avail_in;
         }
-
-        /* run inflate() on input until output buffer not full */
-        do {
-            strm.avail_out = CHUNK;
-            strm.next_out = out.get();
-            ret = inflate(&strm, Z_NO_FLUSH);
-            tc.throw_if_stopped();
-            assert(ret != Z_STREAM_ERROR); /* state not clobbered */
-            switch(ret) {
-            case Z_NEED_DICT:
-            case Z_DATA_ERROR:
-            case Z_MEM_ERROR:
-                throw std::runtime_error(strm.msg);
-            }
-            have = CHUNK - strm.avail_out;
-            crcvalue = crc32(crcvalue, out.get(), have);
-            if(fwrite(out.get(), 1, have, ofile) != have || ferror(ofile)) {
-                throw_system("Could not write to file:");
+        const uInt space = std::min(out.space_size(), MAX_ZLIB_STEP);
+        strm.avail_out = space;
+        strm.next_out = out.space();
+        ret = inflate(&strm, Z_NO_FLUSH);
+        tc.throw_if_stopped();
+        assert(ret != Z_STREAM_ERROR); /* state not clobbered */
+        switch(ret) {
+        case Z_NEED_DICT:
+        case Z_DATA_ERROR:
+        case Z_MEM_ERROR:
+            throw std::runtime_error(strm.msg);
+        }
+        out.commit(space - strm.avail_out);
+        if(ret == Z_BUF_ERROR) {
+            // Either the input ran out, which the CRC check catches, or
+            // there is more output than room for it.
+            if(out.full()) {
+                out.set_overflow();
             }
-        } while(strm.avail_out == 0);
-        /* done when inflate() says it's done */
-    } while(ret != Z_STREAM_END);
-    /*
-        if(Z_STREAM_END != Z_OK) {
-            throw std::runtime_error("Decompression failed.");
+            break;
         }
-    */
-    return crcvalue;
+    } while(ret != Z_STREAM_END);
+    return out.crc();
 }
 
 #ifdef _WIN32
-uint32_t lzma_to_file(const unsigned char *data_start,
+uint32_t lzma_to_sink(const unsigned char *data_start,
                       uint64_t data_size,
-                      FILE *ofile,
+                      OutputSink &out,
                       const TaskControl &tc) {
     throw std::runtime_error("LZMA not supported on Windows.");
 }
 
 #else
-uint32_t lzma_to_file(const unsigned char *data_start,
+uint32_t lzma_to_sink(const unsigned char *data_start,
                       uint64_t data_size,
-                      FILE *ofile,
+                      OutputSink &out,
                       const TaskControl &tc) {
-    uint32_t crcvalue = crc32(0, Z_NULL, 0);
-    std::unique_ptr<unsigned char[]> out(new unsigned char[CHUNK]);
-    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_stream &strm = thread_lzma.strm;
     lzma_filter filter[2];
-    unsigned int have;
 
     size_t offset = 2;
     uint16_t properties_size = le16toh(*reinterpret_cast<const uint16_t *>(data_start + offset));
@@ -172,45 +224,42 @@ uint32_t lzma_to_file(const unsigned char *data_start,
     if(ret != LZMA_OK) {
         throw std::runtime_error("Could not initialize LZMA decoder.");
     }
-    std::unique_ptr<lzma_stream, void (*)(lzma_stream *)> lcloser(&strm, lzma_end);
 
-    const unsigned char *current = data_start + offset;
     strm.avail_in = (size_t)(data_size - offset);
-    strm.next_in = current;
+    strm.next_in = data_start + offset;
     /* decompress until data ends */
     do {
-        if(strm.total_in == data_size - offset)
+        const uint64_t space = out.space_size();
+        strm.avail_out = space;
+        strm.next_out = out.space();
+        ret = lzma_code(&strm, LZMA_RUN);
+        tc.throw_if_stopped();
+        if(ret == LZMA_BUF_ERROR && out.full()) {
+            out.set_overflow();
             break;
-
-        do {
-            strm.avail_out = CHUNK;
-            strm.next_out = out.get();
-            ret = lzma_code(&strm, LZMA_RUN);
-            tc.throw_if_stopped();
-            if(ret != LZMA_OK && ret != LZMA_STREAM_END) {
-                throw std::runtime_error("Decompression failed.");
-            }
-            have = CHUNK - strm.avail_out;
-            crcvalue = crc32(crcvalue, out.get(), have);
-            if(fwrite(out.get(), 1, have, ofile) != have || ferror(ofile)) {
-                throw_system("Could not write to file:");
-            }
-        } while(strm.avail_out == 0);
-    } while(true);
-    return crcvalue;
+        }
+        if(ret != LZMA_OK && ret != LZMA_STREAM_END) {
+            throw std::runtime_error("Decompression failed.");
+        }
+        out.commit(space - strm.avail_out);
+        // Streams without an end marker are done when the input is. Output
+        // may still be pending if the last call filled the buffer.
+    } while(ret != LZMA_STREAM_END &&
+            (strm.avail_in > 0 || (strm.avail_out == 0 && !out.full())));
+    return out.crc();
 }
 #endif
 
-uint32_t unstore_to_file(const unsigned char *data_start,
+uint32_t unstore_to_sink(const unsigned char *data_start,
                          uint64_t data_size,
-                         FILE *ofile,
+                         OutputSink &out,
                          const TaskControl &tc) {
     tc.throw_if_stopped();
-    auto bytes_written = fwrite(data_start, 1, data_size, ofile);
-    if(bytes_written != data_size) {
-        throw_system("Could not write file fully:");
+    out.write(data_start, data_size);
+    if(out.total() != data_size) {
+        out.set_overflow();
     }
-    return CRC32(data_start, data_size);
+    return out.crc();
 }
 
 void create_symlink(const unsigned char *data_start,
@@ -224,52 +273,235 @@ void create_symlink(const unsigned char *data_start,
 #endif
 }
 
-void create_file(const localheader &lh,
-                 const centralheader &ch,
-                 const unsigned char *data_start,
-                 uint64_t data_size,
+bool use_parallel_inflate(const centralview &ch,
+                          uint64_t data_size,
+                          const UnpackOptions &opts,
+                          const ThreadPool *pool) {
+#ifdef _WIN32
+    return false;
+#else
+    return ch.compression_method == ZIP_DEFLATE && opts.parallel_threshold > 0 &&
+           data_size >= opts.parallel_threshold && pool && pool->size() > 1;
+#endif
+}
+
+// Entries that parzip deflated in independent segments are inflated in
+// parallel regardless of their size, since it costs nothing extra.
+bool use_segmented_inflate(const centralview &ch,
+                           const UnpackOptions &opts,
+                           const ThreadPool *pool,
+                           segmentindex &segments) {
+#ifdef _WIN32
+    return false;
+#else
+    return opts.parallel_threshold > 0 && pool && pool->size() > 1 &&
+           unpack_segments(ch, segments) && segments.segments.size() > 1;
+#endif
+}
+
+// Shares the whole blocks at the start of the entry with the archive.
+// Returns how many bytes were cloned.
+uint64_t clone_blocks(const EntryData &entry, int out_fd) {
+#ifdef FICLONERANGE
+    struct stat st;
+    if(fstat(entry.fd, &st) != 0 || st.st_blksize <= 0) {
+        return 0;
+    }
+    const uint64_t block = st.st_blksize;
+    const uint64_t length = entry.size / block * block;
+    if(entry.offset % block != 0 || length == 0) {
+        return 0;
+    }
+    struct file_clone_range range;
+    range.src_fd = entry.fd;
+    range.src_offset = entry.offset;
+    range.src_length = length;
+    range.dest_offset = 0;
+    if(ioctl(out_fd, FICLONERANGE, &range) != 0) {
+        return 0;
+    }
+    return length;
+#else
+    (void)entry;
+    (void)out_fd;
+    return 0;
+#endif
+}
+
+/*
+ * Copies a stored entry from the archive within the kernel, reflinking
+ * it if the file system can. Meanwhile the CRC is computed from the
+ * mapping of the archive, unless the options say to trust it. Returns
+ * false if the entry is not stored or the kernel can not copy it.
+ */
+bool copy_stored(const centralview &ch,
+                 const EntryData &entry,
+                 File &ofile,
+                 const UnpackOptions &opts,
+                 ThreadPool *pool,
+                 const TaskControl &tc,
+                 uint32_t &crc) {
+#ifndef __linux__
+    return false;
+#else
+    if(ch.compression_method != ZIP_NO_COMPRESSION || entry.size != ch.uncompressed_size ||
+       entry.size < MIN_KERNEL_COPY || entry.fd < 0) {
+        return false;
+    }
+    const unsigned char *start = entry.start;
+    const uint64_t size = entry.size;
+    auto crc_of = [start, size, &opts, &ch]() {
+        return opts.trust_stored ? ch.crc32 : CRC32(start, size);
+    };
+    // Without a pool the CRC is computed after the copy.
+    auto crc_task = pool ? pool->fork(crc_of) : ForkedTask<uint32_t>(crc_of);
+    try {
+        const int out_fd = ofile.fileno();
+        uint64_t copied = clone_blocks(entry, out_fd);
+        loff_t in_offset = entry.offset + copied;
+        loff_t out_offset = copied;
+        while(copied < entry.size) {
+            tc.throw_if_stopped();
+            const auto r = copy_file_range(entry.fd,
+                                           &in_offset,
+                                           out_fd,
+                                           &out_offset,
+                                           std::min(entry.size - copied, MAX_COPY_STEP),
+                                           0);
+            if(r < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                if(copied == 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                                   errno == EOPNOTSUPP)) {
+                    crc_task.wait();
+                    return false;
+                }
+                throw_system("Could not copy file data:");
+            }
+            if(r == 0) {
+                throw std::runtime_error("Archive ended in the middle of a stored entry.");
+            }
+            copied += r;
+        }
+    } catch(...) {
+        crc_task.wait();
+        throw;
+    }
+    crc = crc_task.join();
+    return true;
+#endif
+}
+
+/*
+ * Decodes straight into a mapping of the output file, preallocated to the
+ * size given in the header. Returns false with the file emptied if the
+ * entry turns out to be some other size.
+ */
+bool decode_mapped(decltype(unstore_to_sink) *f,
+                   const unsigned char *data_start,
+                   uint64_t data_size,
+                   File &ofile,
+                   uint64_t expected_size,
+                   const TaskControl &tc,
+                   uint32_t &crc) {
+#ifdef _WIN32
+    return false;
+#else
+    if(expected_size < MIN_MAPPED_OUTPUT) {
+        return false;
+    }
+    const int fd = ofile.fileno();
+    bool allocated = false;
+#ifdef __linux__
+    // Reserves the blocks so that running out of disk is an error here
+    // rather than a SIGBUS when writing to the mapping.
+    if(fallocate(fd, 0, 0, expected_size) == 0) {
+        allocated = true;
+    } else if(errno != EOPNOTSUPP) {
+        throw_system("Could not allocate output file:");
+    }
+#endif
+    if(!allocated && ftruncate(fd, expected_size) != 0) {
+        throw_system("Could not resize output file:");
+    }
+    {
+        MMapper map(ofile, expected_size);
+        BufferSink out(map, expected_size);
+        crc = (*f)(data_start, data_size, out, tc);
+        if(!out.overflowed() && out.total() == expected_size) {
+            return true;
+        }
+    }
+    if(ftruncate(fd, 0) != 0) {
+        throw_system("Could not resize output file:");
+    }
+    return false;
+#endif
+}
+
+decltype(unstore_to_sink) *decoder_for(uint16_t compression_method) {
+    if(compression_method == ZIP_NO_COMPRESSION) {
+        return unstore_to_sink;
+    } else if(compression_method == ZIP_DEFLATE) {
+        return inflate_to_sink;
+    } else if(compression_method == ZIP_LZMA) {
+        return lzma_to_sink;
+    }
+    throw std::runtime_error("Unsupported compression format.");
+}
+
+void create_file(const centralview &ch,
+                 const EntryData &entry,
                  const std::string &outname,
+                 const UnpackOptions &opts,
+                 ThreadPool *pool,
                  const TaskControl &tc) {
-    decltype(unstore_to_file) *f;
-    if(ch.compression_method == ZIP_NO_COMPRESSION) {
-        f = unstore_to_file;
-    } else if(ch.compression_method == ZIP_DEFLATE) {
-        f = inflate_to_file;
-    } else if(ch.compression_method == ZIP_LZMA) {
-        f = lzma_to_file;
-    } else {
-        throw std::runtime_error("Unsupported compression format.");
-    }
+    decltype(unstore_to_sink) *f = decoder_for(ch.compression_method);
     if(exists_on_fs(outname)) {
         throw std::runtime_error("Already exists, will not overwrite.");
     }
-    std::string extraction_name = outname + "$ZIPTMP";
+    std::string extraction_name = temporary_name(outname);
     File ofile(extraction_name.c_str(), "w+b");
     uint32_t crc32;
     try {
-        crc32 = (*f)(data_start, data_size, ofile.get(), tc);
+        segmentindex segments;
+        if(use_segmented_inflate(ch, opts, pool, segments)) {
+            crc32 = segmented_inflate(
+                entry.start, ch.uncompressed_size, segments, ofile.fileno(), *pool, tc);
+        } else if(use_parallel_inflate(ch, entry.size, opts, pool)) {
+            crc32 = parallel_inflate(
+                entry.start, entry.size, ofile.fileno(), opts.parallel_chunk_size, *pool, tc);
+        } else if(!copy_stored(ch, entry, ofile, opts, pool, tc, crc32) &&
+                  !decode_mapped(
+                      f, entry.start, entry.size, ofile, ch.uncompressed_size, tc, crc32)) {
+            FileSink out(ofile.get());
+            crc32 = (*f)(entry.start, entry.size, out, tc);
+        }
     } catch(...) {
         unlink(extraction_name.c_str());
         throw;
     }
 
-    uint32_t original = lh.gp_bitflag & (1 << 2) ? ch.crc32 : lh.crc32;
-    if(crc32 != original) {
+    if(crc32 != ch.crc32) {
         unlink(extraction_name.c_str());
         throw std::runtime_error("CRC32 checksum is invalid.");
     }
     ofile.close();
+    if(opts.keep_temporary_names) {
+        return;
+    }
     if(rename(extraction_name.c_str(), outname.c_str()) != 0) {
         unlink(extraction_name.c_str());
         throw_system("Could not rename tmp file to target file:");
     }
 }
 
-void create_device(const localheader &lh, const std::string &outname) {
+void create_device(const unixextra &unix, const std::string &outname) {
 #ifdef _WIN32
     // Windows does not have character devices.
 #else
-    const std::string &d = lh.unix.data;
+    const std::string &d = unix.data;
     if(d.size() != 8) {
         std::string msg("Incorrect extra data for character device, expected 8, got ");
         msg += std::to_string(d.size());
@@ -290,7 +522,7 @@ void create_device(const localheader &lh, const std::string &outname) {
 #endif
 }
 
-filetype detect_filetype(const localheader &lh, const centralheader &ch) {
+filetype detect_filetype(const centralview &ch) {
 #ifndef _WIN32
     if(ch.version_made_by >> 8 == MADE_BY_UNIX) {
         uint16_t extattrs = ch.external_file_attributes >> 16;
@@ -311,34 +543,35 @@ filetype detect_filetype(const localheader &lh, const centralheader &ch) {
     }
 #endif
     // Nothing much to do.
-    if(lh.fname.back() == '/') {
+    if(ch.fname.back() == '/') {
         return DIRECTORY_ENTRY;
     }
     return FILE_ENTRY;
 }
 
-filetype do_unpack(const localheader &lh,
-                   const centralheader &ch,
-                   const unsigned char *data_start,
-                   uint64_t data_size,
+filetype do_unpack(const centralview &ch,
+                   const unixextra &unix,
+                   const EntryData &entry,
                    const std::string &outname,
+                   const UnpackOptions &opts,
+                   ThreadPool *pool,
                    const TaskControl &tc) {
-    auto ftype = detect_filetype(lh, ch);
+    auto ftype = detect_filetype(ch);
     switch(ftype) {
     case DIRECTORY_ENTRY:
         mkdirp(outname);
         break;
     case SYMLINK_ENTRY:
         create_dirs_for_file(outname);
-        create_symlink(data_start, data_size, outname);
+        create_symlink(entry.start, entry.size, outname);
         break;
     case CHARDEV_ENTRY:
         create_dirs_for_file(outname);
-        create_device(lh, outname);
+        create_device(unix, outname);
         break;
     case FILE_ENTRY:
         create_dirs_for_file(outname);
-        create_file(lh, ch, data_start, data_size, outname, tc);
+        create_file(ch, entry, outname, opts, pool, tc);
         break;
     default:
         throw std::runtime_error("Unknown file type.");
@@ -346,8 +579,8 @@ filetype do_unpack(const localheader &lh,
     return ftype;
 }
 
-void set_unix_permissions(const localheader &lh,
-                          const centralheader &ch,
+void set_unix_permissions(const centralview &ch,
+                          const unixextra &unix,
                           const std::string &fname) {
 #ifndef _WIN32
     // This part of the zip spec is poorly documented. :(
@@ -358,15 +591,15 @@ void set_unix_permissions(const localheader &lh,
     // Only support mtime if it is in zip64 info.
     // FIXME add support for crazy zip dos format.
     // http://mindprod.com/jgloss/zip.html
-    if(lh.unix.atime != 0) {
+    if(unix.atime != 0) {
         // These can fail for various reasons (i.e. no chown privilegde), so
         // ignore return values.
         struct utimbuf tb;
-        tb.actime = lh.unix.atime;
-        tb.modtime = lh.unix.mtime;
+        tb.actime = unix.atime;
+        tb.modtime = unix.mtime;
         utime(fname.c_str(), &tb);
     }
-    if(chown(fname.c_str(), lh.unix.uid, lh.unix.gid) < 0) {
+    if(chown(fname.c_str(), unix.uid, unix.gid) < 0) {
         perror("Could not change owner/group info:");
     }
 #endif
@@ -374,31 +607,343 @@ void set_unix_permissions(const localheader &lh,
 
 } // namespace
 
+std::string output_name(const std::string &prefix, const std::string &fname) {
+    if(prefix.empty()) {
+        return fname;
+    }
+    if(prefix.back() != '/') {
+        return prefix + '/' + fname;
+    }
+    return prefix + fname;
+}
+
+std::string temporary_name(const std::string &outname) {
+    return outname + "$ZIPTMP";
+}
+
 UnpackResult unpack_entry(const std::string &prefix,
-                          const localheader &lh,
-                          const centralheader &ch,
-                          const unsigned char *data_start,
-                          uint64_t data_size,
+                          const centralview &ch,
+                          const unixextra &unix,
+                          const EntryData &entry,
+                          const UnpackOptions &opts,
+                          ThreadPool *pool,
                           const TaskControl &tc) {
+    const std::string fname(ch.fname);
     try {
-        std::string ofname;
-        if(prefix.empty()) {
-            ofname = lh.fname;
-        } else {
-            if(prefix.back() != '/') {
-                ofname = prefix + '/' + lh.fname;
-            } else {
-                ofname = prefix + lh.fname;
+        const std::string ofname = output_name(prefix, fname);
+        auto ftype = do_unpack(ch, unix, entry, ofname, opts, pool, tc);
+        if(ch.version_made_by >> 8 == MADE_BY_UNIX && ftype != SYMLINK_ENTRY) {
+            set_unix_permissions(ch, unix, ofname);
+        }
+        return UnpackResult{true, "OK: " + fname};
+    } catch(const std::exception &e) {
+        return UnpackResult{false, "FAIL: " + fname + "\n" + e.what()};
+    } catch(...) {
+    }
+    return UnpackResult{false, "FAIL: " + fname + "  unknown error"};
+}
+
+void decode_entry(const centralview &ch,
+                  const EntryData &entry,
+                  OutputSink &out,
+                  const TaskControl &tc) {
+    decltype(unstore_to_sink) *f = decoder_for(ch.compression_method);
+    const uint32_t crc32 = (*f)(entry.start, entry.size, out, tc);
+    if(out.overflowed() || out.total() != ch.uncompressed_size) {
+        throw std::runtime_error("Entry is not the size its header says.");
+    }
+    if(crc32 != ch.crc32) {
+        throw std::runtime_error("CRC32 checksum is invalid.");
+    }
+}
+
+std::string unpack_to_memory(const centralview &ch,
+                             const EntryData &entry,
+                             const TaskControl &tc) {
+    // The size in the header is only trusted with memory if the data could
+    // really expand to it. Other methods have no such bound, their output
+    // gets memory as it comes.
+    if(ch.compression_method == ZIP_NO_COMPRESSION && ch.uncompressed_size != entry.size) {
+        throw std::runtime_error("Stored entry is not the size its header says.");
+    }
+    if(ch.compression_method == ZIP_DEFLATE &&
+       ch.uncompressed_size / MAX_DEFLATE_RATIO > entry.size) {
+        throw std::runtime_error("Entry is bigger than its compressed data can expand to.");
+    }
+    if(ch.uncompressed_size >= std::string().max_size()) {
+        throw std::runtime_error("Entry does not fit in memory.");
+    }
+    if(ch.compression_method != ZIP_NO_COMPRESSION && ch.compression_method != ZIP_DEFLATE) {
+        std::vector<unsigned char> buf;
+        {
+            VectorSink out(buf);
+            decode_entry(ch, entry, out, tc);
+        }
+        return std::string(buf.begin(), buf.end());
+    }
+    // One byte more than the header says tells a bigger entry apart, and
+    // gives empty entries somewhere to decode to.
+    std::string result(ch.uncompressed_size + 1, '\0');
+    BufferSink out(reinterpret_cast<unsigned char *>(&result[0]), result.size());
+    decode_entry(ch, entry, out, tc);
+    result.resize(ch.uncompressed_size);
+    return result;
+}
+
+UnpackResult reconcile_entry(const std::string &prefix,
+                             const centralview &ch,
+                             const unixextra &unix) {
+    const std::string fname(ch.fname);
+    const std::string ofname = output_name(prefix, fname);
+    const bool is_dir = fname.back() == '/';
+    const std::string tmpname = is_dir ? std::string() : temporary_name(ofname);
+    try {
+        const filetype ftype = detect_filetype(ch);
+        if(is_dir != (ftype == DIRECTORY_ENTRY)) {
+            throw std::runtime_error("Central directory does not match the local header.");
+        }
+        switch(ftype) {
+        case SYMLINK_ENTRY: {
+            // The target was unpacked as the contents of a plain file.
+            std::string target;
+            {
+                File f(tmpname, "rb");
+                target = f.read(f.size());
             }
+            create_symlink(
+                reinterpret_cast<const unsigned char *>(target.data()), target.size(), ofname);
+            unlink(tmpname.c_str());
+            break;
+        }
+        case CHARDEV_ENTRY:
+            create_device(unix, ofname);
+            unlink(tmpname.c_str());
+            break;
+        case UNKNOWN_ENTRY:
+            throw std::runtime_error("Unknown file type.");
+        default:
+            break;
         }
-        auto ftype = do_unpack(lh, ch, data_start, data_size, ofname, tc);
         if(ch.version_made_by >> 8 == MADE_BY_UNIX && ftype != SYMLINK_ENTRY) {
-            set_unix_permissions(lh, ch, ofname);
+            set_unix_permissions(ch, unix, ftype == FILE_ENTRY ? tmpname : ofname);
+        }
+        if(ftype == FILE_ENTRY && rename(tmpname.c_str(), ofname.c_str()) != 0) {
+            throw_system("Could not rename tmp file to target file:");
         }
-        return UnpackResult{true, "OK: " + lh.fname};
+        return UnpackResult{true, "OK: " + fname};
     } catch(const std::exception &e) {
-        return UnpackResult{false, "FAIL: " + lh.fname + "\n" + e.what()};
-    } catch(...) {
+        if(!is_dir) {
+            unlink(tmpname.c_str());
+        }
+        return UnpackResult{false, "FAIL: " + fname + "\n" + e.what()};
+    }
+}
+
+struct StreamDecoder::State {
+    State(uint16_t method, OutputSink &out) : method(method), out(out) {}
+
+    ~State() {
+        if(zlib_started) {
+            inflateEnd(&zstrm);
+        }
+#ifndef _WIN32
+        if(lzma_started) {
+            lzma_end(&lstrm);
+        }
+#endif
+    }
+
+    size_t inflate_some(const unsigned char *data, size_t size);
+#ifndef _WIN32
+    size_t read_lzma_header(const unsigned char *data, size_t size);
+    size_t lzma_some(const unsigned char *data, size_t size);
+#endif
+
+    uint16_t method;
+    OutputSink &out;
+    bool ended = false;
+    z_stream zstrm;
+    bool zlib_started = false;
+#ifndef _WIN32
+    lzma_stream lstrm = LZMA_STREAM_INIT;
+    bool lzma_started = false;
+    // The LZMA properties that come before the data, until all of them are in.
+    std::string lzma_header;
+#endif
+};
+
+size_t StreamDecoder::State::inflate_some(const unsigned char *data, size_t size) {
+    zstrm.next_in = const_cast<unsigned char *>(data); // zlib header is const-broken
+    zstrm.avail_in = (uInt)std::min<uint64_t>(size, MAX_ZLIB_STEP);
+    const uInt fed = zstrm.avail_in;
+    while(true) {
+        const uInt space = std::min(out.space_size(), MAX_ZLIB_STEP);
+        zstrm.avail_out = space;
+        zstrm.next_out = out.space();
+        const int ret = inflate(&zstrm, Z_NO_FLUSH);
+        assert(ret != Z_STREAM_ERROR);
+        switch(ret) {
+        case Z_NEED_DICT:
+        case Z_DATA_ERROR:
+        case Z_MEM_ERROR:
+            throw std::runtime_error(zstrm.msg ? zstrm.msg : "Could not inflate data.");
+        }
+        out.commit(space - zstrm.avail_out);
+        if(ret == Z_STREAM_END) {
+            ended = true;
+            break;
+        }
+        // Out of input with nothing left to output, or no progress possible.
+        if((zstrm.avail_in == 0 && zstrm.avail_out != 0) || ret == Z_BUF_ERROR) {
+            break;
+        }
+    }
+    return fed - zstrm.avail_in;
+}
+
+#ifndef _WIN32
+// Two bytes of version, two of properties size and then the properties.
+size_t StreamDecoder::State::read_lzma_header(const unsigned char *data, size_t size) {
+    size_t used = 0;
+    while(true) {
+        size_t wanted = 4;
+        if(lzma_header.size() >= wanted) {
+            wanted += le16toh(*reinterpret_cast<const uint16_t *>(lzma_header.data() + 2));
+            if(lzma_header.size() == wanted) {
+                break;
+            }
+        }
+        const size_t step = std::min(wanted - lzma_header.size(), size - used);
+        if(step == 0) {
+            return used;
+        }
+        lzma_header.append(reinterpret_cast<const char *>(data + used), step);
+        used += step;
+    }
+    lzma_filter filter[2];
+    filter[0].id = LZMA_FILTER_LZMA1;
+    filter[1].id = LZMA_VLI_UNKNOWN;
+    lzma_ret ret = lzma_properties_decode(&filter[0],
+                                          nullptr,
+                                          reinterpret_cast<const uint8_t *>(lzma_header.data()) + 4,
+                                          lzma_header.size() - 4);
+    if(ret != LZMA_OK) {
+        throw std::runtime_error("Could not decode LZMA properties.");
+    }
+    ret = lzma_raw_decoder(&lstrm, &filter[0]);
+    free(filter[0].options);
+    if(ret != LZMA_OK) {
+        throw std::runtime_error("Could not initialize LZMA decoder.");
+    }
+    lzma_started = true;
+    return used;
+}
+
+size_t StreamDecoder::State::lzma_some(const unsigned char *data, size_t size) {
+    size_t used = 0;
+    if(!lzma_started) {
+        used = read_lzma_header(data, size);
+        if(!lzma_started) {
+            return used;
+        }
+    }
+    lstrm.next_in = data + used;
+    lstrm.avail_in = size - used;
+    while(true) {
+        const uint64_t space = out.space_size();
+        lstrm.avail_out = space;
+        lstrm.next_out = out.space();
+        const lzma_ret ret = lzma_code(&lstrm, LZMA_RUN);
+        if(ret != LZMA_OK && ret != LZMA_STREAM_END && ret != LZMA_BUF_ERROR) {
+            throw std::runtime_error("Decompression failed.");
+        }
+        out.commit(space - lstrm.avail_out);
+        if(ret == LZMA_STREAM_END) {
+            ended = true;
+            break;
+        }
+        if((lstrm.avail_in == 0 && lstrm.avail_out != 0) || ret == LZMA_BUF_ERROR) {
+            break;
+        }
+    }
+    return size - lstrm.avail_in;
+}
+#endif
+
+StreamDecoder::StreamDecoder(uint16_t compression_method, OutputSink &out)
+    : s(new State(compression_method, out)) {
+    if(compression_method == ZIP_DEFLATE) {
+        s->zstrm.zalloc = Z_NULL;
+        s->zstrm.zfree = Z_NULL;
+        s->zstrm.opaque = Z_NULL;
+        s->zstrm.avail_in = 0;
+        s->zstrm.next_in = Z_NULL;
+        if(inflateInit2(&s->zstrm, -15) != Z_OK) {
+            throw std::runtime_error("Could not init zlib.");
+        }
+        s->zlib_started = true;
+    } else if(compression_method == ZIP_LZMA) {
+#ifdef _WIN32
+        throw std::runtime_error("LZMA not supported on Windows.");
+#endif
+    } else if(compression_method != ZIP_NO_COMPRESSION) {
+        throw std::runtime_error("Unsupported compression format.");
+    }
+}
+
+StreamDecoder::~StreamDecoder() {}
+
+size_t StreamDecoder::feed(const unsigned char *data, size_t size, const TaskControl &tc) {
+    tc.throw_if_stopped();
+    if(s->ended) {
+        return 0;
+    }
+    switch(s->method) {
+    case ZIP_DEFLATE:
+        return s->inflate_some(data, size);
+#ifndef _WIN32
+    case ZIP_LZMA:
+        return s->lzma_some(data, size);
+#endif
+    default:
+        return s->out.write(data, size);
+    }
+}
+
+bool StreamDecoder::ended() const { return s->ended; }
+
+uint32_t StreamDecoder::crc() const { return s->out.crc(); }
+
+uint64_t StreamDecoder::total() const { return s->out.total(); }
+
+EntryReader::EntryReader(const centralview &ch, const EntryData &entry)
+    : expected_crc(ch.crc32), expected_size(ch.uncompressed_size), next(entry.start),
+      remaining(entry.size), out(nullptr, 0), dec(ch.compression_method, out) {}
+
+size_t EntryReader::read(unsigned char *buf, size_t size) {
+    if(finished || size == 0) {
+        return 0;
+    }
+    out.reset(buf, size);
+    while(out.space_size() > 0 && !dec.ended()) {
+        const uint64_t before = out.total();
+        const size_t used =
+            dec.feed(next, (size_t)std::min<uint64_t>(remaining, MAX_ZLIB_STEP), tc);
+        next += used;
+        remaining -= used;
+        if(used == 0 && out.total() == before) {
+            // Nothing more comes out of the data there is.
+            break;
+        }
+    }
+    if(out.size() == 0) {
+        finished = true;
+        if(out.total() != expected_size) {
+            throw std::runtime_error("Entry is not the size its header says.");
+        }
+        if(out.crc() != expected_crc) {
+            throw std::runtime_error("CRC32 checksum is invalid.");
+        }
     }
-    return UnpackResult{false, "FAIL: " + lh.fname + "  unknown error"};
+    return out.size();
 }
@@ -17,19 +17,128 @@
 
 #pragma once
 
+#include "outputsink.h"
+#include "taskcontrol.h"
 #include "zipdefs.h"
+#include <memory>
 #include <string>
 
-class TaskControl;
+class ThreadPool;
+
+struct UnpackOptions {
+    // Deflate entries at least this big are decompressed on all threads.
+    // Zero disables.
+    uint64_t parallel_threshold = 64 * 1024 * 1024;
+    uint64_t parallel_chunk_size = 4 * 1024 * 1024;
+    // Do not check the CRC of stored entries that are copied in the kernel.
+    bool trust_stored = false;
+    // An archive that is read as a stream has its entries read into memory
+    // for the worker threads, at most this much at a time. A single entry
+    // may take a tenth of it, bigger ones are unpacked as they are read.
+    uint64_t stream_memory_limit = 256 * 1024 * 1024;
+    // Leave files under the name they are written to, for the caller to
+    // rename once it knows the entry is good.
+    bool keep_temporary_names = false;
+};
+
+// The compressed data of an entry, both mapped and as a range of the
+// archive file so that it can be copied within the kernel.
+struct EntryData {
+    const unsigned char *start;
+    uint64_t size;
+    int fd;
+    uint64_t offset;
+};
 
 struct UnpackResult {
     bool success;
     std::string msg;
 };
 
+// Where an entry is unpacked to.
+std::string output_name(const std::string &prefix, const std::string &fname);
+
+// Where a file is written to until it is complete.
+std::string temporary_name(const std::string &outname);
+
 UnpackResult unpack_entry(const std::string &prefix,
-                          const localheader &lh,
-                          const centralheader &ch,
-                          const unsigned char *data_start,
-                          uint64_t data_size,
+                          const centralview &ch,
+                          const unixextra &unix,
+                          const EntryData &entry,
+                          const UnpackOptions &opts,
+                          ThreadPool *pool,
                           const TaskControl &tc);
+
+// Decodes a file entry into a fresh sink. Throws if it is not the size and
+// CRC its header says, by which time a sink that passes its data on has
+// done so already.
+void decode_entry(const centralview &ch,
+                  const EntryData &entry,
+                  OutputSink &out,
+                  const TaskControl &tc);
+
+// Decodes a file entry into memory.
+std::string unpack_to_memory(const centralview &ch,
+                             const EntryData &entry,
+                             const TaskControl &tc);
+
+// Entries of an archive that is read as a stream are unpacked before their
+// central header is known, as plain files under their temporary names and
+// directories without permissions. This turns one into what its central
+// header says it is, under its real name. A file that can not be turned
+// into it is removed.
+UnpackResult reconcile_entry(const std::string &prefix,
+                             const centralview &ch,
+                             const unixextra &unix);
+
+/*
+ * Decodes the data of an entry piece by piece as it is read from a stream.
+ * The output goes to out, which must outlive the decoder.
+ */
+class StreamDecoder final {
+public:
+    StreamDecoder(uint16_t compression_method, OutputSink &out);
+    ~StreamDecoder();
+
+    // Decodes from the start of the data and returns how much of it was
+    // used. Deflate data and LZMA data with an end marker end by themselves,
+    // after that nothing more is used. Otherwise the data is used until
+    // the output has no more space.
+    size_t feed(const unsigned char *data, size_t size, const TaskControl &tc);
+
+    bool ended() const;
+    uint32_t crc() const;
+    uint64_t total() const;
+
+private:
+    struct State;
+    std::unique_ptr<State> s;
+};
+
+/*
+ * Decodes a file entry as the caller reads it, so that memory use does
+ * not depend on the size of the entry. The compressed data must stay
+ * available for as long as the reader is used.
+ */
+class EntryReader final {
+public:
+    EntryReader(const centralview &ch, const EntryData &entry);
+
+    // Decodes up to size bytes into buf and returns how many there were,
+    // zero at the end of the entry. Throws if the data is broken or is not
+    // the size and CRC the header says, which is found out at the end.
+    size_t read(unsigned char *buf, size_t size);
+
+    uint64_t size() const { return expected_size; }
+    uint64_t position() const { return out.total(); }
+
+private:
+    uint32_t expected_crc;
+    uint64_t expected_size;
+    const unsigned char *next;
+    uint64_t remaining;
+    bool finished = false;
+    TaskControl tc;
+    BufferSink out;
+    StreamDecoder dec;
+};
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "entrycache.h"
+#include "zipreader.h"
+
+#include <stdexcept>
+
+EntryCache::EntryCache(const ZipReader &archive, uint64_t budget, size_t num_shards)
+    : archive(archive) {
+    if(num_shards == 0) {
+        throw std::invalid_argument("Cache must have at least one shard.");
+    }
+    shard_budget = budget / num_shards;
+    for(size_t i = 0; i < num_shards; ++i) {
+        shards.emplace_back(new Shard);
+    }
+}
+
+EntryCache::Data EntryCache::get(const std::string &name) {
+    const size_t i = archive.find(name);
+    if(i == ZipReader::npos) {
+        throw std::runtime_error("No entry named " + name + " in archive.");
+    }
+    return get(i);
+}
+
+EntryCache::Data EntryCache::get(size_t index) {
+    if(index >= archive.size()) {
+        throw std::out_of_range("Entry index out of range.");
+    }
+    if(archive.entries().uncompressed_size(index) > shard_budget) {
+        ++misses;
+        return std::make_shared<const std::string>(archive.read_entry(index));
+    }
+    Shard &shard = *shards[index % shards.size()];
+    std::promise<Data> promise;
+    std::shared_future<Data> pending;
+    {
+        std::lock_guard<std::mutex> l(shard.m);
+        auto it = shard.items.find(index);
+        if(it == shard.items.end()) {
+            ++misses;
+            shard.items.emplace(index, Item{promise.get_future().share(), 0, {}, false});
+        } else {
+            ++hits;
+            Item &item = it->second;
+            if(item.loaded) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, item.pos);
+                return item.data.get();
+            }
+            pending = item.data;
+        }
+    }
+    if(pending.valid()) {
+        // Another thread is decoding it.
+        return pending.get();
+    }
+    return load(shard, index, promise);
+}
+
+// The entry is in the shard as not loaded, with the future of promise.
+EntryCache::Data EntryCache::load(Shard &shard, size_t index, std::promise<Data> &promise) {
+    Data data;
+    try {
+        data = std::make_shared<const std::string>(archive.read_entry(index));
+    } catch(...) {
+        promise.set_exception(std::current_exception());
+        std::lock_guard<std::mutex> l(shard.m);
+        shard.items.erase(index);
+        throw;
+    }
+    promise.set_value(data);
+    std::lock_guard<std::mutex> l(shard.m);
+    Item &item = shard.items.at(index);
+    item.size = data->size();
+    item.loaded = true;
+    shard.lru.push_front(index);
+    item.pos = shard.lru.begin();
+    shard.bytes += item.size;
+    while(shard.bytes > shard_budget && shard.lru.size() > 1) {
+        const size_t victim = shard.lru.back();
+        shard.lru.pop_back();
+        auto v = shard.items.find(victim);
+        shard.bytes -= v->second.size;
+        shard.items.erase(v);
+        ++evictions;
+    }
+    return data;
+}
+
+CacheStats EntryCache::stats() const {
+    CacheStats s{hits, misses, evictions, 0};
+    for(const auto &shard : shards) {
+        std::lock_guard<std::mutex> l(shard->m);
+        s.bytes += shard->bytes;
+    }
+    return s;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class ZipReader;
+
+struct CacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    // Decoded bytes held right now.
+    uint64_t bytes;
+};
+
+/*
+ * Keeps recently read entries of an archive decoded in memory, at most
+ * budget bytes of them. The entries are spread over shards by index, each
+ * with its own lock and least recently used list, so that threads reading
+ * different entries seldom wait for each other. An entry is decoded only
+ * once even if many threads ask for it at the same time, the others wait
+ * for the first one to finish.
+ *
+ * Entries bigger than the budget of a shard are read but not kept.
+ */
+class EntryCache final {
+public:
+    typedef std::shared_ptr<const std::string> Data;
+
+    EntryCache(const ZipReader &archive, uint64_t budget, size_t num_shards = 16);
+
+    // Throws if the entry can not be read, the failure is not cached.
+    Data get(size_t index);
+    Data get(const std::string &name);
+
+    CacheStats stats() const;
+
+private:
+    struct Item {
+        std::shared_future<Data> data;
+        uint64_t size;
+        // Into lru, valid once the entry is decoded.
+        std::list<size_t>::iterator pos;
+        bool loaded;
+    };
+
+    struct Shard {
+        std::mutex m;
+        std::unordered_map<size_t, Item> items;
+        // Most recently used first.
+        std::list<size_t> lru;
+        uint64_t bytes = 0;
+    };
+
+    Data load(Shard &shard, size_t index, std::promise<Data> &promise);
+
+    const ZipReader &archive;
+    uint64_t shard_budget;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> evictions{0};
+};
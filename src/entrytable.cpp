@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "entrytable.h"
+#include "zipparse.h"
+
+namespace {
+
+// The headers have been parsed once already, so their fields are read
+// without further checks.
+const unsigned char *field(const unsigned char *arena, uint64_t header_offset, int offset) {
+    return arena + header_offset + offset;
+}
+
+} // namespace
+
+void EntryTable::reserve(size_t num_entries) {
+    header_offsets.reserve(num_entries);
+    local_offsets.reserve(num_entries);
+    compressed_sizes.reserve(num_entries);
+    uncompressed_sizes.reserve(num_entries);
+    crcs.reserve(num_entries);
+    methods.reserve(num_entries);
+}
+
+void EntryTable::add(const centralview &c, uint64_t header_offset) {
+    header_offsets.push_back(header_offset);
+    local_offsets.push_back(c.local_header_rel_offset);
+    compressed_sizes.push_back(c.compressed_size);
+    uncompressed_sizes.push_back(c.uncompressed_size);
+    crcs.push_back(c.crc32);
+    methods.push_back(c.compression_method);
+}
+
+std::string_view EntryTable::name(size_t i) const {
+    const uint64_t h = header_offsets[i];
+    return std::string_view(reinterpret_cast<const char *>(field(arena, h, CENTRAL_HEADER_SIZE)),
+                            load16le(field(arena, h, 28)));
+}
+
+bool EntryTable::is_dir(size_t i) const {
+    const std::string_view n = name(i);
+    return !n.empty() && n.back() == '/';
+}
+
+centralview EntryTable::header(size_t i) const {
+    const uint64_t h = header_offsets[i];
+    centralview c;
+    c.version_made_by = load16le(field(arena, h, 4));
+    c.version_needed = load16le(field(arena, h, 6));
+    c.bit_flag = load16le(field(arena, h, 8));
+    c.compression_method = methods[i];
+    c.last_mod_time = load16le(field(arena, h, 12));
+    c.last_mod_date = load16le(field(arena, h, 14));
+    c.crc32 = crcs[i];
+    c.compressed_size = compressed_sizes[i];
+    c.uncompressed_size = uncompressed_sizes[i];
+    c.disk_number_start = load16le(field(arena, h, 34));
+    c.internal_file_attributes = load16le(field(arena, h, 36));
+    c.external_file_attributes = load32le(field(arena, h, 38));
+    c.local_header_rel_offset = local_offsets[i];
+    const uint16_t fname_length = load16le(field(arena, h, 28));
+    const uint16_t extra_length = load16le(field(arena, h, 30));
+    const uint16_t comment_length = load16le(field(arena, h, 32));
+    const char *p = reinterpret_cast<const char *>(field(arena, h, CENTRAL_HEADER_SIZE));
+    c.fname = std::string_view(p, fname_length);
+    c.extra_field = std::string_view(p + fname_length, extra_length);
+    c.comment = std::string_view(p + fname_length + extra_length, comment_length);
+    return c;
+}
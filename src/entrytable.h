@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "zipdefs.h"
+
+#include <cstdint>
+#include <iterator>
+#include <string_view>
+#include <vector>
+
+/*
+ * The central directory of an archive as columns of the fields that are
+ * looked at for every entry, a few dozen bytes per entry and no
+ * allocations of its own, so that archives with millions of entries stay
+ * cheap to open. Names, extra fields and comments are not copied. They
+ * are referenced by offset from the central directory in the mapped
+ * archive, which serves as the string arena, and so are the rarely needed
+ * fixed fields. Only fields with a ZIP64 extension, or that are scanned
+ * over the whole table, get columns.
+ */
+class EntryTable final {
+public:
+    // A row of the table, only valid for as long as the table is.
+    class Entry final {
+    public:
+        size_t index() const { return i; }
+        std::string_view name() const { return t->name(i); }
+        uint64_t compressed_size() const { return t->compressed_size(i); }
+        uint64_t uncompressed_size() const { return t->uncompressed_size(i); }
+        uint32_t crc32() const { return t->crc32(i); }
+        uint16_t compression_method() const { return t->compression_method(i); }
+        bool is_dir() const { return t->is_dir(i); }
+        centralview header() const { return t->header(i); }
+
+    private:
+        friend class EntryTable;
+        Entry(const EntryTable *t, size_t i) : t(t), i(i) {}
+
+        const EntryTable *t;
+        size_t i;
+    };
+
+    class iterator final {
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef Entry value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Entry *pointer;
+        typedef Entry reference;
+
+        Entry operator*() const { return Entry(t, i); }
+        Entry operator[](difference_type n) const { return Entry(t, i + n); }
+        iterator &operator++() {
+            ++i;
+            return *this;
+        }
+        iterator operator++(int) { return iterator(t, i++); }
+        iterator &operator--() {
+            --i;
+            return *this;
+        }
+        iterator operator--(int) { return iterator(t, i--); }
+        iterator &operator+=(difference_type n) {
+            i += n;
+            return *this;
+        }
+        iterator &operator-=(difference_type n) {
+            i -= n;
+            return *this;
+        }
+        iterator operator+(difference_type n) const { return iterator(t, i + n); }
+        iterator operator-(difference_type n) const { return iterator(t, i - n); }
+        difference_type operator-(const iterator &o) const { return difference_type(i - o.i); }
+        bool operator==(const iterator &o) const { return i == o.i; }
+        bool operator!=(const iterator &o) const { return i != o.i; }
+        bool operator<(const iterator &o) const { return i < o.i; }
+
+    private:
+        friend class EntryTable;
+        iterator(const EntryTable *t, size_t i) : t(t), i(i) {}
+
+        const EntryTable *t;
+        size_t i;
+    };
+
+    // The arena is the start of the archive, header offsets are counted
+    // from there.
+    explicit EntryTable(const unsigned char *arena) : arena(arena) {}
+
+    void reserve(size_t num_entries);
+    // Adds a parsed central header that starts at header_offset.
+    void add(const centralview &c, uint64_t header_offset);
+
+    size_t size() const { return header_offsets.size(); }
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, size()); }
+    Entry operator[](size_t i) const { return Entry(this, i); }
+
+    std::string_view name(size_t i) const;
+    uint64_t compressed_size(size_t i) const { return compressed_sizes[i]; }
+    uint64_t uncompressed_size(size_t i) const { return uncompressed_sizes[i]; }
+    uint64_t local_header_offset(size_t i) const { return local_offsets[i]; }
+    uint32_t crc32(size_t i) const { return crcs[i]; }
+    uint16_t compression_method(size_t i) const { return methods[i]; }
+    // Zip files mark directories by ending their names with a slash.
+    bool is_dir(size_t i) const;
+
+    // The whole central header, put together from the columns and the
+    // arena. Cheap, but only meant for when an entry is unpacked.
+    centralview header(size_t i) const;
+
+private:
+    const unsigned char *arena;
+    std::vector<uint64_t> header_offsets;
+    std::vector<uint64_t> local_offsets;
+    std::vector<uint64_t> compressed_sizes;
+    std::vector<uint64_t> uncompressed_sizes;
+    std::vector<uint32_t> crcs;
+    std::vector<uint16_t> methods;
+};
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "notifier.hpp"
+#include "zipdefs.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+
+// Entries on their way from the scan of the input files to the archive
+// writer, so that compression can start before the scan is done. The scan
+// waits when the queue is full. Besides the queue the scan only holds the
+// listings of the directories it is in and of the few it reads ahead, so a
+// huge tree is never all in memory.
+class FileQueue final {
+public:
+    explicit FileQueue(size_t max_size) : max_size(max_size) {}
+
+    // Producer side.
+
+    // Waits while the queue is full. Returns false if the consumer has gone
+    // away, the scan should stop then.
+    bool push(fileinfo fi) {
+        std::unique_lock<std::mutex> l(m);
+        cv.wait(l, [this] { return entries.size() < max_size || cancelled; });
+        if(cancelled) {
+            return false;
+        }
+        if(closed) {
+            throw std::logic_error("Tried to push to a closed file queue.");
+        }
+        entries.push_back(std::move(fi));
+        if(listener) {
+            listener->notify();
+        }
+        return true;
+    }
+
+    // No more entries are coming.
+    void close() {
+        std::lock_guard<std::mutex> l(m);
+        closed = true;
+        if(listener) {
+            listener->notify();
+        }
+    }
+
+    // Consumer side.
+
+    bool try_pop(fileinfo &fi) {
+        std::lock_guard<std::mutex> l(m);
+        if(entries.empty()) {
+            return false;
+        }
+        fi = std::move(entries.front());
+        entries.pop_front();
+        cv.notify_all();
+        return true;
+    }
+
+    // Whether the queue has been closed and everything in it taken.
+    bool finished() const {
+        std::lock_guard<std::mutex> l(m);
+        return closed && entries.empty();
+    }
+
+    // The listener is told whenever an entry arrives or the queue is closed.
+    void set_listener(Notifier *n) {
+        std::lock_guard<std::mutex> l(m);
+        listener = n;
+    }
+
+    // The consumer is done. Entries pushed after this are dropped and the
+    // listener is not told about them any more.
+    void cancel() {
+        std::lock_guard<std::mutex> l(m);
+        cancelled = true;
+        listener = nullptr;
+        entries.clear();
+        cv.notify_all();
+    }
+
+private:
+    const size_t max_size;
+    mutable std::mutex m;
+    std::condition_variable cv;
+    std::deque<fileinfo> entries;
+    Notifier *listener = nullptr;
+    bool closed = false;
+    bool cancelled = false;
+};
@@ -16,6 +16,7 @@
  */
 
 #include "fileutils.h"
+#include "threadpool.h"
 #include "utils.h"
 
 #ifdef _WIN32
@@ -24,37 +25,32 @@
 #include <windows.h>
 #else
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <sys/sysmacros.h>
 #endif
 #include <filesystem>
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <deque>
 #include <memory>
-#include <numeric>
 #include <stdexcept>
 
 namespace fs = std::filesystem;
 
 namespace {
 
-std::vector<fileinfo> expand_entry(const std::string &fname);
-
 // The C++ filesystem API does not seem to have uids or gids.
 // Thus we have to use platform specific code to get this information.
 
-fileinfo get_unix_stats(const std::string &fname) {
-    struct stat buf;
-    fileinfo sd;
-#ifdef _WIN32
-    if(stat(fname.c_str(), &buf) != 0) {
-#else
-    if(lstat(fname.c_str(), &buf) != 0) {
-#endif
-        throw_system("Could not get entry stats: ");
-    }
-    sd.fname = fname;
+void fill_stats(fileinfo &sd, const struct stat &buf) {
     sd.ue.uid = buf.st_uid;
     sd.ue.gid = buf.st_gid;
 #if defined(__APPLE__)
@@ -70,9 +66,22 @@ fileinfo get_unix_stats(const std::string &fname) {
     sd.mode = buf.st_mode;
     sd.fsize = buf.st_size;
     sd.device_id = buf.st_rdev;
-    return sd;
-} // namespace
+}
 
+#ifdef _WIN32
+
+std::vector<fileinfo> expand_entry(const std::string &fname);
+
+fileinfo get_unix_stats(const std::string &fname) {
+    struct stat buf;
+    fileinfo sd;
+    if(stat(fname.c_str(), &buf) != 0) {
+        throw_system("Could not get entry stats: ");
+    }
+    sd.fname = fname;
+    fill_stats(sd, buf);
+    return sd;
+}
 
 std::vector<std::string> handle_dir_platform(const std::string &dirname) {
     std::vector<std::string> entries;
@@ -113,6 +122,144 @@ std::vector<fileinfo> expand_entry(const std::string &fname) {
     }
 }
 
+#else
+
+// Stats name in the directory dirfd without following symlinks. Only the
+// fields that go in the archive are asked for, which saves the file system
+// some work, network ones in particular.
+fileinfo stat_at(int dirfd, const char *name, std::string fullpath) {
+    fileinfo sd;
+    sd.fname = std::move(fullpath);
+#ifdef STATX_BASIC_STATS
+    const unsigned int mask = STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_ATIME |
+                              STATX_MTIME | STATX_SIZE;
+    struct statx sx;
+    if(statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, mask, &sx) == 0) {
+        sd.ue.uid = sx.stx_uid;
+        sd.ue.gid = sx.stx_gid;
+        sd.ue.atime = sx.stx_atime.tv_sec;
+        sd.ue.mtime = sx.stx_mtime.tv_sec;
+        sd.mode = sx.stx_mode;
+        sd.fsize = sx.stx_size;
+        sd.device_id = makedev(sx.stx_rdev_major, sx.stx_rdev_minor);
+        return sd;
+    }
+    if(errno != ENOSYS) {
+        throw_system("Could not get entry stats: ");
+    }
+#endif
+    struct stat buf;
+    if(fstatat(dirfd, name, &buf, AT_SYMLINK_NOFOLLOW) != 0) {
+        throw_system("Could not get entry stats: ");
+    }
+    fill_stats(sd, buf);
+    return sd;
+}
+
+// The contents of one directory, sorted by name. The directory stays open
+// so that its subdirectories can be opened relative to it.
+struct dirlisting {
+    std::unique_ptr<DIR, int (*)(DIR *)> dir{nullptr, closedir};
+    std::vector<std::string> names;
+    std::vector<fileinfo> entries;
+
+    int fd() const { return dirfd(dir.get()); }
+};
+
+// Entries are looked up relative to the directory's descriptor, so the
+// kernel does not resolve the whole path again for each of them.
+dirlisting list_dir_at(int parentfd, const std::string &name, const std::string &dirname) {
+    const int fd =
+        openat(parentfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0) {
+        throw_system("Could not open directory: ");
+    }
+    dirlisting l;
+    l.dir.reset(fdopendir(fd));
+    if(!l.dir) {
+        close(fd);
+        throw_system("Could not open directory: ");
+    }
+    errno = 0;
+    while(const dirent *e = readdir(l.dir.get())) {
+        if(strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) {
+            l.names.emplace_back(e->d_name);
+        }
+    }
+    if(errno != 0) {
+        throw_system("Could not read directory: ");
+    }
+    // Always set order to create reproducible zip files.
+    std::sort(l.names.begin(), l.names.end());
+    l.entries.reserve(l.names.size());
+    for(const auto &base : l.names) {
+        l.entries.push_back(stat_at(l.fd(), base.c_str(), dirname + '/' + base));
+    }
+    return l;
+}
+
+typedef std::deque<ForkedTask<dirlisting>> subdir_tasks;
+
+// Emits a listed directory and everything under it in name order. With a
+// pool the following subdirectories are listed ahead on it, at most as
+// many per directory as the pool has threads. Only listings of single
+// directories are kept, so memory use depends on the depth of the tree
+// rather than its size.
+void walk_dir(dirlisting &l, ThreadPool *pool, const EntrySink &emit) {
+    const size_t max_ahead = pool ? (size_t)pool->size() : 0;
+    size_t next_fork = 0;
+    subdir_tasks subdirs;
+    auto fork_ahead = [&]() {
+        for(; next_fork < l.entries.size() && subdirs.size() < max_ahead; ++next_fork) {
+            if(is_dir(l.entries[next_fork])) {
+                subdirs.emplace_back(pool->fork(
+                    [fd = l.fd(), base = l.names[next_fork], path = l.entries[next_fork].fname]() {
+                        return list_dir_at(fd, base, path);
+                    }));
+            }
+        }
+    };
+    try {
+        fork_ahead();
+        for(size_t i = 0; i < l.entries.size(); ++i) {
+            const bool dir = is_dir(l.entries[i]);
+            const std::string path = dir ? l.entries[i].fname : std::string();
+            emit(std::move(l.entries[i]));
+            if(!dir) {
+                continue;
+            }
+            dirlisting sub;
+            if(pool) {
+                sub = subdirs.front().join();
+                subdirs.pop_front();
+                fork_ahead();
+            } else {
+                sub = list_dir_at(l.fd(), l.names[i], path);
+            }
+            walk_dir(sub, pool, emit);
+        }
+    } catch(...) {
+        // The subdirectories are opened relative to this one, so they must
+        // be done before it is closed.
+        for(auto &t : subdirs) {
+            t.wait();
+        }
+        throw;
+    }
+}
+
+void expand_entry(const std::string &fname, ThreadPool *pool, const EntrySink &emit) {
+    auto fi = stat_at(AT_FDCWD, fname.c_str(), fname);
+    const bool dir = is_dir(fi);
+    emit(std::move(fi));
+    if(dir) {
+        dirlisting l = list_dir_at(AT_FDCWD, fname, fname);
+        walk_dir(l, pool, emit);
+    }
+}
+
+#endif
+
 } // namespace
 
 bool is_dir(const std::string &s) {
@@ -149,7 +296,7 @@ void create_dirs_for_file(const std::string &s) {
     mkdirp(s.substr(0, lastslash));
 }
 
-bool is_absolute_path(const std::string &fname) {
+bool is_absolute_path(std::string_view fname) {
     if(fname.empty()) {
         return false;
     }
@@ -163,13 +310,45 @@ bool is_absolute_path(const std::string &fname) {
     return false;
 }
 
-std::vector<fileinfo> expand_files(const std::vector<std::string> &originals) {
-    return std::accumulate(originals.begin(),
-                           originals.end(),
-                           std::vector<fileinfo>{},
-                           [](std::vector<fileinfo> res, const std::string &s) {
-                               auto n = expand_entry(s);
-                               std::move(n.begin(), n.end(), std::back_inserter(res));
-                               return res;
-                           });
+fileinfo get_entry_info(const std::string &fname) {
+#ifdef _WIN32
+    return get_unix_stats(fname);
+#else
+    return stat_at(AT_FDCWD, fname.c_str(), fname);
+#endif
+}
+
+void scan_files(const std::vector<std::string> &originals,
+                ThreadPool *pool,
+                const EntrySink &emit) {
+#ifdef _WIN32
+    (void)pool;
+    for(const auto &s : originals) {
+        for(auto &fi : expand_entry(s)) {
+            emit(std::move(fi));
+        }
+    }
+#else
+    for(const auto &s : originals) {
+        expand_entry(s, pool, emit);
+    }
+#endif
+}
+
+void scan_files(const std::vector<std::string> &originals,
+                int num_threads,
+                const EntrySink &emit) {
+    std::unique_ptr<ThreadPool> pool;
+    if(num_threads > 1) {
+        pool.reset(new ThreadPool(num_threads));
+    }
+    scan_files(originals, pool.get(), emit);
+}
+
+std::vector<fileinfo> expand_files(const std::vector<std::string> &originals, int num_threads) {
+    std::vector<fileinfo> result;
+    scan_files(originals, num_threads, [&result](fileinfo &&fi) {
+        result.push_back(std::move(fi));
+    });
+    return result;
 }
@@ -18,9 +18,13 @@
 #pragma once
 
 #include "zipdefs.h"
+#include <functional>
 #include <string>
+#include <string_view>
 #include <vector>
 
+class ThreadPool;
+
 bool is_dir(const std::string &s);
 bool is_dir(const fileinfo &f);
 bool is_symlink(const fileinfo &f);
@@ -28,12 +32,29 @@ bool is_file(const std::string &s);
 bool is_file(const fileinfo &f);
 bool exists_on_fs(const std::string &s);
 
-bool is_absolute_path(const std::string &fname);
+bool is_absolute_path(std::string_view fname);
 
 void mkdirp(const std::string &s);
 void create_dirs_for_file(const std::string &s);
 
-std::vector<fileinfo> expand_files(const std::vector<std::string> &originals);
+typedef std::function<void(fileinfo &&)> EntrySink;
+
+// The stats of one entry, a symlink is not followed.
+fileinfo get_entry_info(const std::string &fname);
+
+// Passes the given entries and everything in the directories among them to
+// emit, in an order that only depends on their names. Directories are
+// scanned on num_threads threads. An exception from emit stops the scan.
+void scan_files(const std::vector<std::string> &originals, int num_threads, const EntrySink &emit);
+// The same on a pool that may be shared with other work, or on the calling
+// thread only if pool is null.
+void scan_files(const std::vector<std::string> &originals,
+                ThreadPool *pool,
+                const EntrySink &emit);
+
+// Like scan_files, but returns all entries at once.
+std::vector<fileinfo> expand_files(const std::vector<std::string> &originals,
+                                   int num_threads = 1);
 
 #if defined _WIN32
 #if !defined S_ISDIR
@@ -36,6 +36,17 @@ MMapper::MMapper(const File &f) {
     addr = MapViewOfFile(h, FILE_MAP_READ, 0, 0, 0);
 }
 
+MMapper::MMapper(const File &f, uint64_t size) {
+    map_size = size;
+    h = CreateFileMapping((HANDLE)_get_osfhandle(f.fileno()),
+                          nullptr,
+                          PAGE_READWRITE,
+                          (DWORD)(size >> 32),
+                          (DWORD)size,
+                          nullptr);
+    addr = MapViewOfFile(h, FILE_MAP_WRITE, 0, 0, size);
+}
+
 #else
 MMapper::MMapper(const File &f) {
     map_size = f.size();
@@ -49,6 +60,18 @@ MMapper::MMapper(const File &f) {
         }
     }
 }
+
+MMapper::MMapper(const File &f, uint64_t size) {
+    map_size = size;
+    if(map_size == 0) {
+        addr = nullptr;
+    } else {
+        addr = ::mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, f.fileno(), 0);
+        if(addr == MAP_FAILED) {
+            throw_system("Could not mmap file:");
+        }
+    }
+}
 #endif
 
 MMapper::MMapper(MMapper &&other) {
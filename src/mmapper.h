@@ -28,6 +28,9 @@ class File;
 class MMapper final {
 public:
     explicit MMapper(const File &file);
+    // Maps the first size bytes of the file for writing. The file must
+    // already be at least that big.
+    MMapper(const File &file, uint64_t size);
     MMapper(const MMapper &) = delete;
     MMapper(MMapper &&other);
     MMapper &operator=(const MMapper &) = delete;
@@ -37,6 +40,7 @@ public:
     uint64_t size() const { return map_size; }
 
     operator unsigned char *() { return reinterpret_cast<unsigned char *>(addr); }
+    const unsigned char *data() const { return reinterpret_cast<const unsigned char *>(addr); }
 
 private:
     void *addr;
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+/*
+ * Finds entries by name in constant time. An open addressing table with
+ * linear probing that holds a part of each name's hash and the index of
+ * the entry. The names themselves stay wherever the entries keep them
+ * and are fetched through name_of(index) only to confirm a match.
+ */
+class NameIndex final {
+public:
+    static const constexpr size_t npos = SIZE_MAX;
+
+    template<typename NameOf> void build(size_t num_entries, const NameOf &name_of) {
+        if(num_entries >= UINT32_MAX) {
+            throw std::runtime_error("Too many entries to index.");
+        }
+        // At most 70% full, probe sequences stay short.
+        size_t capacity = 16;
+        while(capacity * 7 < num_entries * 10) {
+            capacity *= 2;
+        }
+        slots.assign(capacity, Slot{0, 0});
+        mask = capacity - 1;
+        for(size_t i = 0; i < num_entries; ++i) {
+            const uint64_t h = hash(name_of(i));
+            size_t pos = h & mask;
+            while(slots[pos].index != 0) {
+                pos = (pos + 1) & mask;
+            }
+            slots[pos] = Slot{uint32_t(h >> 32), uint32_t(i + 1)};
+        }
+    }
+
+    // Returns the first entry with the name or npos.
+    template<typename NameOf>
+    size_t find(std::string_view name, const NameOf &name_of) const {
+        if(slots.empty()) {
+            return npos;
+        }
+        const uint64_t h = hash(name);
+        const uint32_t tag = uint32_t(h >> 32);
+        for(size_t pos = h & mask; slots[pos].index != 0; pos = (pos + 1) & mask) {
+            const Slot &s = slots[pos];
+            if(s.tag == tag && name_of(s.index - 1) == name) {
+                return s.index - 1;
+            }
+        }
+        return npos;
+    }
+
+private:
+    // FNV-1a.
+    static uint64_t hash(std::string_view s) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for(const char c : s) {
+            h = (h ^ (unsigned char)c) * 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    // Index zero marks an empty slot, entry i is stored as i + 1.
+    struct Slot {
+        uint32_t tag;
+        uint32_t index;
+    };
+
+    std::vector<Slot> slots;
+    size_t mask = 0;
+};
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+// Lets one thread sleep until any of several producers has something to say.
+// Read the generation before checking for work and wait on it if there was
+// none, then no notification can get lost in between.
+class Notifier final {
+public:
+    uint64_t generation() const {
+        std::lock_guard<std::mutex> l(m);
+        return gen;
+    }
+
+    void notify() {
+        {
+            std::lock_guard<std::mutex> l(m);
+            ++gen;
+        }
+        cv.notify_all();
+    }
+
+    void wait_for_change(uint64_t seen) const {
+        std::unique_lock<std::mutex> l(m);
+        cv.wait(l, [this, seen] { return gen != seen; });
+    }
+
+    // Jobs on a thread pool that outlives the owner of the notifier say when
+    // they start and end, so the owner can wait for them before going away.
+    void job_started() {
+        std::lock_guard<std::mutex> l(m);
+        ++jobs;
+    }
+
+    void job_done() {
+        std::lock_guard<std::mutex> l(m);
+        --jobs;
+        ++gen;
+        // Under the lock, the notifier may be gone as soon as it is released.
+        cv.notify_all();
+    }
+
+    void wait_for_jobs() const {
+        std::unique_lock<std::mutex> l(m);
+        cv.wait(l, [this] { return jobs == 0; });
+    }
+
+private:
+    mutable std::mutex m;
+    mutable std::condition_variable cv;
+    uint64_t gen = 0;
+    uint64_t jobs = 0;
+};
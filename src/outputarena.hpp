@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+// The compressed data of a batch of small files, back to back in one
+// growing buffer. It can be written to like a ByteQueue, but it never
+// blocks and the data stays put until the arena is destroyed.
+class OutputArena final {
+public:
+    void push(const char *data, int64_t inbuf_size) {
+        if(inbuf_size < 0) {
+            throw std::logic_error("Negative value used for input buffer size.");
+        }
+        reserve(inbuf_size);
+        memcpy(buf.get() + used, data, inbuf_size);
+        used += inbuf_size;
+    }
+    void push(const unsigned char *data, int64_t inbuf_size) {
+        push(reinterpret_cast<const char *>(data), inbuf_size);
+    }
+
+    // Free space at the end of the arena, grows it if there is none.
+    unsigned char *space() {
+        if(used == allocated) {
+            reserve(1);
+        }
+        return reinterpret_cast<unsigned char *>(buf.get() + used);
+    }
+
+    int64_t space_size() const { return allocated - used; }
+
+    void commit(const int64_t size) {
+        assert(size >= 0 && used + size <= allocated);
+        used += size;
+    }
+
+    // Throws away everything after the given size, for entries that failed.
+    void truncate(const int64_t size) {
+        assert(size >= 0 && size <= used);
+        used = size;
+    }
+
+    const char *data() const { return buf.get(); }
+    int64_t size() const { return used; }
+
+private:
+    void reserve(const int64_t size) {
+        if(used + size <= allocated) {
+            return;
+        }
+        const int64_t new_size = std::max({used + size, 2 * allocated, MIN_SIZE});
+        std::unique_ptr<char[]> grown(new char[new_size]);
+        if(used > 0) {
+            memcpy(grown.get(), buf.get(), used);
+        }
+        buf = std::move(grown);
+        allocated = new_size;
+    }
+
+    static constexpr int64_t MIN_SIZE = 64 * 1024;
+
+    std::unique_ptr<char[]> buf;
+    int64_t allocated = 0;
+    int64_t used = 0;
+};
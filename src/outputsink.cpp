@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "outputsink.h"
+#include "utils.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+
+namespace {
+
+const constexpr uint64_t BOUNCE_SIZE = 1024 * 1024;
+
+} // namespace
+
+OutputSink::OutputSink()
+    : bounce(new unsigned char[BOUNCE_SIZE]), start(bounce.get()), capacity(BOUNCE_SIZE),
+      crcvalue(CRC32(nullptr, 0)) {}
+
+OutputSink::OutputSink(unsigned char *mem, uint64_t size)
+    : start(mem), capacity(size), crcvalue(CRC32(nullptr, 0)) {}
+
+OutputSink::~OutputSink() {}
+
+void OutputSink::commit(uint64_t n) {
+    crcvalue = CRC32(start + used, n, crcvalue);
+    written += n;
+    if(bounce) {
+        pass_on(start, n);
+        return;
+    }
+    used += n;
+    if(used == capacity) {
+        grow();
+    }
+}
+
+uint64_t OutputSink::write(const unsigned char *data, uint64_t n) {
+    if(bounce) {
+        crcvalue = CRC32(data, n, crcvalue);
+        written += n;
+        pass_on(data, n);
+        return n;
+    }
+    uint64_t done = 0;
+    while(done < n && space_size() > 0) {
+        const uint64_t step = std::min(n - done, space_size());
+        memcpy(space(), data + done, step);
+        commit(step);
+        done += step;
+    }
+    return done;
+}
+
+void OutputSink::pass_on(const unsigned char *, uint64_t) {}
+
+void BufferSink::reset(unsigned char *buf, uint64_t size) {
+    start = buf;
+    capacity = size;
+    used = 0;
+}
+
+VectorSink::VectorSink(std::vector<unsigned char> &v)
+    : OutputSink(nullptr, 0), v(v), original_size(v.size()) {
+    grow();
+}
+
+VectorSink::~VectorSink() { v.resize(original_size + used); }
+
+void VectorSink::grow() {
+    v.resize(std::max<size_t>(v.size() * 2, original_size + BOUNCE_SIZE));
+    start = v.data() + original_size;
+    capacity = v.size() - original_size;
+}
+
+void CallbackSink::pass_on(const unsigned char *data, uint64_t n) {
+    if(n > 0) {
+        cb(data, n);
+    }
+}
+
+void FdSink::pass_on(const unsigned char *data, uint64_t n) {
+    while(n > 0) {
+#ifdef _WIN32
+        const int r = _write(fd, data, (unsigned int)std::min<uint64_t>(n, INT_MAX));
+#else
+        const ssize_t r = ::write(fd, data, std::min<uint64_t>(n, SSIZE_MAX));
+#endif
+        if(r < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw_system("Could not write to file:");
+        }
+        data += r;
+        n -= r;
+    }
+}
+
+void FileSink::pass_on(const unsigned char *data, uint64_t n) {
+    if(f && (fwrite(data, 1, n, f) != n || ferror(f))) {
+        throw_system("Could not write to file:");
+    }
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <vector>
+
+/*
+ * Where the decoders put their output. Decoders write into space() and
+ * then commit how much of it they filled, so that data is decoded in
+ * place whenever the sink has a place for it. The CRC is computed as the
+ * data comes in, while it is still in cache.
+ *
+ * Sinks that pass the data on elsewhere have a bounce buffer of their own
+ * and hand over every commit as it is made. Sinks that keep the data
+ * hand out their own memory as the space.
+ */
+class OutputSink {
+public:
+    virtual ~OutputSink();
+
+    // Room for the decoder to write to.
+    unsigned char *space() { return start + used; }
+    uint64_t space_size() const { return capacity - used; }
+
+    // Marks that many bytes of space as decoded.
+    void commit(uint64_t n);
+
+    // For data that needs no decoding. Returns how much of it fit, which
+    // is all of it unless the sink is full.
+    uint64_t write(const unsigned char *data, uint64_t n);
+
+    // A sink with fixed memory can fill up if the entry is bigger than its
+    // header says.
+    bool full() const { return !bounce && used == capacity; }
+    void set_overflow() { overflow = true; }
+    bool overflowed() const { return overflow; }
+
+    uint32_t crc() const { return crcvalue; }
+    uint64_t total() const { return written; }
+
+protected:
+    // A sink that passes its data on.
+    OutputSink();
+    // A sink that keeps its data in the given memory.
+    OutputSink(unsigned char *mem, uint64_t size);
+
+    // Bounce buffered sinks get every piece of data through this.
+    virtual void pass_on(const unsigned char *data, uint64_t n);
+    // Memory sinks may make room once they are full.
+    virtual void grow() {}
+
+    std::unique_ptr<unsigned char[]> bounce;
+    unsigned char *start;
+    uint64_t capacity;
+    uint64_t used = 0;
+
+private:
+    uint64_t written = 0;
+    uint32_t crcvalue;
+    bool overflow = false;
+};
+
+// Decodes into a caller's buffer. The buffer can be changed between
+// decoder calls, the CRC and total carry on.
+class BufferSink final : public OutputSink {
+public:
+    BufferSink(unsigned char *buf, uint64_t size) : OutputSink(buf, size) {}
+
+    void reset(unsigned char *buf, uint64_t size);
+    // How much of the current buffer is filled.
+    uint64_t size() const { return used; }
+};
+
+// Appends to a vector, growing it as needed. The vector is bigger than the
+// data while decoding goes on and gets its final size when the sink is
+// destroyed.
+class VectorSink final : public OutputSink {
+public:
+    explicit VectorSink(std::vector<unsigned char> &v);
+    ~VectorSink();
+
+private:
+    void grow() override;
+
+    std::vector<unsigned char> &v;
+    size_t original_size;
+};
+
+// Passes the data to a function as it is decoded.
+class CallbackSink final : public OutputSink {
+public:
+    typedef std::function<void(const unsigned char *data, size_t size)> Callback;
+
+    explicit CallbackSink(Callback cb) : cb(std::move(cb)) {}
+
+private:
+    void pass_on(const unsigned char *data, uint64_t n) override;
+
+    Callback cb;
+};
+
+// Writes to a file descriptor at its current position.
+class FdSink final : public OutputSink {
+public:
+    explicit FdSink(int fd) : fd(fd) {}
+
+private:
+    void pass_on(const unsigned char *data, uint64_t n) override;
+
+    int fd;
+};
+
+// Writes to a FILE. Without one the data is only counted and checksummed,
+// which is how entries are skipped.
+class FileSink final : public OutputSink {
+public:
+    explicit FileSink(FILE *f) : f(f) {}
+
+private:
+    void pass_on(const unsigned char *data, uint64_t n) override;
+
+    FILE *f;
+};
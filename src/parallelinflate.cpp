@@ -0,0 +1,848 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The block header checks follow puff.c by Mark Adler. The idea of decoding
+ * with an unknown window and fixing it up afterwards is from pugz and
+ * rapidgzip. */
+
+#include "parallelinflate.h"
+#include "taskcontrol.h"
+#include "threadpool.h"
+#include "utils.h"
+#include "zipparse.h"
+
+#include <zlib.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+const constexpr uint64_t WINDOW_SIZE = 32 * 1024;
+const constexpr uint64_t MIN_CHUNK_SIZE = 256 * 1024;
+const constexpr uint64_t OUTPUT_STEP = 1024 * 1024;
+// Chunks that would inflate to more than this many times their size are
+// decoded sequentially in pieces of that size.
+const constexpr uint64_t MAX_CHUNK_RATIO = 8;
+// Upper limit for the output of all speculative chunks in flight, each of
+// which is kept twice to track bytes from the unknown window.
+const constexpr uint64_t SPECULATION_BUDGET =
+    sizeof(void *) > 4 ? 1024 * 1024 * 1024 : 128 * 1024 * 1024;
+const constexpr uint64_t MAX_INPUT_STEP = 1024 * 1024 * 1024;
+const constexpr int MAXBITS = 15;
+
+// Reads deflate's LSB first bit stream. Running out of data is the usual
+// way for a guessed block start to fail so it only sets a flag.
+class BitReader final {
+public:
+    BitReader(const unsigned char *data, uint64_t data_size, uint64_t bitpos)
+        : data(data), data_size(data_size), bitpos(bitpos) {}
+
+    uint32_t get(int n) {
+        uint32_t v = 0;
+        int got = 0;
+        while(got < n) {
+            const uint64_t byte = bitpos >> 3;
+            if(byte >= data_size) {
+                overflow = true;
+                return 0;
+            }
+            const int offset = bitpos & 7;
+            const int take = std::min(8 - offset, n - got);
+            v |= ((data[byte] >> offset) & ((1u << take) - 1)) << got;
+            got += take;
+            bitpos += take;
+        }
+        return v;
+    }
+
+    bool overflowed() const { return overflow; }
+
+private:
+    const unsigned char *data;
+    uint64_t data_size;
+    uint64_t bitpos;
+    bool overflow = false;
+};
+
+struct huffman {
+    short count[MAXBITS + 1];
+    short symbol[286];
+};
+
+// Returns zero for a complete code, a positive number for an incomplete
+// one and a negative number for an over-subscribed one.
+int construct(huffman &h, const uint8_t *length, int n) {
+    std::fill(h.count, h.count + MAXBITS + 1, 0);
+    for(int sym = 0; sym < n; ++sym) {
+        h.count[length[sym]]++;
+    }
+    if(h.count[0] == n) {
+        return 0;
+    }
+    int left = 1;
+    for(int len = 1; len <= MAXBITS; ++len) {
+        left <<= 1;
+        left -= h.count[len];
+        if(left < 0) {
+            return left;
+        }
+    }
+    short offs[MAXBITS + 1];
+    offs[1] = 0;
+    for(int len = 1; len < MAXBITS; ++len) {
+        offs[len + 1] = offs[len] + h.count[len];
+    }
+    for(int sym = 0; sym < n; ++sym) {
+        if(length[sym] != 0) {
+            h.symbol[offs[length[sym]]++] = sym;
+        }
+    }
+    return left;
+}
+
+int decode(BitReader &r, const huffman &h) {
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    for(int len = 1; len <= MAXBITS; ++len) {
+        code |= r.get(1);
+        const int count = h.count[len];
+        if(code - count < first) {
+            return h.symbol[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+// A cheap first look at the block header starting at bitpos. Nearly all
+// bit positions are rejected here.
+bool may_be_dynamic_header(const unsigned char *data, uint64_t data_size, uint64_t bitpos) {
+    const uint64_t byte = bitpos / 8;
+    if(byte + 16 > data_size) {
+        return true;
+    }
+    const uint64_t low = load64le(data + byte) >> (bitpos % 8);
+    if(((low >> 1) & 3) != 2 || ((low >> 3) & 31) > 29 || ((low >> 8) & 31) > 29) {
+        return false;
+    }
+    // Both words hold 56 valid bits.
+    const uint64_t high = load64le(data + byte + 7) >> (bitpos % 8);
+    const int ncode = ((low >> 13) & 15) + 4;
+    int kraft = 0;
+    for(int i = 0; i < ncode; ++i) {
+        const int offset = 17 + 3 * i;
+        const int len = (offset + 3 <= 56 ? low >> offset : high >> (offset - 56)) & 7;
+        if(len != 0) {
+            kraft += 1 << (7 - len);
+        }
+    }
+    return kraft == 128;
+}
+
+// Checks whether a dynamic Huffman block header that zlib would accept
+// starts at the given bit. Random data almost never passes this.
+bool plausible_dynamic_header(const unsigned char *data, uint64_t data_size, uint64_t bitpos) {
+    static const uint8_t order[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    BitReader r(data, data_size, bitpos);
+    r.get(1); // Last block or not, both are fine.
+    if(r.get(2) != 2) {
+        return false;
+    }
+    const int nlen = r.get(5) + 257;
+    const int ndist = r.get(5) + 1;
+    const int ncode = r.get(4) + 4;
+    if(nlen > 286 || ndist > 30) {
+        return false;
+    }
+    uint8_t lengths[286 + 30] = {0};
+    for(int i = 0; i < ncode; ++i) {
+        lengths[order[i]] = r.get(3);
+    }
+    if(r.overflowed()) {
+        return false;
+    }
+    // The code length code must be complete. Checking the Kraft sum first
+    // is much cheaper and rejects nearly all false candidates.
+    int kraft = 0;
+    for(int i = 0; i < 19; ++i) {
+        if(lengths[i] != 0) {
+            kraft += 1 << (7 - lengths[i]);
+        }
+    }
+    huffman h;
+    if(kraft != 128 || construct(h, lengths, 19) != 0) {
+        return false;
+    }
+    int index = 0;
+    while(index < nlen + ndist) {
+        const int sym = decode(r, h);
+        if(sym < 0 || r.overflowed()) {
+            return false;
+        }
+        if(sym < 16) {
+            lengths[index++] = sym;
+            continue;
+        }
+        uint8_t len = 0;
+        int rep;
+        if(sym == 16) {
+            if(index == 0) {
+                return false;
+            }
+            len = lengths[index - 1];
+            rep = 3 + r.get(2);
+        } else if(sym == 17) {
+            rep = 3 + r.get(3);
+        } else {
+            rep = 11 + r.get(7);
+        }
+        if(index + rep > nlen + ndist) {
+            return false;
+        }
+        while(rep-- > 0) {
+            lengths[index++] = len;
+        }
+    }
+    if(r.overflowed() || lengths[256] == 0) {
+        return false;
+    }
+    // Incomplete codes are only allowed if they have just one symbol.
+    int err = construct(h, lengths, nlen);
+    if(err < 0 || (err > 0 && nlen - h.count[0] != 1)) {
+        return false;
+    }
+    err = construct(h, lengths + nlen, ndist);
+    if(err < 0 || (err > 0 && ndist - h.count[0] != 1)) {
+        return false;
+    }
+    return true;
+}
+
+// Two dictionaries that differ in every byte. A byte copied from the
+// unknown window comes out different from the two decoders, and the pair
+// of values tells which window position it came from.
+struct markerdicts {
+    unsigned char low[WINDOW_SIZE];
+    unsigned char high[WINDOW_SIZE];
+
+    markerdicts() {
+        for(uint64_t k = 0; k < WINDOW_SIZE; ++k) {
+            low[k] = k & 0xFF;
+            high[k] = k >> 8;
+            if(high[k] == low[k]) {
+                high[k] += 128;
+            }
+        }
+    }
+
+    static uint64_t position(unsigned char l, unsigned char h) {
+        return h >= 128 ? ((uint64_t)(h - 128) << 8) | l : ((uint64_t)h << 8) | l;
+    }
+};
+
+const markerdicts &marker_dicts() {
+    static const markerdicts d;
+    return d;
+}
+
+class Inflater final {
+public:
+    Inflater() {
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+        strm.avail_in = 0;
+        strm.next_in = Z_NULL;
+        if(inflateInit2(&strm, -15) != Z_OK) {
+            throw std::runtime_error("Could not init zlib.");
+        }
+    }
+    Inflater(const Inflater &) = delete;
+    Inflater &operator=(const Inflater &) = delete;
+    ~Inflater() { inflateEnd(&strm); }
+
+    // Prepares to decode starting at an arbitrary bit of the input.
+    void start(const unsigned char *data,
+               uint64_t data_size,
+               uint64_t bitpos,
+               const unsigned char *dict,
+               uint64_t dict_size) {
+        inflateReset(&strm);
+        input_end = data + data_size;
+        const uint64_t byte = bitpos / 8;
+        const int skip = bitpos % 8;
+        if(skip != 0) {
+            inflatePrime(&strm, 8 - skip, data[byte] >> skip);
+            strm.next_in = const_cast<unsigned char *>(data + byte + 1);
+        } else {
+            strm.next_in = const_cast<unsigned char *>(data + byte);
+        }
+        strm.avail_in = 0;
+        if(dict_size > 0) {
+            inflateSetDictionary(&strm, dict, dict_size);
+        }
+        base = data;
+    }
+
+    int run(unsigned char *out, uint64_t out_size, int flush) {
+        if(strm.avail_in == 0) {
+            strm.avail_in = std::min<uint64_t>(input_end - strm.next_in, MAX_INPUT_STEP);
+        }
+        strm.next_out = out;
+        strm.avail_out = std::min(out_size, MAX_INPUT_STEP);
+        const uInt before = strm.avail_out;
+        const int ret = inflate(&strm, flush);
+        produced = before - strm.avail_out;
+        return ret;
+    }
+
+    uint64_t last_produced() const { return produced; }
+    bool input_exhausted() const { return strm.avail_in == 0 && strm.next_in == input_end; }
+    // Zlib stops after the last block too, the stream only ends on the
+    // next call.
+    bool at_block_end() const { return (strm.data_type & 192) == 128; }
+    uint64_t bit_position() const {
+        return (strm.next_in - base) * 8 - (strm.data_type & 7);
+    }
+    const char *msg() const { return strm.msg ? strm.msg : "Deflate stream is corrupt."; }
+
+private:
+    z_stream strm;
+    const unsigned char *base = nullptr;
+    const unsigned char *input_end = nullptr;
+    uint64_t produced = 0;
+};
+
+// Checks that zlib can decode the whole first block starting at bitpos.
+bool decodes_first_block(Inflater &inf,
+                         const unsigned char *data,
+                         uint64_t data_size,
+                         uint64_t bitpos,
+                         std::vector<unsigned char> &scratch) {
+    inf.start(data, data_size, bitpos, marker_dicts().low, WINDOW_SIZE);
+    while(true) {
+        const int ret = inf.run(scratch.data(), scratch.size(), Z_BLOCK);
+        if(ret == Z_STREAM_END) {
+            return true;
+        }
+        if(ret != Z_OK) {
+            return false;
+        }
+        if(inf.at_block_end()) {
+            return true;
+        }
+        if(inf.input_exhausted()) {
+            return false;
+        }
+    }
+}
+
+bool next_block_is_dynamic(const unsigned char *data, uint64_t data_size, uint64_t bitpos) {
+    BitReader r(data, data_size, bitpos);
+    r.get(1);
+    return r.get(2) == 2 && !r.overflowed();
+}
+
+struct inflatechunk {
+    bool ok = false;
+    bool final = false;
+    uint64_t start_bit = 0;
+    uint64_t end_bit = 0;
+    // End of the input range this chunk searched in, in bits.
+    uint64_t search_end = 0;
+    // Bytes that came from the unknown window differ between these two.
+    std::vector<unsigned char> data;
+    std::vector<unsigned char> alt;
+};
+
+enum class ChunkEnd {
+    OK,
+    // The block start the search found was a false positive.
+    FALSE_START,
+    GIVE_UP,
+};
+
+// Searches [start, end_bit) for the first position that parses as a
+// dynamic block header which zlib can decode a whole block from.
+bool find_block_start(Inflater &inf,
+                      const unsigned char *data,
+                      uint64_t data_size,
+                      uint64_t &start,
+                      uint64_t end_bit,
+                      const TaskControl &tc,
+                      const std::atomic<bool> &abandon) {
+    std::vector<unsigned char> scratch(256 * 1024);
+    for(; start < end_bit; ++start) {
+        if(start % (64 * 1024) == 0) {
+            tc.throw_if_stopped();
+            if(abandon) {
+                return false;
+            }
+        }
+        if(may_be_dynamic_header(data, data_size, start) &&
+           plausible_dynamic_header(data, data_size, start) &&
+           decodes_first_block(inf, data, data_size, start, scratch)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Decodes with the started inflaters up to the first block boundary at or
+// after end that is followed by a dynamic block. Gives up rather than
+// produce more than max_output bytes.
+ChunkEnd decode_from(inflatechunk &c,
+                     Inflater &inf,
+                     Inflater &alt_inf,
+                     bool first,
+                     const unsigned char *data,
+                     uint64_t data_size,
+                     uint64_t end,
+                     uint64_t max_output,
+                     const TaskControl &tc,
+                     const std::atomic<bool> &abandon) {
+    uint64_t produced = 0;
+    while(true) {
+        if(c.data.size() - produced < OUTPUT_STEP) {
+            if(c.data.size() >= max_output) {
+                return ChunkEnd::GIVE_UP;
+            }
+            c.data.resize(c.data.size() + OUTPUT_STEP);
+            if(!first) {
+                c.alt.resize(c.data.size());
+            }
+        }
+        const uint64_t room = c.data.size() - produced;
+        const int ret = inf.run(c.data.data() + produced, room, Z_BLOCK);
+        if(!first) {
+            const int alt_ret = alt_inf.run(c.alt.data() + produced, room, Z_BLOCK);
+            if(alt_ret != ret || alt_inf.last_produced() != inf.last_produced()) {
+                return ChunkEnd::FALSE_START;
+            }
+        }
+        if(ret != Z_OK && ret != Z_STREAM_END) {
+            return ChunkEnd::FALSE_START;
+        }
+        produced += inf.last_produced();
+        if(ret == Z_STREAM_END) {
+            c.final = true;
+            c.end_bit = inf.bit_position();
+            break;
+        }
+        if(inf.at_block_end() && inf.bit_position() >= end * 8 &&
+           next_block_is_dynamic(data, data_size, inf.bit_position())) {
+            c.end_bit = inf.bit_position();
+            break;
+        }
+        if(inf.input_exhausted()) {
+            return ChunkEnd::FALSE_START;
+        }
+        tc.throw_if_stopped();
+        if(abandon) {
+            return ChunkEnd::GIVE_UP;
+        }
+    }
+    c.data.resize(produced);
+    c.alt.resize(first ? 0 : produced);
+    return ChunkEnd::OK;
+}
+
+/*
+ * Decodes from the first block start in [begin, end) that turns out to be
+ * real, up to the first block boundary at or after end that is followed by a dynamic
+ * block, which is where the search of the next chunk would land. A chunk
+ * that would produce more than max_output bytes is left to the
+ * sequential decoder, so that memory use does not depend on the data.
+ */
+inflatechunk decode_chunk(const unsigned char *data,
+                          uint64_t data_size,
+                          uint64_t begin,
+                          uint64_t end,
+                          uint64_t max_output,
+                          const TaskControl &tc,
+                          const std::atomic<bool> &abandon) {
+    const bool first = begin == 0;
+    Inflater inf;
+    Inflater alt_inf;
+    uint64_t start = begin * 8;
+    while(true) {
+        inflatechunk c;
+        c.search_end = end * 8;
+        if(first) {
+            inf.start(data, data_size, 0, nullptr, 0);
+        } else {
+            if(!find_block_start(inf, data, data_size, start, end * 8, tc, abandon)) {
+                return c;
+            }
+            inf.start(data, data_size, start, marker_dicts().low, WINDOW_SIZE);
+            alt_inf.start(data, data_size, start, marker_dicts().high, WINDOW_SIZE);
+        }
+        c.start_bit = start;
+        const ChunkEnd result =
+            decode_from(c, inf, alt_inf, first, data, data_size, end, max_output, tc, abandon);
+        if(result == ChunkEnd::OK) {
+            c.ok = true;
+            return c;
+        }
+        if(result == ChunkEnd::GIVE_UP || first) {
+            inflatechunk failed;
+            failed.search_end = end * 8;
+            return failed;
+        }
+        ++start;
+    }
+}
+
+// Replaces bytes that came from the unknown window with the real ones.
+void resolve_window(inflatechunk &c,
+                    uint64_t begin,
+                    uint64_t end,
+                    const std::vector<unsigned char> &window) {
+    if(c.alt.empty()) {
+        return;
+    }
+    const uint64_t missing = WINDOW_SIZE - window.size();
+    for(uint64_t i = begin; i < end; ++i) {
+        if(c.data[i] == c.alt[i]) {
+            continue;
+        }
+        const uint64_t k = markerdicts::position(c.data[i], c.alt[i]);
+        if(k < missing) {
+            throw std::runtime_error("Deflate stream refers to data before its start.");
+        }
+        c.data[i] = window[k - missing];
+    }
+}
+
+void write_at(int fd, const unsigned char *buf, uint64_t size, uint64_t offset) {
+#ifdef _WIN32
+    throw std::runtime_error("Positional writes are not supported on Windows.");
+#else
+    while(size > 0) {
+        const auto r = pwrite(fd, buf, size, offset);
+        if(r < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw_system("Could not write to file:");
+        }
+        buf += r;
+        size -= r;
+        offset += r;
+    }
+#endif
+}
+
+// Inflates one segment to its place in the output. Only the last segment
+// ends the deflate stream, the others just run out of input after a sync
+// flush.
+uint32_t inflate_segment(const unsigned char *data,
+                         uint64_t data_size,
+                         int fd,
+                         uint64_t out_offset,
+                         uint64_t out_size,
+                         bool last,
+                         const TaskControl &tc) {
+    Inflater inf;
+    inf.start(data, data_size, 0, nullptr, 0);
+    std::vector<unsigned char> buf(std::min(out_size, OUTPUT_STEP));
+    uint32_t crc = CRC32(nullptr, 0);
+    uint64_t written = 0;
+    bool ended = false;
+    while(!ended) {
+        tc.throw_if_stopped();
+        const int ret = inf.run(buf.data(), buf.size(), Z_NO_FLUSH);
+        if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            throw std::runtime_error(inf.msg());
+        }
+        const uint64_t produced = inf.last_produced();
+        if(produced > out_size - written) {
+            throw std::runtime_error("Segment is bigger than the segment index says.");
+        }
+        crc = CRC32(buf.data(), produced, crc);
+        write_at(fd, buf.data(), produced, out_offset + written);
+        written += produced;
+        ended = ret == Z_STREAM_END;
+        if(produced == 0 && inf.input_exhausted()) {
+            break;
+        }
+    }
+    if(written != out_size || ended != last) {
+        throw std::runtime_error("Segment does not match the segment index.");
+    }
+    return crc;
+}
+
+/*
+ * Decodes sequentially with a known window from start_bit up to the first
+ * block boundary at or after stop_bit, optionally only one followed by a
+ * dynamic block. This covers the parts of the stream where the speculative
+ * chunks did not line up. Stops at the first block boundary after
+ * max_output bytes too, reached tells whether stop_bit was reached.
+ */
+inflatechunk bridge(const unsigned char *data,
+                    uint64_t data_size,
+                    uint64_t start_bit,
+                    uint64_t stop_bit,
+                    bool need_dynamic,
+                    uint64_t max_output,
+                    const std::vector<unsigned char> &window,
+                    const TaskControl &tc,
+                    bool &reached) {
+    reached = false;
+    inflatechunk c;
+    c.start_bit = start_bit;
+    Inflater inf;
+    inf.start(data, data_size, start_bit, window.data(), window.size());
+    uint64_t produced = 0;
+    while(true) {
+        if(c.data.size() - produced < OUTPUT_STEP) {
+            c.data.resize(c.data.size() + OUTPUT_STEP);
+        }
+        const int ret = inf.run(c.data.data() + produced, c.data.size() - produced, Z_BLOCK);
+        if(ret == Z_BUF_ERROR && inf.input_exhausted()) {
+            throw std::runtime_error("Deflate stream ended prematurely.");
+        }
+        if(ret != Z_OK && ret != Z_STREAM_END) {
+            throw std::runtime_error(inf.msg());
+        }
+        produced += inf.last_produced();
+        if(ret == Z_STREAM_END) {
+            c.final = true;
+            reached = true;
+            break;
+        }
+        if(inf.at_block_end() && inf.bit_position() >= stop_bit &&
+           (!need_dynamic || next_block_is_dynamic(data, data_size, inf.bit_position()))) {
+            reached = true;
+            break;
+        }
+        if(inf.at_block_end() && produced >= max_output) {
+            break;
+        }
+        tc.throw_if_stopped();
+    }
+    c.end_bit = inf.bit_position();
+    c.data.resize(produced);
+    c.ok = true;
+    return c;
+}
+
+struct writtenchunk {
+    uint32_t crc32;
+    uint64_t size;
+};
+
+} // namespace
+
+uint32_t parallel_inflate(const unsigned char *data,
+                          uint64_t data_size,
+                          int fd,
+                          uint64_t chunk_size,
+                          ThreadPool &pool,
+                          const TaskControl &tc) {
+    chunk_size = std::max(chunk_size, MIN_CHUNK_SIZE);
+    const uint64_t num_chunks = (data_size + chunk_size - 1) / chunk_size;
+    const uint64_t max_output = MAX_CHUNK_RATIO * chunk_size;
+    const size_t max_in_flight = (size_t)std::max<uint64_t>(
+        1, std::min<uint64_t>(2 * pool.size(), SPECULATION_BUDGET / (2 * max_output)));
+    std::atomic<bool> abandon{false};
+    std::deque<ForkedTask<inflatechunk>> chunks;
+    std::deque<ForkedTask<writtenchunk>> writes;
+    uint64_t next_chunk = 0;
+    uint64_t expected_bit = 0;
+    uint64_t out_offset = 0;
+    uint32_t crc = crc32(0, Z_NULL, 0);
+    std::vector<unsigned char> window;
+    bool done = false;
+
+    auto finish_write = [&writes, &crc]() {
+        const auto w = writes.front().join();
+        writes.pop_front();
+        crc = crc32_combine(crc, w.crc32, w.size);
+    };
+    // Takes a chunk that continues exactly where the previous one ended.
+    auto commit = [&](inflatechunk &&c) {
+        // The end of this chunk is the window of the next one, so it gets
+        // fixed up here. The rest is done in parallel.
+        const uint64_t size = c.data.size();
+        const uint64_t tail = std::min(size, WINDOW_SIZE);
+        resolve_window(c, size - tail, size, window);
+        std::vector<unsigned char> new_window;
+        new_window.reserve(WINDOW_SIZE);
+        if(tail < WINDOW_SIZE) {
+            const uint64_t keep = std::min<uint64_t>(window.size(), WINDOW_SIZE - tail);
+            new_window.insert(new_window.end(), window.end() - keep, window.end());
+        }
+        new_window.insert(new_window.end(), c.data.end() - tail, c.data.end());
+        expected_bit = c.end_bit;
+        done = c.final;
+
+        auto shared = std::make_shared<inflatechunk>(std::move(c));
+        auto old_window = std::make_shared<std::vector<unsigned char>>(std::move(window));
+        writes.emplace_back(pool.fork([shared, old_window, size, tail, fd, out_offset]() {
+            resolve_window(*shared, 0, size - tail, *old_window);
+            write_at(fd, shared->data.data(), size, out_offset);
+            return writtenchunk{CRC32(shared->data.data(), size), size};
+        }));
+        window = std::move(new_window);
+        out_offset += size;
+        if(writes.size() > (size_t)pool.size()) {
+            finish_write();
+        }
+    };
+    // Sequential decoding in pieces of bounded size.
+    auto bridge_to = [&](uint64_t stop_bit, bool need_dynamic) {
+        bool reached = false;
+        while(!done && !reached) {
+            commit(bridge(data,
+                          data_size,
+                          expected_bit,
+                          stop_bit,
+                          need_dynamic,
+                          max_output,
+                          window,
+                          tc,
+                          reached));
+        }
+    };
+    try {
+        while(!done) {
+            while(next_chunk < num_chunks && chunks.size() < max_in_flight) {
+                const uint64_t begin = next_chunk * chunk_size;
+                const uint64_t end = std::min(begin + chunk_size, data_size);
+                chunks.emplace_back(
+                    pool.fork([data, data_size, begin, end, max_output, &tc, &abandon]() {
+                        return decode_chunk(data, data_size, begin, end, max_output, tc, abandon);
+                    }));
+                ++next_chunk;
+            }
+            if(chunks.empty()) {
+                bridge_to(UINT64_MAX, false);
+                continue;
+            }
+            inflatechunk c = chunks.front().join();
+            chunks.pop_front();
+            if(c.ok && c.start_bit > expected_bit) {
+                // Decode up to the guessed start and use the chunk if the
+                // two meet. If not, the guess was wrong.
+                bridge_to(c.start_bit, false);
+                if(done || c.start_bit != expected_bit) {
+                    continue;
+                }
+            } else if(!c.ok || c.start_bit != expected_bit) {
+                // Nothing usable, e.g. the chunk is all stored blocks. Go
+                // on to where the next chunk started looking.
+                if(expected_bit < c.search_end) {
+                    bridge_to(c.search_end, true);
+                }
+                continue;
+            }
+            commit(std::move(c));
+        }
+        while(!writes.empty()) {
+            finish_write();
+        }
+    } catch(...) {
+        // Everything in flight points to the input, it must finish first.
+        abandon = true;
+        for(auto &t : chunks) {
+            t.wait();
+        }
+        for(auto &t : writes) {
+            t.wait();
+        }
+        throw;
+    }
+    // The stream may end before the last chunks, which then found nothing.
+    abandon = true;
+    for(auto &t : chunks) {
+        t.wait();
+    }
+    return crc;
+}
+
+uint32_t segmented_inflate(const unsigned char *data,
+                           uint64_t uncompressed_size,
+                           const segmentindex &index,
+                           int fd,
+                           ThreadPool &pool,
+                           const TaskControl &tc) {
+    const auto &segments = index.segments;
+    const size_t max_in_flight = 2 * pool.size();
+    std::deque<ForkedTask<uint32_t>> in_flight;
+    uint64_t in_offset = 0;
+    uint64_t out_offset = 0;
+    uint32_t crc = crc32(0, Z_NULL, 0);
+    size_t next = 0;
+    size_t finished = 0;
+    // Only the last segment can be shorter.
+    auto out_size = [&](size_t i) {
+        return std::min(index.segment_size, uncompressed_size - i * index.segment_size);
+    };
+    try {
+        while(finished < segments.size()) {
+            while(next < segments.size() && in_flight.size() < max_in_flight) {
+                const uint64_t in_size = segments[next].compressed_size;
+                const bool last = next + 1 == segments.size();
+                const uint64_t size = out_size(next);
+                in_flight.emplace_back(pool.fork([=, &tc]() {
+                    return inflate_segment(data + in_offset,
+                                           in_size,
+                                           fd,
+                                           out_offset,
+                                           size,
+                                           last,
+                                           tc);
+                }));
+                in_offset += in_size;
+                out_offset += size;
+                ++next;
+            }
+            const uint32_t segment_crc = in_flight.front().join();
+            in_flight.pop_front();
+            if(segment_crc != segments[finished].crc32) {
+                throw std::runtime_error("CRC32 checksum of segment is invalid.");
+            }
+            crc = crc32_combine(crc, segment_crc, out_size(finished));
+            ++finished;
+        }
+    } catch(...) {
+        // The tasks point to the input, they must finish first.
+        for(auto &t : in_flight) {
+            t.wait();
+        }
+        throw;
+    }
+    return crc;
+}
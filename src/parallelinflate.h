@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+class TaskControl;
+class ThreadPool;
+struct segmentindex;
+
+/*
+ * Decompresses one raw deflate stream using all threads of the pool and
+ * writes the result to the start of the given file descriptor. Returns
+ * the CRC-32 of the decompressed data.
+ *
+ * The input is cut into chunks of roughly chunk_size bytes. Each chunk
+ * except the first looks for the first position that parses as a dynamic
+ * Huffman block and decodes from there without knowing the preceding 32k
+ * of output. Bytes that come from that unknown window are tracked and
+ * filled in once the previous chunk is done. A chunk is only used if the
+ * previous one ended exactly where it started. Gaps, such as runs of
+ * stored blocks, are decoded sequentially up to the next usable chunk.
+ * So are chunks that would inflate to many times their size, which keeps
+ * the memory use bounded whatever the data.
+ */
+uint32_t parallel_inflate(const unsigned char *data,
+                          uint64_t data_size,
+                          int fd,
+                          uint64_t chunk_size,
+                          ThreadPool &pool,
+                          const TaskControl &tc);
+
+/*
+ * Decompresses a deflate stream made of independently compressed
+ * segments, as listed in parzip's segment index, using all threads of the
+ * pool. Each segment is written to its place in the file descriptor and
+ * its CRC-32 is checked. Returns the CRC-32 of the whole output.
+ */
+uint32_t segmented_inflate(const unsigned char *data,
+                           uint64_t uncompressed_size,
+                           const segmentindex &index,
+                           int fd,
+                           ThreadPool &pool,
+                           const TaskControl &tc);
@@ -15,34 +15,138 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <chrono>
 #include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <vector>
 
 #ifdef _WIN32
 #include <WinSock2.h>
 #include <Windows.h>
 #endif
 
+#include "utils.h"
 #include "zipfile.h"
+#include "zipstream.h"
+
+namespace {
+
+void print_usage(const char *progname) {
+    printf("%s [options] <zip file> [entry names]\n\n", progname);
+    printf("Options:\n");
+    printf("  --threads=N                number of threads to use\n");
+    printf("  --parallel-threshold=SIZE  inflate entries at least this big on all threads,\n");
+    printf("                             0 disables\n");
+    printf("  --parallel-chunk-size=SIZE chunk size for parallel inflate\n");
+    printf("  --trust-stored             do not check CRCs of stored entries\n");
+    printf("  --memory-limit=SIZE        memory for entries read ahead from standard input\n");
+    printf("\nSizes are in bytes with an optional k, M or G suffix.\n");
+    printf("A zip file name of - reads the archive from the standard input as it comes.\n");
+    printf("If entry names are given, only those entries are unpacked.\n");
+}
+
+// Returns false if the argument is not a known option.
+bool parse_option(const std::string &arg, int &num_threads, UnpackOptions &opts) {
+    if(arg == "--trust-stored") {
+        opts.trust_stored = true;
+        return true;
+    }
+    const auto eq = arg.find('=');
+    if(eq == std::string::npos) {
+        return false;
+    }
+    const std::string name = arg.substr(0, eq);
+    const std::string value = arg.substr(eq + 1);
+    if(name == "--threads") {
+        num_threads = std::stoi(value);
+        if(num_threads < 1) {
+            throw std::invalid_argument("Thread count must be positive.");
+        }
+    } else if(name == "--parallel-threshold") {
+        opts.parallel_threshold = parse_size(value);
+    } else if(name == "--parallel-chunk-size") {
+        opts.parallel_chunk_size = parse_size(value);
+    } else if(name == "--memory-limit") {
+        opts.stream_memory_limit = parse_size(value);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Returns the number of failures.
+int extract_entries(const ZipFile &f,
+                    const std::vector<std::string> &names,
+                    const UnpackOptions &opts) {
+    int num_failures = 0;
+    for(const auto &name : names) {
+        const UnpackResult r = f.extract(name, "", opts);
+        printf("%s\n", r.msg.c_str());
+        if(!r.success) {
+            ++num_failures;
+        }
+    }
+    printf("Success: %ld\n", (long)(names.size() - num_failures));
+    printf("Fail:    %ld\n", (long)num_failures);
+    return num_failures;
+}
+
+} // namespace
 
 int main(int argc, char **argv) {
-    const int num_threads = -1;
-    if(argc != 2) {
-        printf("%s <zip file>\n", argv[0]);
+    int num_threads = -1;
+    UnpackOptions opts;
+    int first_arg = 1;
+    for(; first_arg < argc && std::string(argv[first_arg]).rfind("--", 0) == 0; ++first_arg) {
+        try {
+            if(!parse_option(argv[first_arg], num_threads, opts)) {
+                printf("Unknown option %s.\n\n", argv[first_arg]);
+                print_usage(argv[0]);
+                return 1;
+            }
+        } catch(const std::exception &e) {
+            printf("Invalid value in %s: %s\n", argv[first_arg], e.what());
+            return 1;
+        }
+    }
+    if(argc - first_arg < 1) {
+        print_usage(argv[0]);
         return 1;
     }
+    const std::vector<std::string> names(argv + first_arg + 1, argv + argc);
     int num_failures;
     try {
         size_t i = 0;
-        ZipFile f(argv[1]);
-        TaskControl *tc = f.unzip("", num_threads);
-        size_t total_tasks = tc->total();
-        while(i < total_tasks) {
-            if(i >= tc->finished()) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            } else {
+        const std::string zipname(argv[first_arg]);
+        std::unique_ptr<ZipFile> f;
+        std::unique_ptr<ZipStream> stream;
+        TaskControl *tc;
+        if(!names.empty()) {
+            if(zipname == "-") {
+                printf("Entries can not be picked from the standard input.\n");
+                return 1;
+            }
+            return extract_entries(ZipFile(zipname.c_str()), names, opts);
+        }
+        if(zipname == "-") {
+            stream.reset(new ZipStream(zipname.c_str()));
+            tc = stream->unzip("", num_threads, opts);
+        } else {
+            f.reset(new ZipFile(zipname.c_str()));
+            tc = f->unzip("", num_threads, opts);
+        }
+        while(true) {
+            const bool done = tc->state() == TASK_FINISHED;
+            if(i < tc->finished()) {
                 auto txt = tc->entry(i++);
                 printf("%s\n", txt.c_str());
+            } else if(done) {
+                break;
+            } else {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
             }
         }
         printf("Success: %ld\n", (long)tc->successes());
@@ -15,7 +15,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "filequeue.hpp"
 #include "fileutils.h"
+#include "threadpool.h"
 #include "utils.h"
 #include "zipcreator.h"
 
@@ -28,6 +30,9 @@
 #include <algorithm>
 #include <chrono>
 #include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
 #include <string>
 #include <thread>
 #include <vector>
@@ -38,78 +43,242 @@
 using std::max;
 #endif
 
+namespace {
+
+void print_usage(const char *progname) {
+    printf("%s [options] <zip file> <files to archive>\n\n", progname);
+    printf("Options:\n");
+    printf("  --threads=N                number of threads to use\n");
+    printf("  --parallel-threshold=SIZE  deflate files at least this big on all threads,\n");
+    printf("                             0 disables\n");
+    printf("  --parallel-block-size=SIZE block size for parallel deflate\n");
+    printf("  --independent-blocks       make parallel deflated files quick to unpack\n");
+    printf("  --memory-limit=SIZE        memory for compressed data waiting to be written\n");
+    printf("  --scan-window=N            start compressing while scanning, biggest first\n");
+    printf("                             among N entries, 0 scans everything first\n");
+    printf("  --files0-from=FILE         also archive the NUL separated names in FILE,\n");
+    printf("                             - is standard input\n");
+    printf("\nA zip file name of - writes the archive to the standard output.\n");
+    printf("Sizes are in bytes with an optional k, M or G suffix.\n");
+}
+
+// The scan hands this many entries to the packer at most before it waits.
+const size_t SCAN_QUEUE_SIZE = 64 * 1024;
+
+// Returns false if the argument is not a known option.
+bool parse_option(const std::string &arg,
+                  int &num_threads,
+                  PackOptions &opts,
+                  std::string &list_file) {
+    if(arg == "--independent-blocks") {
+        opts.independent_blocks = true;
+        return true;
+    }
+    const auto eq = arg.find('=');
+    if(eq == std::string::npos) {
+        return false;
+    }
+    const std::string name = arg.substr(0, eq);
+    const std::string value = arg.substr(eq + 1);
+    if(name == "--threads") {
+        num_threads = std::stoi(value);
+        if(num_threads < 1) {
+            throw std::invalid_argument("Thread count must be positive.");
+        }
+    } else if(name == "--parallel-threshold") {
+        opts.parallel_threshold = parse_size(value);
+    } else if(name == "--parallel-block-size") {
+        opts.parallel_block_size = parse_size(value);
+    } else if(name == "--memory-limit") {
+        opts.memory_limit = parse_size(value);
+    } else if(name == "--scan-window") {
+        opts.scan_window = std::stoull(value);
+    } else if(name == "--files0-from") {
+        if(value.empty()) {
+            throw std::invalid_argument("File name is empty.");
+        }
+        list_file = value;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void check_name(const std::string &name) {
+    if(name.empty()) {
+        throw std::runtime_error("Empty file name not permitted.");
+    }
+    if(is_absolute_path(name)) {
+        throw std::runtime_error("Absolute file names are forbidden in ZIP files.");
+    }
+}
+
+// The names in a list are archived as they are, without going into
+// directories, since tools like find already list everything.
+void scan_list(std::istream &list, const EntrySink &emit) {
+    std::string name;
+    while(std::getline(list, name, '\0')) {
+        check_name(name);
+        emit(get_entry_info(name));
+    }
+    if(list.bad()) {
+        throw std::runtime_error("Could not read file list.");
+    }
+}
+
+void scan_input(const std::vector<std::string> &filenames,
+                const std::string &list_file,
+                ThreadPool &pool,
+                const EntrySink &emit) {
+    scan_files(filenames, &pool, emit);
+    if(list_file == "-") {
+        scan_list(std::cin, emit);
+    } else if(!list_file.empty()) {
+        std::ifstream list(list_file, std::ios::binary);
+        if(!list) {
+            throw std::runtime_error("Could not open file list " + list_file + ".");
+        }
+        scan_list(list, emit);
+    }
+}
+
+} // namespace
+
 int main(int argc, char **argv) {
-    const int num_threads = max((int)std::thread::hardware_concurrency(), 1);
-    if(argc < 3) {
-        printf("%s <zip file> <files to archive>\n", argv[0]);
+    int num_threads = max((int)std::thread::hardware_concurrency(), 1);
+    PackOptions opts;
+    std::string list_file;
+    int first_arg = 1;
+    for(; first_arg < argc && std::string(argv[first_arg]).rfind("--", 0) == 0; ++first_arg) {
+        try {
+            if(!parse_option(argv[first_arg], num_threads, opts, list_file)) {
+                printf("Unknown option %s.\n\n", argv[first_arg]);
+                print_usage(argv[0]);
+                return 1;
+            }
+        } catch(const std::exception &e) {
+            printf("Invalid value in %s: %s\n", argv[first_arg], e.what());
+            return 1;
+        }
+    }
+    if(argc - first_arg < (list_file.empty() ? 2 : 1)) {
+        print_usage(argv[0]);
         return 1;
     }
-    if(exists_on_fs(argv[1])) {
+    const char *zipname = argv[first_arg];
+    // Messages must not end up in the archive.
+    const bool to_stdout = std::string(zipname) == "-";
+    FILE *report = to_stdout ? stderr : stdout;
+    if(!to_stdout && exists_on_fs(zipname)) {
         printf("Output file already exists, will not overwrite.\n");
         return 1;
     }
+    auto remove_output = [&]() {
+        if(!to_stdout) {
+            unlink(zipname);
+        }
+    };
 
     std::vector<std::string> filenames;
-    for(int i = 2; i < argc; i++) {
+    for(int i = first_arg + 1; i < argc; i++) {
         filenames.push_back(argv[i]);
-        if(filenames.back().empty()) {
-            printf("Empty file name not permitted.");
-            return 1;
-        }
-        if(is_absolute_path(filenames.back())) {
-            printf("Absolute file names are forbidden in ZIP files.\n");
+        try {
+            check_name(filenames.back());
+        } catch(const std::exception &e) {
+            fprintf(report, "%s\n", e.what());
             return 1;
         }
     }
-    if(filenames.empty()) {
-        printf("No input files listed.\n");
+    if(filenames.empty() && list_file.empty()) {
+        fprintf(report, "No input files listed.\n");
         return 1;
     }
+    // One pool for both the scan and the compression, they overlap when streaming.
+    ThreadPool pool(num_threads);
     std::vector<fileinfo> files;
-    try {
-        files = expand_files(filenames);
-    } catch(const std::exception &e) {
-        printf("Scanning input files failed: %s\n", e.what());
-        return 1;
+    if(opts.scan_window == 0) {
+        try {
+            scan_input(filenames, list_file, pool, [&files](fileinfo &&fi) {
+                files.push_back(std::move(fi));
+            });
+        } catch(const std::exception &e) {
+            fprintf(report, "Scanning input files failed: %s\n", e.what());
+            return 1;
+        }
+        /*
+         * First all directory entries so they get created before files that go in
+         * them. Then files starting from the biggest ones, because a big file
+         * followed by lots of small files causes waste of resources. See
+         * zipfile.cpp for the explanation.
+         */
+        auto midpoint = std::stable_partition(
+            files.begin(), files.end(), [](const fileinfo &fi) { return is_dir(fi); });
+        assert(midpoint >= files.begin());
+        assert(midpoint <= files.end());
+        std::sort(midpoint, files.end(), [](const fileinfo &f1, const fileinfo &f2) {
+            return f1.fsize > f2.fsize;
+        });
     }
-    /*
-     * First all directory entries so they get created before files that go in
-     * them. Then files starting from the biggest ones, because a big file
-     * followed by lots of small files causes waste of resources. See
-     * zipfile.cpp for the explanation.
-     */
-    auto midpoint = std::stable_partition(
-        files.begin(), files.end(), [](const fileinfo &fi) { return is_dir(fi); });
-    assert(midpoint >= files.begin());
-    assert(midpoint <= files.end());
-    std::sort(midpoint, files.end(), [](const fileinfo &f1, const fileinfo &f2) {
-        return f1.fsize > f2.fsize;
-    });
-    ZipCreator zc(argv[1]);
+    // Otherwise the scan feeds the packer as it goes and the packer picks
+    // the order within a window, see zipcreator.cpp.
+    FileQueue found(SCAN_QUEUE_SIZE);
+    std::unique_ptr<std::thread> scanner;
+    std::string scan_error;
+    ZipCreator zc(zipname, opts);
     int num_failures;
     try {
         size_t i = 0;
-        auto *tc = zc.create(files, num_threads);
-        size_t total_tasks = tc->total();
-        while(i < total_tasks) {
-            if(i >= tc->finished()) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            } else {
+        auto *tc = opts.scan_window == 0 ? zc.create(files, pool)
+                                         : zc.create(found, pool);
+        if(opts.scan_window != 0) {
+            scanner.reset(new std::thread([&]() {
+                bool packing_stopped = false;
+                try {
+                    scan_input(filenames, list_file, pool, [&](fileinfo &&fi) {
+                        if(!found.push(std::move(fi))) {
+                            packing_stopped = true;
+                            throw std::runtime_error("Packing stopped.");
+                        }
+                    });
+                } catch(const std::exception &e) {
+                    if(!packing_stopped) {
+                        scan_error = e.what();
+                        tc->stop();
+                    }
+                }
+                found.close();
+            }));
+        }
+        while(true) {
+            const bool done = tc->state() == TASK_FINISHED;
+            if(i < tc->finished()) {
                 auto txt = tc->entry(i++);
-                printf("%s\n", txt.c_str());
+                fprintf(report, "%s\n", txt.c_str());
+            } else if(done) {
+                break;
+            } else {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
             }
         }
-        printf("\n");
-        printf("Success: %d\n", (int)tc->successes());
-        printf("Fail:    %d\n", (int)tc->failures());
+        if(scanner) {
+            scanner->join();
+        }
+        if(!scan_error.empty()) {
+            remove_output();
+            fprintf(report, "Scanning input files failed: %s\n", scan_error.c_str());
+            return 1;
+        }
+        fprintf(report, "\n");
+        fprintf(report, "Success: %d\n", (int)tc->successes());
+        fprintf(report, "Fail:    %d\n", (int)tc->failures());
         num_failures = tc->failures();
     } catch(std::exception &e) {
-        unlink(argv[1]);
-        printf("Zip creation failed: %s\n", e.what());
+        remove_output();
+        fprintf(report, "Zip creation failed: %s\n", e.what());
         return 1;
     } catch(...) {
-        unlink(argv[1]);
-        printf("Zip creation failed due to an unknown reason.");
+        remove_output();
+        fprintf(report, "Zip creation failed due to an unknown reason.");
         return 1;
     }
     return num_failures;
@@ -0,0 +1,424 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "seekindex.h"
+#include "file.h"
+#include "fileutils.h"
+#include "taskcontrol.h"
+#include "utils.h"
+#include "zipreader.h"
+
+#include <zlib.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+// Deflate refers at most this far back.
+const constexpr size_t WINDOW_SIZE = 32768;
+
+// Zlib counts in uInt so it gets fed at most this much at a time.
+const constexpr uint64_t MAX_ZLIB_STEP = 1024 * 1024 * 1024;
+
+const char SIDECAR_MAGIC[] = "PZSEEK01";
+
+// Lazily built indexes are written to the sidecar this many at a time,
+// rewriting it for every one would take quadratic time.
+const constexpr size_t SAVE_BATCH = 16;
+
+// Seek indexes are not part of a task, nothing ever stops them.
+const TaskControl never_stopped;
+
+class RawInflate final {
+public:
+    RawInflate() {
+        memset(&strm, 0, sizeof(strm));
+        if(inflateInit2(&strm, -15) != Z_OK) {
+            throw std::runtime_error("Could not init zlib.");
+        }
+    }
+    ~RawInflate() { inflateEnd(&strm); }
+
+    // Feeds the next piece of the data once the previous one is used up.
+    void feed(const EntryData &entry) {
+        if(strm.avail_in == 0) {
+            const uint64_t used = strm.next_in - entry.start;
+            strm.avail_in = (uInt)std::min(entry.size - used, MAX_ZLIB_STEP);
+        }
+    }
+
+    z_stream strm;
+};
+
+void check_inflate(int ret, const z_stream &strm) {
+    switch(ret) {
+    case Z_NEED_DICT:
+    case Z_DATA_ERROR:
+    case Z_MEM_ERROR:
+        throw std::runtime_error(strm.msg ? strm.msg : "Could not inflate data.");
+    case Z_BUF_ERROR:
+        // Input and output space are always given, so the data ran out.
+        throw std::runtime_error("Entry data ends in the middle of the deflate stream.");
+    }
+}
+
+std::string pack_window(const unsigned char *window, size_t size) {
+    uLongf packed_size = compressBound(size);
+    std::string packed(packed_size, '\0');
+    if(compress2(reinterpret_cast<Bytef *>(&packed[0]), &packed_size, window, size, 1) !=
+       Z_OK) {
+        throw std::runtime_error("Could not compress seek point window.");
+    }
+    packed.resize(packed_size);
+    return packed;
+}
+
+std::vector<unsigned char> unpack_window(const std::string &packed) {
+    std::vector<unsigned char> window(WINDOW_SIZE);
+    uLongf size = WINDOW_SIZE;
+    if(uncompress(window.data(),
+                  &size,
+                  reinterpret_cast<const Bytef *>(packed.data()),
+                  packed.size()) != Z_OK) {
+        throw std::runtime_error("Seek index is broken.");
+    }
+    window.resize(size);
+    return window;
+}
+
+} // namespace
+
+SeekIndex SeekIndex::build(const centralview &ch,
+                           const EntryData &entry,
+                           uint64_t span,
+                           const TaskControl &tc) {
+    if(ch.compression_method != ZIP_DEFLATE) {
+        throw std::runtime_error("Only deflated entries have seek indexes.");
+    }
+    SeekIndex index;
+    index.pts.push_back(Point{0, 0, 0, std::string()});
+    RawInflate inf;
+    z_stream &strm = inf.strm;
+    strm.next_in = const_cast<unsigned char *>(entry.start); // zlib header is const-broken
+    // The output goes round and round in the window.
+    unsigned char window[WINDOW_SIZE];
+    uint32_t crc = CRC32(nullptr, 0);
+    uint64_t total = 0;
+    uint64_t last = 0;
+    while(true) {
+        inf.feed(entry);
+        if(strm.avail_out == 0) {
+            strm.next_out = window;
+            strm.avail_out = WINDOW_SIZE;
+        }
+        unsigned char *const before = strm.next_out;
+        // Returns at every block boundary.
+        const int ret = inflate(&strm, Z_BLOCK);
+        tc.throw_if_stopped();
+        check_inflate(ret, strm);
+        crc = CRC32(before, strm.next_out - before, crc);
+        total += strm.next_out - before;
+        if(ret == Z_STREAM_END) {
+            break;
+        }
+        const bool at_boundary = (strm.data_type & 128) && !(strm.data_type & 64);
+        if(at_boundary && total - last >= span) {
+            const size_t pos = WINDOW_SIZE - strm.avail_out;
+            // Oldest output first.
+            std::vector<unsigned char> dict;
+            if(total >= WINDOW_SIZE) {
+                dict.insert(dict.end(), window + pos, window + WINDOW_SIZE);
+            }
+            dict.insert(dict.end(), window, window + pos);
+            index.pts.push_back(Point{total,
+                                      (uint64_t)(strm.next_in - entry.start),
+                                      strm.data_type & 7,
+                                      pack_window(dict.data(), dict.size())});
+            last = total;
+        }
+    }
+    if(total != ch.uncompressed_size) {
+        throw std::runtime_error("Entry is not the size its header says.");
+    }
+    if(crc != ch.crc32) {
+        throw std::runtime_error("CRC32 checksum is invalid.");
+    }
+    index.total_out = total;
+    return index;
+}
+
+size_t SeekIndex::read_at(const EntryData &entry,
+                          uint64_t offset,
+                          unsigned char *buf,
+                          size_t size) const {
+    if(offset >= total_out || size == 0) {
+        return 0;
+    }
+    size = (size_t)std::min<uint64_t>(size, total_out - offset);
+    const auto next = std::upper_bound(
+        pts.begin(), pts.end(), offset, [](uint64_t o, const Point &p) { return o < p.out; });
+    const Point &p = *(next - 1);
+    RawInflate inf;
+    z_stream &strm = inf.strm;
+    if(p.bits) {
+        inflatePrime(&strm, p.bits, entry.start[p.in - 1] >> (8 - p.bits));
+    }
+    if(!p.window.empty()) {
+        const auto window = unpack_window(p.window);
+        inflateSetDictionary(&strm, window.data(), window.size());
+    }
+    strm.next_in = const_cast<unsigned char *>(entry.start + p.in);
+    uint64_t skip = offset - p.out;
+    unsigned char discard[WINDOW_SIZE];
+    size_t got = 0;
+    while(got < size) {
+        inf.feed(entry);
+        if(skip > 0) {
+            strm.next_out = discard;
+            strm.avail_out = (uInt)std::min<uint64_t>(skip, WINDOW_SIZE);
+        } else {
+            strm.next_out = buf + got;
+            strm.avail_out = (uInt)std::min<uint64_t>(size - got, MAX_ZLIB_STEP);
+        }
+        const uInt space = strm.avail_out;
+        const int ret = inflate(&strm, Z_NO_FLUSH);
+        check_inflate(ret, strm);
+        const uInt produced = space - strm.avail_out;
+        if(skip > 0) {
+            skip -= produced;
+        } else {
+            got += produced;
+        }
+        if(ret == Z_STREAM_END) {
+            break;
+        }
+    }
+    return got;
+}
+
+bool SeekIndex::matches(const centralview &ch) const {
+    if(total_out != ch.uncompressed_size || pts.empty() || pts[0].out != 0) {
+        return false;
+    }
+    for(size_t i = 0; i < pts.size(); ++i) {
+        const Point &p = pts[i];
+        if(p.in > ch.compressed_size || p.out > total_out || p.bits < 0 || p.bits > 7 ||
+           (p.bits && p.in == 0) || (i > 0 && p.out <= pts[i - 1].out)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void SeekIndex::write(File &f) const {
+    f.write64le(total_out);
+    f.write64le(pts.size());
+    for(const auto &p : pts) {
+        f.write64le(p.out);
+        f.write64le(p.in);
+        f.write8(p.bits);
+        f.write32le(p.window.size());
+        f.write(p.window);
+    }
+}
+
+SeekIndex SeekIndex::read(File &f) {
+    SeekIndex index;
+    index.total_out = f.read64le();
+    const uint64_t num_points = f.read64le();
+    for(uint64_t i = 0; i < num_points; ++i) {
+        Point p;
+        p.out = f.read64le();
+        p.in = f.read64le();
+        p.bits = f.read8();
+        const uint32_t window_size = f.read32le();
+        if(window_size > compressBound(WINDOW_SIZE)) {
+            throw std::runtime_error("Seek index is broken.");
+        }
+        p.window = f.read(window_size);
+        index.pts.push_back(std::move(p));
+    }
+    return index;
+}
+
+SeekIndexStore::SeekIndexStore(const ZipReader &archive,
+                               const std::string &sidecar,
+                               uint64_t span)
+    : archive(archive), sidecar(sidecar), span(span) {
+    load();
+}
+
+SeekIndexStore::~SeekIndexStore() {
+    if(unsaved > 0) {
+        try_save();
+    }
+}
+
+void SeekIndexStore::load() {
+    if(sidecar.empty() || !exists_on_fs(sidecar)) {
+        return;
+    }
+    try {
+        File f(sidecar, "rb");
+        if(f.read(sizeof(SIDECAR_MAGIC) - 1) != SIDECAR_MAGIC) {
+            return;
+        }
+        const uint64_t num_indexes = f.read64le();
+        for(uint64_t n = 0; n < num_indexes; ++n) {
+            const std::string name = f.read(f.read16le());
+            const uint32_t crc32 = f.read32le();
+            const uint64_t compressed_size = f.read64le();
+            SeekIndex index = SeekIndex::read(f);
+            const size_t i = archive.find(name);
+            if(i == ZipReader::npos) {
+                continue;
+            }
+            const centralview ch = archive.entry(i);
+            if(ch.crc32 == crc32 && ch.compressed_size == compressed_size && index.matches(ch)) {
+                std::promise<IndexPtr> loaded;
+                loaded.set_value(std::make_shared<const SeekIndex>(std::move(index)));
+                indexes[i] = loaded.get_future().share();
+            }
+        }
+    } catch(const std::exception &) {
+        // A broken sidecar is rebuilt as entries are read.
+        indexes.clear();
+    }
+}
+
+void SeekIndexStore::save() const {
+    if(sidecar.empty()) {
+        return;
+    }
+    // Taken first, so that a save never replaces a newer one.
+    std::lock_guard<std::mutex> sl(save_m);
+    std::vector<std::pair<size_t, IndexPtr>> snapshot;
+    {
+        std::lock_guard<std::mutex> l(m);
+        for(const auto &it : indexes) {
+            // The ones being built are counted as unsaved when they are done.
+            if(it.second.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                snapshot.emplace_back(it.first, it.second.get());
+            }
+        }
+        unsaved = 0;
+    }
+    std::sort(snapshot.begin(), snapshot.end(), [](const auto &a, const auto &b) {
+        return a.first < b.first;
+    });
+    const std::string tmpname = sidecar + "$ZIPTMP";
+    try {
+        File f(tmpname, "wb");
+        f.write(SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC) - 1);
+        f.write64le(snapshot.size());
+        for(const auto &s : snapshot) {
+            const centralview ch = archive.entry(s.first);
+            f.write16le(ch.fname.size());
+            f.write(ch.fname.data(), ch.fname.size());
+            f.write32le(ch.crc32);
+            f.write64le(ch.compressed_size);
+            s.second->write(f);
+        }
+        f.close();
+    } catch(...) {
+        unlink(tmpname.c_str());
+        throw;
+    }
+    if(rename(tmpname.c_str(), sidecar.c_str()) != 0) {
+        unlink(tmpname.c_str());
+        throw_system("Could not rename tmp file to seek index file:");
+    }
+}
+
+SeekIndexStore::IndexPtr SeekIndexStore::index_for(size_t i) {
+    std::promise<IndexPtr> promise;
+    std::shared_future<IndexPtr> pending;
+    {
+        std::lock_guard<std::mutex> l(m);
+        auto it = indexes.find(i);
+        if(it == indexes.end()) {
+            indexes.emplace(i, promise.get_future().share());
+        } else {
+            pending = it->second;
+        }
+    }
+    if(pending.valid()) {
+        // Built already, or being built by another thread.
+        return pending.get();
+    }
+    // Built without the lock, reads of other entries go on meanwhile.
+    IndexPtr index;
+    try {
+        localview lh;
+        const EntryData entry = archive.entry_data(i, lh);
+        index = std::make_shared<const SeekIndex>(
+            SeekIndex::build(archive.entry(i), entry, span, never_stopped));
+    } catch(...) {
+        {
+            std::lock_guard<std::mutex> l(m);
+            indexes.erase(i);
+        }
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+    promise.set_value(index);
+    bool save_now;
+    {
+        std::lock_guard<std::mutex> l(m);
+        save_now = ++unsaved >= SAVE_BATCH;
+    }
+    if(save_now) {
+        try_save();
+    }
+    return index;
+}
+
+void SeekIndexStore::try_save() const {
+    try {
+        save();
+    } catch(const std::exception &) {
+        // The indexes still work from memory.
+    }
+}
+
+void SeekIndexStore::build(size_t i) { index_for(i); }
+
+size_t SeekIndexStore::read_at(size_t i, uint64_t offset, unsigned char *buf, size_t size) {
+    const centralview ch = archive.entry(i);
+    if(ch.compression_method == ZIP_NO_COMPRESSION) {
+        localview lh;
+        const EntryData entry = archive.entry_data(i, lh);
+        if(offset >= entry.size) {
+            return 0;
+        }
+        const size_t n = (size_t)std::min<uint64_t>(size, entry.size - offset);
+        memcpy(buf, entry.start + offset, n);
+        return n;
+    }
+    const auto index = index_for(i);
+    localview lh;
+    return index->read_at(archive.entry_data(i, lh), offset, buf, size);
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "decompress.h"
+#include "zipdefs.h"
+
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class File;
+class TaskControl;
+class ZipReader;
+
+/*
+ * Points in a deflate stream where decoding can start, for reading from
+ * the middle of a big entry without inflating everything before it. A
+ * point is a block boundary together with the 32k of output before it,
+ * which later blocks may refer back to. This is the method of zran.c in
+ * the zlib sources.
+ */
+class SeekIndex final {
+public:
+    struct Point {
+        // Where the block starts in the output and in the compressed data.
+        uint64_t out;
+        uint64_t in;
+        // How many bits of the byte before in belong to the block.
+        int bits;
+        // The output before the point, deflated to save space.
+        std::string window;
+    };
+
+    // Decodes the whole entry and puts a point at the first block boundary
+    // after every span bytes of output. Throws if the entry is not deflated
+    // or does not match the CRC and size of its header.
+    static SeekIndex build(const centralview &ch,
+                           const EntryData &entry,
+                           uint64_t span,
+                           const TaskControl &tc);
+
+    // Decodes up to size bytes from offset of the output, starting at the
+    // closest point before it. Returns how many bytes there were.
+    size_t read_at(const EntryData &entry, uint64_t offset, unsigned char *buf, size_t size) const;
+
+    uint64_t size() const { return total_out; }
+    // Whether the index can be used for the entry, for indexes read back
+    // from a file.
+    bool matches(const centralview &ch) const;
+    const std::vector<Point> &points() const { return pts; }
+
+    void write(File &f) const;
+    static SeekIndex read(File &f);
+
+private:
+    uint64_t total_out = 0;
+    std::vector<Point> pts;
+};
+
+/*
+ * Seek indexes for the entries of an archive, kept in a sidecar file so
+ * that they are built only once. An entry's index is built when it is
+ * first read at an offset, or ahead of time with build(). Threads that
+ * need an index another one is building wait for it. Indexes in the
+ * sidecar that do not match the archive any more are ignored. Can be used
+ * from many threads at once.
+ */
+class SeekIndexStore final {
+public:
+    static const constexpr uint64_t DEFAULT_SPAN = 4 * 1024 * 1024;
+
+    // An empty sidecar name keeps the indexes in memory only.
+    SeekIndexStore(const ZipReader &archive,
+                   const std::string &sidecar,
+                   uint64_t span = DEFAULT_SPAN);
+    // Writes the indexes built since the last save, failing to is not an error.
+    ~SeekIndexStore();
+
+    // Reads up to size bytes from offset of a stored or deflated entry and
+    // returns how many there were. Zero means the offset is past the end.
+    size_t read_at(size_t i, uint64_t offset, unsigned char *buf, size_t size);
+
+    // Builds the index of a deflated entry unless it has one already.
+    void build(size_t i);
+
+    // Writes all indexes to the sidecar, if there is one. Otherwise new
+    // indexes are written in batches and when the store is destroyed.
+    void save() const;
+
+private:
+    typedef std::shared_ptr<const SeekIndex> IndexPtr;
+
+    IndexPtr index_for(size_t i);
+    void load();
+    void try_save() const;
+
+    const ZipReader &archive;
+    std::string sidecar;
+    uint64_t span;
+    mutable std::mutex m;
+    // Only one save writes the sidecar at a time.
+    mutable std::mutex save_m;
+    // Ones still being built are not ready yet.
+    std::unordered_map<size_t, std::shared_future<IndexPtr>> indexes;
+    // Built since the sidecar was last written, protected by m.
+    mutable size_t unsaved = 0;
+};
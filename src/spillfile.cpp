@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spillfile.h"
+#include "utils.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <memory>
+#include <stdexcept>
+
+namespace {
+
+const uint64_t MAX_COPY_STEP = 1024 * 1024 * 1024;
+const uint64_t BOUNCE_SIZE = 1024 * 1024;
+
+} // namespace
+
+SpillFile::SpillFile(const std::string &dir) {
+#ifdef _WIN32
+    (void)dir;
+    FILE *opened = tmpfile();
+#else
+    int fd = -1;
+#ifdef O_TMPFILE
+    fd = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+    if(fd < 0) {
+        // Not every file system supports O_TMPFILE.
+        std::string name = dir + "/.parzip-spill-XXXXXX";
+        fd = mkstemp(&name[0]);
+        if(fd < 0) {
+            throw_system("Could not create spill file:");
+        }
+        unlink(name.c_str());
+    }
+    FILE *opened = fdopen(fd, "w+b");
+    if(!opened) {
+        ::close(fd);
+    }
+#endif
+    if(!opened) {
+        throw_system("Could not create spill file:");
+    }
+    f = File(opened);
+}
+
+void SpillFile::write(const char *data, uint64_t size) {
+    f.write(data, size);
+    written += size;
+}
+
+uint64_t SpillFile::copy_to(File &out, uint64_t offset) {
+    f.flush();
+    uint64_t copied = 0;
+#ifdef __linux__
+    loff_t in_offset = 0;
+    loff_t out_offset = offset;
+    while(copied < written) {
+        const auto r = copy_file_range(f.fileno(),
+                                       &in_offset,
+                                       out.fileno(),
+                                       &out_offset,
+                                       std::min(written - copied, MAX_COPY_STEP),
+                                       0);
+        if(r < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(copied == 0 &&
+               (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+                break;
+            }
+            throw_system("Could not copy spilled data:");
+        }
+        if(r == 0) {
+            throw std::runtime_error("Spill file ended prematurely.");
+        }
+        copied += r;
+    }
+#else
+    (void)MAX_COPY_STEP;
+#endif
+    if(copied < written) {
+        // The kernel can not do it, so go through a buffer.
+#ifdef _WIN32
+        out.seek(offset, SEEK_SET);
+        append_to(out);
+        out.flush();
+#else
+        // Other entries may be written to out at the same time, so neither
+        // file position is used.
+        std::unique_ptr<char[]> buf(new char[BOUNCE_SIZE]);
+        while(copied < written) {
+            const ssize_t r =
+                pread(f.fileno(), buf.get(), std::min(written - copied, BOUNCE_SIZE), copied);
+            if(r < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                throw_system("Could not read spilled data:");
+            }
+            if(r == 0) {
+                throw std::runtime_error("Spill file ended prematurely.");
+            }
+            for(ssize_t done = 0; done < r;) {
+                const ssize_t w =
+                    pwrite(out.fileno(), buf.get() + done, r - done, offset + copied + done);
+                if(w < 0) {
+                    if(errno == EINTR) {
+                        continue;
+                    }
+                    throw_system("Could not write data:");
+                }
+                done += w;
+            }
+            copied += r;
+        }
+#endif
+    }
+    return offset + written;
+}
+
+void SpillFile::append_to(File &out) {
+    f.flush();
+    f.seek(0, SEEK_SET);
+    std::unique_ptr<char[]> buf(new char[BOUNCE_SIZE]);
+    for(uint64_t copied = 0; copied < written;) {
+        const uint64_t step = std::min(written - copied, BOUNCE_SIZE);
+        if(fread(buf.get(), 1, step, f.get()) != step) {
+            throw_system("Could not read spilled data:");
+        }
+        out.write(buf.get(), step);
+        copied += step;
+    }
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "file.h"
+
+#include <cstdint>
+#include <string>
+
+// Compressed data that did not fit in memory. It is kept in an anonymous
+// file in the directory of the archive, so that the kernel can usually
+// copy it into the archive without it passing through user space.
+class SpillFile final {
+public:
+    explicit SpillFile(const std::string &dir);
+
+    void write(const char *data, uint64_t size);
+    uint64_t size() const { return written; }
+
+    // Copies the contents to out at the given offset and returns the offset
+    // after them. Uses positional writes, so several spill files can be
+    // copied into the same file at once (except on Windows).
+    uint64_t copy_to(File &out, uint64_t offset);
+
+    // Writes the contents at the current position of out, for outputs that
+    // can not seek.
+    void append_to(File &out);
+
+private:
+    File f;
+    uint64_t written = 0;
+};
@@ -36,6 +36,7 @@ TaskState TaskControl::state() const {
 
 void TaskControl::set_state(TaskState new_state) {
     // FIXME check that we are only going forwards.
+    std::lock_guard<std::mutex> l(m);
     cur_state = new_state;
 }
 
@@ -78,18 +79,11 @@ void TaskControl::add_failure(const std::string &msg) {
     num_failures++;
 }
 
-void TaskControl::stop() {
-    std::lock_guard<std::mutex> l(m);
-    stopped = true;
-}
+void TaskControl::stop() { stopped = true; }
 
-bool TaskControl::should_stop() const {
-    std::lock_guard<std::mutex> l(m);
-    return stopped;
-}
+bool TaskControl::should_stop() const { return stopped; }
 
 void TaskControl::throw_if_stopped() const {
-    std::lock_guard<std::mutex> l(m);
     if(stopped) {
         throw std::runtime_error("Stopping task evaluation.");
     }
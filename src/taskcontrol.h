@@ -16,6 +16,7 @@
  */
 #pragma once
 
+#include <atomic>
 #include <mutex>
 #include <string>
 #include <vector>
@@ -53,5 +54,6 @@ private:
     int num_success;
     int num_failures;
     int total_tasks;
-    bool stopped = false;
+    // Checked all the time by decoders, so it does not take the lock.
+    std::atomic<bool> stopped{false};
 };
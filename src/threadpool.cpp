@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "threadpool.h"
+
+#include <cassert>
+#include <stdexcept>
+
+namespace {
+
+// Which pool the current thread is a worker of, if any.
+thread_local const ThreadPool *worker_pool = nullptr;
+thread_local int worker_index = -1;
+
+} // namespace
+
+ThreadPool::ThreadPool(int num_threads) {
+    if(num_threads < 1) {
+        throw std::logic_error("Thread pool must have at least one thread.");
+    }
+    workers.reserve(num_threads);
+    for(int i = 0; i < num_threads; ++i) {
+        workers.emplace_back(std::make_unique<Worker>());
+    }
+    threads.reserve(num_threads);
+    for(int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([this, i]() { worker_loop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> l(sleep_m);
+        stopping = true;
+    }
+    sleep_cv.notify_all();
+    for(auto &t : threads) {
+        t.join();
+    }
+}
+
+int ThreadPool::current_worker() const { return worker_pool == this ? worker_index : -1; }
+
+void ThreadPool::submit(std::function<void()> task) {
+    int target = current_worker();
+    if(target < 0) {
+        target = (int)(next_victim++ % workers.size());
+    }
+    ++pending;
+    {
+        std::lock_guard<std::mutex> l(workers[target]->m);
+        workers[target]->tasks.push_back(std::move(task));
+    }
+    // A worker counts itself as a sleeper before it looks at pending, so
+    // either it sees the new task or it is seen here. Going through the lock
+    // means it is not between the check and the wait.
+    if(sleepers > 0) {
+        std::lock_guard<std::mutex> l(sleep_m);
+        sleep_cv.notify_one();
+    }
+}
+
+bool ThreadPool::run_one(int self) {
+    std::function<void()> task;
+    const int n = size();
+    // Own deque first, newest task first for cache locality. Then steal
+    // the oldest task of some other worker.
+    for(int i = 0; i < n && !task; ++i) {
+        Worker &w = *workers[(self + i) % n];
+        std::lock_guard<std::mutex> l(w.m);
+        if(w.tasks.empty()) {
+            continue;
+        }
+        if(i == 0) {
+            task = std::move(w.tasks.back());
+            w.tasks.pop_back();
+        } else {
+            task = std::move(w.tasks.front());
+            w.tasks.pop_front();
+        }
+    }
+    if(!task) {
+        return false;
+    }
+    assert(pending > 0);
+    --pending;
+    task();
+    return true;
+}
+
+void ThreadPool::worker_loop(int self) {
+    worker_pool = this;
+    worker_index = self;
+    while(true) {
+        if(run_one(self)) {
+            continue;
+        }
+        std::unique_lock<std::mutex> l(sleep_m);
+        ++sleepers;
+        sleep_cv.wait(l, [this] { return pending > 0 || stopping; });
+        --sleepers;
+        if(pending == 0 && stopping) {
+            return;
+        }
+    }
+}
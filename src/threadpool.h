@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+template<typename R> class ForkedTask final {
+public:
+    // A task that is not forked on any pool runs when it is joined.
+    template<typename F>
+    explicit ForkedTask(F f)
+        : task(std::make_shared<std::packaged_task<R()>>(std::move(f))),
+          claimed(std::make_shared<std::atomic<bool>>(false)), result(task->get_future()) {}
+
+    R join() {
+        wait();
+        return result.get();
+    }
+
+    void wait() {
+        if(!claimed->exchange(true)) {
+            (*task)();
+        }
+        result.wait();
+    }
+
+private:
+    friend class ThreadPool;
+
+    std::shared_ptr<std::packaged_task<R()>> task;
+    std::shared_ptr<std::atomic<bool>> claimed;
+    std::future<R> result;
+};
+
+/*
+ * A fixed set of worker threads, each with its own task deque.
+ *
+ * Workers pop from the back of their own deque and steal from the front
+ * of the others' when they run out. Tasks submitted from a worker go to its
+ * own deque, tasks from other threads are spread round robin. Idle workers
+ * sleep until new work arrives.
+ */
+class ThreadPool final {
+public:
+    explicit ThreadPool(int num_threads);
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+    // Runs all queued tasks to completion before returning.
+    ~ThreadPool();
+
+    int size() const { return (int)workers.size(); }
+
+    void submit(std::function<void()> task);
+
+    // Starts a task whose result is fetched with join(). If no worker has
+    // picked the task up by then, join() runs it on the calling thread. A
+    // task can thus fork subtasks and join them without ever waiting on
+    // work that is stuck in a queue behind it.
+    template<typename F> auto fork(F f) -> ForkedTask<decltype(f())> {
+        ForkedTask<decltype(f())> t(std::move(f));
+        auto task = t.task;
+        auto claimed = t.claimed;
+        submit([task, claimed]() {
+            if(!claimed->exchange(true)) {
+                (*task)();
+            }
+        });
+        return t;
+    }
+
+private:
+    struct Worker {
+        std::mutex m;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    int current_worker() const;
+    bool run_one(int self);
+    void worker_loop(int self);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next_victim{0};
+
+    // Counted before the task goes in a deque, so never below the number of
+    // queued tasks. The lock is only taken to sleep and to wake sleepers.
+    std::atomic<size_t> pending{0};
+    std::atomic<int> sleepers{0};
+    std::mutex sleep_m;
+    std::condition_variable sleep_cv;
+    bool stopping = false; // Protected by sleep_m.
+};
+
+// Results of finished tasks, handed to a waiting consumer in completion order.
+template<typename T> class CompletionQueue final {
+public:
+    // Notifies under the lock, the consumer may destroy the queue as soon
+    // as it has popped the last value.
+    void push(T value) {
+        std::lock_guard<std::mutex> l(m);
+        done.push_back(std::move(value));
+        cv.notify_one();
+    }
+
+    T pop() {
+        std::unique_lock<std::mutex> l(m);
+        cv.wait(l, [this] { return !done.empty(); });
+        T value = std::move(done.front());
+        done.pop_front();
+        return value;
+    }
+
+private:
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<T> done;
+};
@@ -16,6 +16,7 @@
  */
 
 #include "utils.h"
+#include "crc.h"
 #include "mmapper.h"
 
 #if _WIN32
@@ -23,8 +24,6 @@
 #include <winsock2.h>
 #endif
 
-#include <zlib.h>
-
 #include <cassert>
 #include <cerrno>
 #include <cstring>
@@ -32,10 +31,6 @@
 #include <stdexcept>
 #include <string>
 
-#ifndef _WIN32
-using std::min;
-#endif
-
 void throw_system(const char *msg) {
     std::string error(msg);
     assert(errno != 0);
@@ -46,16 +41,27 @@ void throw_system(const char *msg) {
     throw std::runtime_error(error);
 }
 
-uint32_t CRC32(const unsigned char *buf, uint64_t bufsize) {
-    uint32_t crcvalue = crc32(0, Z_NULL, 0);
-    const uint64_t blocksize = 1024 * 1024;
-    for(uint64_t offset = 0; offset < bufsize; offset += blocksize) {
-        crcvalue = crc32(crcvalue, buf + offset, min(blocksize, bufsize - offset));
-    }
-    return crcvalue;
+uint32_t CRC32(const unsigned char *buf, uint64_t bufsize, uint32_t crcvalue) {
+    return crc32_update(crcvalue, buf, bufsize);
 }
 
 uint32_t CRC32(File &f) {
     MMapper mmap = f.mmap();
     return CRC32(mmap, mmap.size());
 }
+
+uint64_t parse_size(const std::string &value) {
+    size_t end;
+    uint64_t result = std::stoull(value, &end);
+    const std::string suffix = value.substr(end);
+    if(suffix == "k" || suffix == "K") {
+        result *= 1024;
+    } else if(suffix == "M") {
+        result *= 1024 * 1024;
+    } else if(suffix == "G") {
+        result *= 1024 * 1024 * 1024;
+    } else if(!suffix.empty()) {
+        throw std::invalid_argument("Unknown size suffix " + suffix + ".");
+    }
+    return result;
+}
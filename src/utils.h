@@ -25,5 +25,9 @@
 
 void throw_system(const char *msg);
 
-uint32_t CRC32(const unsigned char *buf, uint64_t bufsize);
+// Continues from crcvalue if given.
+uint32_t CRC32(const unsigned char *buf, uint64_t bufsize, uint32_t crcvalue = 0);
 uint32_t CRC32(File &f);
+
+// Parses a byte count with an optional k, M or G suffix.
+uint64_t parse_size(const std::string &value);
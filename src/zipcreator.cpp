@@ -16,11 +16,17 @@
  */
 
 #include "zipcreator.h"
+#include "bufferpool.hpp"
 #include "bytequeue.hpp"
 #include "compress.h"
 #include "file.h"
+#include "filequeue.hpp"
 #include "fileutils.h"
 #include "mmapper.h"
+#include "notifier.hpp"
+#include "outputarena.hpp"
+#include "spillfile.h"
+#include "threadpool.h"
 #include "utils.h"
 #include "zipdefs.h"
 
@@ -28,76 +34,272 @@
 #if defined(_WIN32)
 #include <windows.h>
 #include <winsock2.h>
+#include <fcntl.h>
+#include <io.h>
 #else
 #include <pthread.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <climits>
+#include <cerrno>
 #endif
 
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <future>
+#include <mutex>
+#include <set>
 #include <stdexcept>
 #include <thread>
 #include <algorithm>
 
 namespace {
 
+const int64_t BUFFER_BLOCK_SIZE = 1024 * 1024;
+
+// What a task hands back to the writer thread. If the worker thread has
+// written the entry into the archive itself, the result also has its
+// central header.
+struct EntryResult {
+    compressresult compression;
+    bool written;
+    centralheader ch;
+};
+
 struct CompressionTask {
+    size_t index;
     fileinfo fi;
     ByteQueue queue;
-    std::future<compressresult> result;
+    std::future<EntryResult> result;
+    // The compression method of a regular file, valid once there is data
+    // in the queue.
+    std::atomic<uint16_t> cformat{ZIP_NO_COMPRESSION};
+    // Whoever claims the task writes out its data: the worker once all of it
+    // is in the queue, or the writer thread while it is still being produced.
+    std::atomic<bool> claimed{false};
+
+    CompressionTask(const size_t index,
+                    const fileinfo fi,
+                    BufferPool &buffers,
+                    const int64_t queue_size,
+                    const std::string &spill_dir,
+                    Notifier *n)
+        : index(index), fi(fi), queue(buffers, queue_size) {
+        queue.set_listener(n);
+        queue.set_spill_dir(spill_dir);
+    }
 
-    explicit CompressionTask(const fileinfo fi, const int64_t queue_size)
-        : fi(fi), queue(queue_size) {}
+    bool claim() { return !claimed.exchange(true); }
+
+    bool finished() const {
+        return result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
 };
 
 typedef std::vector<std::unique_ptr<CompressionTask>> task_array;
 
-void write_localheader(File &ofile, const localheader &lh) {
-    ofile.write32le(LOCAL_SIG);
-    ofile.write16le(lh.needed_version);
-    ofile.write16le(lh.gp_bitflag);
-    ofile.write16le(lh.compression);
-    ofile.write16le(lh.last_mod_time);
-    ofile.write16le(lh.last_mod_date);
-    ofile.write32le(lh.crc32);
-    ofile.write32le(lh.compressed_size);
-    ofile.write32le(lh.uncompressed_size);
-    ofile.write16le(lh.fname.size());
-    ofile.write16le(lh.extra.size());
-    ofile.write(lh.fname);
-    ofile.write(lh.extra);
-}
-
-void write_file(ByteQueue &q, File &ofile) {
-    do {
-        auto buf = q.pop();
-        ofile.write(buf.data(), buf.size());
-    } while(q.state() != QueueState::SHUTDOWN);
-    auto final_buf = q.pop();
-    ofile.write(final_buf.data(), final_buf.size());
-}
-
-void write_central_header(File &ofile, const centralheader &ch) {
-    ofile.write32le(CENTRAL_SIG);
-    ofile.write16le(ch.version_made_by);
-    ofile.write16le(ch.version_needed);
-    ofile.write16le(ch.bit_flag);
-    ofile.write16le(ch.compression_method);
-    ofile.write16le(ch.last_mod_time);
-    ofile.write16le(ch.last_mod_date);
-    ofile.write32le(ch.crc32);
-    ofile.write32le(ch.compressed_size);
-    ofile.write32le(ch.uncompressed_size);
-    ofile.write16le(ch.fname.size());
-    ofile.write16le(ch.extra_field.size());
-    ofile.write16le(ch.comment.size());
-    ofile.write16le(ch.disk_number_start);
-    ofile.write16le(ch.internal_file_attributes);
-    ofile.write32le(ch.external_file_attributes);
-    ofile.write32le(ch.local_header_rel_offset);
-    ofile.write(ch.fname);
-    ofile.write(ch.extra_field);
-    ofile.write(ch.comment);
+struct BatchEntry {
+    size_t index;
+    fileinfo fi;
+    compressresult compression;
+    // The compressed data in the arena of the batch.
+    int64_t start;
+    int64_t size;
+    std::exception_ptr error;
+    centralheader ch;
+};
+
+// Small entries are not worth a queue and a task of their own. They are
+// compressed one batch at a time, into one arena, and written out with one
+// reservation and as few system calls as possible.
+struct BatchTask {
+    std::vector<BatchEntry> entries;
+    OutputArena arena;
+    // Whether the worker wrote the batch into the archive itself, which it
+    // does unless the output can only be written in order.
+    std::future<bool> written;
+
+    bool finished() const {
+        return written.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+};
+
+typedef std::vector<std::unique_ptr<BatchTask>> batch_array;
+
+// An entry that has been found but not launched yet. The index is its
+// position in the input.
+struct PendingEntry {
+    size_t index;
+    fileinfo fi;
+};
+
+// Directories go first and then the biggest files, because a big file
+// followed by lots of small files causes waste of resources. Ties go in the
+// order of the input.
+struct PendingOrder {
+    bool operator()(const PendingEntry &a, const PendingEntry &b) const {
+        const bool a_dir = is_dir(a.fi);
+        const bool b_dir = is_dir(b.fi);
+        if(a_dir != b_dir) {
+            return a_dir;
+        }
+        if(!a_dir && a.fi.fsize != b.fi.fsize) {
+            return a.fi.fsize > b.fi.fsize;
+        }
+        return a.index < b.index;
+    }
+};
+
+typedef std::set<PendingEntry, PendingOrder> pending_set;
+
+// Writes the blocks at the current position of the file, which is at the
+// given offset, and returns the offset after them.
+uint64_t append_blocks(File &ofile, uint64_t offset, const QueueBlock *blocks, size_t count) {
+    for(size_t i = 0; i < count; ++i) {
+        ofile.write(blocks[i].data, blocks[i].size);
+        offset += blocks[i].size;
+    }
+    return offset;
+}
+
+// Writes the blocks at the given offset with as few system calls as
+// possible and returns the offset after them.
+uint64_t write_blocks(File &ofile, uint64_t offset, const QueueBlock *blocks, size_t count) {
+#ifdef _WIN32
+    ofile.seek(offset, SEEK_SET);
+    offset = append_blocks(ofile, offset, blocks, count);
+#else
+    const size_t MAX_IOV = IOV_MAX < 1024 ? IOV_MAX : 1024;
+    iovec iov[MAX_IOV];
+    size_t i = 0;
+    int64_t done_in_block = 0;
+    while(i < count) {
+        size_t num_iov = 0;
+        for(size_t j = i; j < count && num_iov < MAX_IOV; ++j, ++num_iov) {
+            const int64_t skip = j == i ? done_in_block : 0;
+            iov[num_iov].iov_base = const_cast<char *>(blocks[j].data + skip);
+            iov[num_iov].iov_len = blocks[j].size - skip;
+        }
+        ssize_t r = pwritev(ofile.fileno(), iov, (int)num_iov, (off_t)offset);
+        if(r < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw_system("Could not write data:");
+        }
+        offset += r;
+        while(r > 0) {
+            const int64_t step = std::min<int64_t>(r, blocks[i].size - done_in_block);
+            done_in_block += step;
+            r -= step;
+            if(done_in_block == blocks[i].size) {
+                ++i;
+                done_in_block = 0;
+            }
+        }
+    }
+#endif
+    return offset;
+}
+
+// The archive file as shared by the writer thread and the workers. An entry
+// whose size is known gets its own range at the end of the file and is
+// written there with positional writes, so several of them can be written
+// at once. An entry whose size is not known yet is streamed to the end of
+// the file instead, no ranges can be reserved until it is done.
+//
+// An output that can not seek is written strictly in order. Then only the
+// writer thread writes, each range right after reserving it.
+class ArchiveWriter final {
+public:
+    ArchiveWriter(File &f, bool sequential) : f(f), is_sequential(sequential) {}
+
+    bool sequential() const { return is_sequential; }
+
+    // Reserves size bytes at the end of the file. Fails while an entry is
+    // being streamed.
+    bool reserve(const uint64_t size, uint64_t &offset) {
+        uint64_t cur = tail.load();
+        do {
+            if(cur == STREAMING) {
+                return false;
+            }
+        } while(!tail.compare_exchange_weak(cur, cur + size));
+        offset = cur;
+        return true;
+    }
+
+    // Only one entry may be streamed at a time. Returns the offset to
+    // write it at.
+    uint64_t begin_stream() {
+        const uint64_t offset = tail.exchange(STREAMING);
+        assert(offset != STREAMING);
+        return offset;
+    }
+
+    void end_stream(const uint64_t end) { tail.store(end); }
+
+    uint64_t end() const {
+        const uint64_t offset = tail.load();
+        assert(offset != STREAMING);
+        return offset;
+    }
+
+    uint64_t write(const uint64_t offset, const std::string &data) {
+        const QueueBlock b{data.data(), (int64_t)data.size()};
+        return write(offset, &b, 1);
+    }
+
+    uint64_t write(const uint64_t offset, const QueueBlock *blocks, size_t count) {
+        if(is_sequential) {
+            return append_blocks(f, offset, blocks, count);
+        }
+#ifdef _WIN32
+        std::lock_guard<std::mutex> l(m);
+#endif
+        return write_blocks(f, offset, blocks, count);
+    }
+
+    uint64_t write(const uint64_t offset, SpillFile &spill) {
+        if(is_sequential) {
+            spill.append_to(f);
+            return offset + spill.size();
+        }
+#ifdef _WIN32
+        std::lock_guard<std::mutex> l(m);
+#endif
+        return spill.copy_to(f, offset);
+    }
+
+private:
+    static constexpr uint64_t STREAMING = UINT64_MAX;
+
+    File &f;
+    const bool is_sequential;
+    std::atomic<uint64_t> tail{0};
+#ifdef _WIN32
+    // There are no positional writes, so they are done one at a time.
+    std::mutex m;
+#endif
+};
+
+// Writes out everything in the queue, offset is kept up to date so that it
+// is valid even if this fails.
+void write_data(ArchiveWriter &out, ByteQueue &q, uint64_t &offset) {
+    while(q.drain([&out, &offset](const QueueBlock *blocks, size_t count) {
+        offset = out.write(offset, blocks, count);
+    })) {
+    }
+    if(SpillFile *spill = q.spilled()) {
+        offset = out.write(offset, *spill);
+    }
+}
+
+// Throws away what is left in the queue of a failed task.
+void discard_data(ByteQueue &q) {
+    while(q.drain([](const QueueBlock *, size_t) {})) {
+    }
 }
 
 void write_end_record(File &ofile, const endrecord &ed) {
@@ -165,48 +367,108 @@ std::string pack_unix_extra(unixextra ue) {
     return result;
 }
 
-centralheader write_entry(File &ofile, CompressionTask &t) {
+std::string pack_segments(const segmentindex &index) {
+    const uint16_t tag = ZIP_EXTRA_SEGMENTS;
+    const uint16_t size = 1 + 8 + 8 * index.segments.size();
+    std::string result;
+    append_data(result, htole16(tag));
+    append_data(result, htole16(size));
+    result += '\1';
+    append_data(result, htole64(index.segment_size));
+    for(const auto &s : index.segments) {
+        append_data(result, htole32(s.compressed_size));
+        append_data(result, htole32(s.crc32));
+    }
+    assert(result.size() == size + 2 * 2u);
+    return result;
+}
+
+std::string pack_central_header(const centralheader &ch) {
+    std::string result;
+    append_data(result, htole32(CENTRAL_SIG));
+    append_data(result, htole16(ch.version_made_by));
+    append_data(result, htole16(ch.version_needed));
+    append_data(result, htole16(ch.bit_flag));
+    append_data(result, htole16(ch.compression_method));
+    append_data(result, htole16(ch.last_mod_time));
+    append_data(result, htole16(ch.last_mod_date));
+    append_data(result, htole32(ch.crc32));
+    append_data(result, htole32(ch.compressed_size));
+    append_data(result, htole32(ch.uncompressed_size));
+    append_data(result, htole16(ch.fname.size()));
+    append_data(result, htole16(ch.extra_field.size()));
+    append_data(result, htole16(ch.comment.size()));
+    append_data(result, htole16(ch.disk_number_start));
+    append_data(result, htole16(ch.internal_file_attributes));
+    append_data(result, htole32(ch.external_file_attributes));
+    append_data(result, htole32(ch.local_header_rel_offset));
+    result += ch.fname;
+    result += ch.extra_field;
+    result += ch.comment;
+    return result;
+}
+
+// The sizes are 64 bits because the local header has a zip64 extra field.
+std::string pack_data_descriptor(uint32_t crc32,
+                                 uint64_t compressed_size,
+                                 uint64_t uncompressed_size) {
+    std::string result;
+    append_data(result, htole32(DATA_DESCRIPTOR_SIG));
+    append_data(result, htole32(crc32));
+    append_data(result, htole64(compressed_size));
+    append_data(result, htole64(uncompressed_size));
+    return result;
+}
+
+std::string pack_localheader(const localheader &lh) {
+    std::string result;
+    append_data(result, htole32(LOCAL_SIG));
+    append_data(result, htole16(lh.needed_version));
+    append_data(result, htole16(lh.gp_bitflag));
+    append_data(result, htole16(lh.compression));
+    append_data(result, htole16(lh.last_mod_time));
+    append_data(result, htole16(lh.last_mod_date));
+    append_data(result, htole32(lh.crc32));
+    append_data(result, htole32(lh.compressed_size));
+    append_data(result, htole32(lh.uncompressed_size));
+    append_data(result, htole16(lh.fname.size()));
+    append_data(result, htole16(lh.extra.size()));
+    result += lh.fname;
+    result += lh.extra;
+    return result;
+}
+
+localheader make_localheader(const fileinfo &fi,
+                             const compressresult &cr,
+                             const uint64_t compressed_size,
+                             const uint64_t local_header_offset) {
     localheader lh;
-    centralheader ch;
-    const fileinfo &i = t.fi;
-    uint64_t local_header_offset = ofile.tell();
-    uint64_t uncompressed_size = i.fsize;
-    uint64_t compressed_size = 0xFFFFFFFF;
-    lh.fname = i.fname;
-    const auto compression_result = t.result.get();
-    if(!compression_result.additional_unix_extra_data.empty()) {
-        t.fi.ue.data.insert(0, compression_result.additional_unix_extra_data.c_str());
-    }
-    if(compression_result.entrytype == DIRECTORY_ENTRY) {
+    lh.fname = fi.fname;
+    if(cr.entrytype == DIRECTORY_ENTRY) {
         if(lh.fname.back() != '/') {
             lh.fname += '/';
         }
     }
-
-    lh.needed_version = NEEDED_VERSION;
+    lh.compression = cr.cformat;
+    // Only ask for LZMA support from the unpacker when it is needed.
+    lh.needed_version = lh.compression == ZIP_LZMA ? NEEDED_VERSION : ZIP64_NEEDED_VERSION;
     lh.gp_bitflag = 0x02; // LZMA EOS marker.
-    lh.compression = compression_result.cformat;
     lh.last_mod_date = 0;
     lh.last_mod_time = 0;
-    lh.crc32 = compression_result.crc32;
+    lh.crc32 = cr.crc32;
     lh.compressed_size = lh.uncompressed_size = 0xFFFFFFFF;
-    // Write fake data because the local header must be written before the data.
-    // But we don't know the final data size until all data has been read from the
-    // ByteQueue.
-    lh.extra = pack_zip64(uncompressed_size, compressed_size, local_header_offset);
-    lh.extra += pack_unix_extra(t.fi.ue);
-    write_localheader(ofile, lh);
-    auto data_start_loc = ofile.tell();
-    write_file(t.queue, ofile);
-    auto data_end_loc = ofile.tell();
-
-    // Fix the header by rewriting it.
-    lh.extra = pack_zip64(uncompressed_size, data_end_loc - data_start_loc, local_header_offset);
-    lh.extra += pack_unix_extra(t.fi.ue);
-    ofile.seek(local_header_offset, SEEK_SET);
-    write_localheader(ofile, lh);
-    ofile.seek(data_end_loc, SEEK_SET);
+    lh.extra = pack_zip64(fi.fsize, compressed_size, local_header_offset);
+    lh.extra += pack_unix_extra(fi.ue);
+    return lh;
+}
 
+// The segment index only goes to the central header, since it is known
+// only once the data has been compressed.
+centralheader make_central_header(const localheader &lh,
+                                  const fileinfo &fi,
+                                  const compressresult &cr,
+                                  const uint64_t local_header_offset) {
+    centralheader ch;
     ch.version_made_by = MADE_BY_UNIX << 8 | NEEDED_VERSION;
     ch.version_needed = lh.needed_version;
     ch.bit_flag = lh.gp_bitflag;
@@ -219,160 +481,569 @@ centralheader write_entry(File &ofile, CompressionTask &t) {
     ch.fname = lh.fname;
     ch.disk_number_start = 0;
     ch.internal_file_attributes = 0;
-    ch.external_file_attributes = i.mode << 16;
+    ch.external_file_attributes = fi.mode << 16;
     ch.local_header_rel_offset = local_header_offset;
     ch.extra_field = lh.extra;
+    if(!cr.segments.segments.empty()) {
+        ch.extra_field += pack_segments(cr.segments);
+    }
     return ch;
 }
 
-void handle_future(File &ofile,
-                   CompressionTask &t,
-                   std::vector<centralheader> &chs,
-                   TaskControl &tc) {
+// Writes an entry whose queue has been shut down, so that its size is
+// known, into a range of its own. Returns false if an entry is being
+// streamed at the moment.
+bool write_finished_entry(ArchiveWriter &out,
+                          CompressionTask &t,
+                          const compressresult &cr,
+                          centralheader &ch) {
+    const uint64_t data_size = t.queue.data_size();
+    const uint64_t header_size = pack_localheader(make_localheader(t.fi, cr, data_size, 0)).size();
+    uint64_t offset;
+    if(!out.reserve(header_size + data_size, offset)) {
+        return false;
+    }
+    const localheader lh = make_localheader(t.fi, cr, data_size, offset);
+    out.write(offset, pack_localheader(lh));
+    uint64_t data_end = offset + header_size;
+    write_data(out, t.queue, data_end);
+    assert(data_end == offset + header_size + data_size);
+    ch = make_central_header(lh, t.fi, cr, offset);
+    return true;
+}
+
+// Writes an entry while it is still being compressed. The data goes to the
+// end of the file as it comes and the local header is rewritten afterwards.
+centralheader stream_entry(ArchiveWriter &out, CompressionTask &t) {
+    const uint64_t local_header_offset = out.begin_stream();
+    uint64_t data_end = local_header_offset;
     try {
-        chs.push_back(write_entry(ofile, t));
-        tc.add_success("OK: " + t.fi.fname);
+        // A regular file may still be compressing and its compressor may be
+        // waiting for the queue to be drained. Only its method and CRC depend
+        // on the compression, those are filled in when the header is
+        // rewritten. Other entries have little or no data, they are waited for.
+        const bool result_first = !S_ISREG(t.fi.mode);
+        compressresult compression_result{FILE_ENTRY, 0, ZIP_NO_COMPRESSION, ""};
+        if(result_first) {
+            compression_result = t.result.get().compression;
+        }
+        // Write fake data because the local header must be written before the data.
+        // But we don't know the final data size until all data has been read from the
+        // ByteQueue.
+        localheader lh =
+            make_localheader(t.fi, compression_result, 0xFFFFFFFF, local_header_offset);
+        const std::string header = pack_localheader(lh);
+        out.write(local_header_offset, header);
+        data_end += header.size();
+        write_data(out, t.queue, data_end);
+        if(!result_first) {
+            compression_result = t.result.get().compression;
+            assert(compression_result.entrytype == FILE_ENTRY);
+            assert(compression_result.additional_unix_extra_data.empty());
+        }
+
+        // Fix the header by rewriting it.
+        const uint64_t compressed_size = data_end - local_header_offset - header.size();
+        lh = make_localheader(t.fi, compression_result, compressed_size, local_header_offset);
+        out.write(local_header_offset, pack_localheader(lh));
+        out.end_stream(data_end);
+        return make_central_header(lh, t.fi, compression_result, local_header_offset);
+    } catch(...) {
+        out.end_stream(data_end);
+        throw;
+    }
+}
+
+// Streams an entry into an output that can not seek, so its local header
+// can not be fixed afterwards. The header goes out with the first data, when
+// the compression method is known, and the CRC and the sizes follow the data
+// in a data descriptor.
+centralheader stream_entry_with_descriptor(ArchiveWriter &out, CompressionTask &t) {
+    const uint64_t local_header_offset = out.begin_stream();
+    uint64_t data_end = local_header_offset;
+    try {
+        const bool result_first = !S_ISREG(t.fi.mode);
+        compressresult compression_result{FILE_ENTRY, 0, ZIP_NO_COMPRESSION, ""};
+        if(result_first) {
+            compression_result = t.result.get().compression;
+        }
+        bool header_written = false;
+        uint64_t data_start = 0;
+        auto write_header = [&] {
+            localheader lh = make_localheader(t.fi, compression_result, 0, local_header_offset);
+            lh.gp_bitflag |= ZIP_FLAG_DATA_DESCRIPTOR;
+            lh.crc32 = 0;
+            lh.extra = pack_zip64(0, 0, local_header_offset);
+            lh.extra += pack_unix_extra(t.fi.ue);
+            data_start = data_end = out.write(data_end, pack_localheader(lh));
+            header_written = true;
+        };
+        while(t.queue.drain([&](const QueueBlock *blocks, size_t count) {
+            if(!header_written) {
+                if(!result_first) {
+                    compression_result.cformat = t.cformat.load();
+                }
+                write_header();
+            }
+            data_end = out.write(data_end, blocks, count);
+        })) {
+        }
+        if(!result_first) {
+            const compressresult r = t.result.get().compression;
+            assert(!header_written || r.cformat == compression_result.cformat);
+            assert(r.additional_unix_extra_data.empty());
+            compression_result = r;
+        }
+        if(!header_written) {
+            write_header();
+        }
+        if(SpillFile *spill = t.queue.spilled()) {
+            data_end = out.write(data_end, *spill);
+        }
+        const uint64_t compressed_size = data_end - data_start;
+        data_end = out.write(
+            data_end,
+            pack_data_descriptor(compression_result.crc32, compressed_size, t.fi.fsize));
+        localheader lh =
+            make_localheader(t.fi, compression_result, compressed_size, local_header_offset);
+        lh.gp_bitflag |= ZIP_FLAG_DATA_DESCRIPTOR;
+        out.end_stream(data_end);
+        return make_central_header(lh, t.fi, compression_result, local_header_offset);
+    } catch(...) {
+        out.end_stream(data_end);
+        throw;
+    }
+}
+
+// The central headers are collected in whatever order the entries are
+// written in and sorted by the index of the input file at the end.
+typedef std::vector<std::pair<size_t, centralheader>> header_array;
+
+std::string failure_message(const std::exception_ptr &error) {
+    try {
+        std::rethrow_exception(error);
     } catch(const std::exception &e) {
         std::string msg("FAIL: ");
         msg += e.what();
-        tc.add_failure(msg);
+        return msg;
     } catch(...) {
-        tc.add_failure("FAIL: unknown reason.");
+        return "FAIL: unknown reason.";
     }
 }
 
-bool pop_with_state(File &ofile,
-                    task_array &tasks,
-                    std::vector<centralheader> &chs,
-                    TaskControl &tc,
-                    const QueueState state) {
-    auto full_entry = std::find_if(
-        tasks.begin(), tasks.end(), [state](const auto &up) { return up->queue.state() == state; });
-    if(full_entry != tasks.end()) {
-        handle_future(ofile, **full_entry, chs, tc);
-        tasks.erase(full_entry);
-        return true;
+// The task is taken off the task list after this, so its queue is emptied
+// even if it failed.
+template<typename F>
+void handle_entry(CompressionTask &t, header_array &chs, TaskControl &tc, F &&write) {
+    try {
+        chs.emplace_back(t.index, write());
+        tc.add_success("OK: " + t.fi.fname);
+    } catch(...) {
+        discard_data(t.queue);
+        tc.add_failure(failure_message(std::current_exception()));
     }
-    return false;
 }
 
-void pop_future(File &ofile, task_array &tasks, std::vector<centralheader> &chs, TaskControl &tc) {
-    while(true) {
-        if(tc.should_stop()) {
-            return;
+// A task that its worker is done with. Usually the worker has written it
+// already, unless an entry was being streamed at the time.
+centralheader finish_entry(ArchiveWriter &out, CompressionTask &t) {
+    EntryResult r = t.result.get();
+    if(!r.written && !write_finished_entry(out, t, r.compression, r.ch)) {
+        throw std::logic_error("Could not reserve space in the archive.");
+    }
+    return r.ch;
+}
+
+// An entry that fails does not stop the rest of the batch.
+void compress_batch(BatchTask &b, bool use_lzma, const TaskControl &tc) {
+    for(auto &e : b.entries) {
+        e.start = b.arena.size();
+        try {
+            tc.throw_if_stopped();
+            e.compression = compress_entry(e.fi, b.arena, use_lzma, tc);
+            if(!e.compression.additional_unix_extra_data.empty()) {
+                e.fi.ue.data.insert(0, e.compression.additional_unix_extra_data.c_str());
+            }
+        } catch(...) {
+            e.error = std::current_exception();
+            b.arena.truncate(e.start);
+        }
+        e.size = b.arena.size() - e.start;
+    }
+}
+
+// Writes all entries of the batch that did not fail. Returns false if an
+// entry is being streamed at the moment.
+bool write_batch(ArchiveWriter &out, BatchTask &b) {
+    std::vector<std::string> headers(b.entries.size());
+    uint64_t total_size = 0;
+    for(size_t i = 0; i < b.entries.size(); ++i) {
+        const BatchEntry &e = b.entries[i];
+        if(!e.error) {
+            headers[i] = pack_localheader(make_localheader(e.fi, e.compression, e.size, 0));
+            total_size += headers[i].size() + e.size;
+        }
+    }
+    uint64_t offset;
+    if(!out.reserve(total_size, offset)) {
+        return false;
+    }
+    std::vector<QueueBlock> blocks;
+    blocks.reserve(2 * b.entries.size());
+    for(size_t i = 0; i < b.entries.size(); ++i) {
+        BatchEntry &e = b.entries[i];
+        if(e.error) {
+            continue;
+        }
+        const localheader lh = make_localheader(e.fi, e.compression, e.size, offset);
+        headers[i] = pack_localheader(lh);
+        e.ch = make_central_header(lh, e.fi, e.compression, offset);
+        blocks.push_back(QueueBlock{headers[i].data(), (int64_t)headers[i].size()});
+        if(e.size > 0) {
+            blocks.push_back(QueueBlock{b.arena.data() + e.start, e.size});
         }
-        if(pop_with_state(ofile, tasks, chs, tc, QueueState::FULL))
-            return;
-        if(pop_with_state(ofile, tasks, chs, tc, QueueState::SHUTDOWN))
-            return;
-        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        offset += headers[i].size() + e.size;
     }
+    if(!blocks.empty()) {
+        out.write(offset - total_size, blocks.data(), blocks.size());
+    }
+    return true;
+}
+
+void finish_batch(ArchiveWriter &out, BatchTask &b, header_array &chs, TaskControl &tc) {
+    try {
+        if(!b.written.get() && !write_batch(out, b)) {
+            throw std::logic_error("Could not reserve space in the archive.");
+        }
+    } catch(...) {
+        for(auto &e : b.entries) {
+            if(!e.error) {
+                e.error = std::current_exception();
+            }
+        }
+    }
+    for(const auto &e : b.entries) {
+        if(e.error) {
+            tc.add_failure(failure_message(e.error));
+        } else {
+            chs.emplace_back(e.index, e.ch);
+            tc.add_success("OK: " + e.fi.fname);
+        }
+    }
+}
+
+bool is_batched(const fileinfo &f, const PackOptions &opts) {
+    return f.fsize < opts.batch_file_size;
+}
+
+// A file name of - is the standard output.
+File open_output(const std::string &fname) {
+    if(fname != "-") {
+        return File(fname, "wb");
+    }
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    return File(stdout);
 }
 
 } // namespace
 
-ZipCreator::ZipCreator(const std::string fname) : fname(fname) {}
+ZipCreator::ZipCreator(const std::string fname, const PackOptions &opts)
+    : fname(fname), opts(opts) {}
+
+ZipCreator::~ZipCreator() { wait(); }
 
-ZipCreator::~ZipCreator() {
-    if(t) {
+void ZipCreator::wait() {
+    if(t && t->joinable()) {
         t->join();
     }
 }
 
-TaskControl *ZipCreator::create(const std::vector<fileinfo> &files, int num_threads) {
+void ZipCreator::check_not_started() const {
     if(tc.state() != TASK_NOT_STARTED) {
         throw std::logic_error("Tried to start an already used packing process.");
     }
+}
+
+TaskControl *ZipCreator::create(const std::vector<fileinfo> &files, int num_threads) {
+    check_not_started();
+    own_pool.reset(new ThreadPool(num_threads));
+    return create(files, *own_pool);
+}
+
+TaskControl *ZipCreator::create(FileQueue &files, int num_threads) {
+    check_not_started();
+    own_pool.reset(new ThreadPool(num_threads));
+    return create(files, *own_pool);
+}
 
+TaskControl *ZipCreator::create(const std::vector<fileinfo> &files, ThreadPool &pool) {
+    check_not_started();
+    own_files.reset(new FileQueue(std::max<size_t>(files.size(), 1)));
+    for(const auto &f : files) {
+        own_files->push(f);
+    }
+    own_files->close();
     tc.reserve(files.size());
+    return create(*own_files, pool);
+}
+
+TaskControl *ZipCreator::create(FileQueue &files, ThreadPool &pool) {
+    check_not_started();
     tc.set_state(TASK_RUNNING);
     t.reset(new std::thread(
-        [this](const std::vector<fileinfo> &files, int num_threads) {
+        [this, &files, &pool]() {
             try {
-                this->run(files, num_threads);
+                this->run(files, pool);
             } catch(const std::exception &e) {
-                printf("Fail: %s\n", e.what());
+                fprintf(stderr, "Fail: %s\n", e.what());
             } catch(...) {
-                printf("Unknown fail.\n");
+                fprintf(stderr, "Unknown fail.\n");
             }
-        },
-        files,
-        num_threads));
+            tc.set_state(TASK_FINISHED);
+        }));
     return &tc;
 }
 
-void launch_task(task_array &tasks,
+void launch_task(ThreadPool &pool,
+                 task_array &tasks,
+                 const size_t index,
                  const fileinfo &f,
+                 BufferPool &buffers,
                  const int64_t buffer_size,
+                 const std::string &spill_dir,
                  bool use_lzma,
-                 TaskControl &tc) {
-    auto t = std::make_unique<CompressionTask>(f, buffer_size);
-    ByteQueue *bq_ptr = &t->queue;
-    t->result = std::async(std::launch::async, [&f, bq_ptr, use_lzma, &tc]() -> compressresult {
+                 const PackOptions &opts,
+                 TaskControl &tc,
+                 ArchiveWriter &out,
+                 Notifier &n) {
+    auto t = std::make_unique<CompressionTask>(index, f, buffers, buffer_size, spill_dir, &n);
+    CompressionTask *t_ptr = t.get();
+    auto promise = std::make_shared<std::promise<EntryResult>>();
+    t->result = promise->get_future();
+    n.job_started();
+    pool.submit([t_ptr, promise, use_lzma, &opts, &pool, &tc, &out, &n]() {
         try {
-            compressresult result = compress_entry(f, *bq_ptr, use_lzma, tc);
-            bq_ptr->shutdown();
-            return result;
+            compressresult result;
+            try {
+                result = compress_entry(
+                    t_ptr->fi, t_ptr->queue, use_lzma, opts, pool, tc, [t_ptr](uint16_t cformat) {
+                        t_ptr->cformat.store(cformat);
+                    });
+            } catch(...) {
+                t_ptr->queue.shutdown();
+                throw;
+            }
+            // Writes out the end of the spill file, so this can fail too.
+            t_ptr->queue.shutdown();
+            if(!result.additional_unix_extra_data.empty()) {
+                t_ptr->fi.ue.data.insert(0, result.additional_unix_extra_data.c_str());
+            }
+            EntryResult r{result, false, centralheader()};
+            // Unless the writer thread is already streaming it, or is the
+            // only one that may write.
+            if(!out.sequential() && t_ptr->claim()) {
+                r.written = write_finished_entry(out, *t_ptr, result, r.ch);
+            }
+            promise->set_value(std::move(r));
         } catch(...) {
-            bq_ptr->shutdown();
-            throw;
+            promise->set_exception(std::current_exception());
         }
+        n.job_done();
     });
     tasks.push_back(std::move(t));
 }
 
-void ZipCreator::run(const std::vector<fileinfo> &files, const int num_threads) {
+// Takes small entries from the front of pending into one batch.
+void launch_batch(ThreadPool &pool,
+                  batch_array &batches,
+                  pending_set &pending,
+                  bool use_lzma,
+                  const PackOptions &opts,
+                  TaskControl &tc,
+                  ArchiveWriter &out,
+                  Notifier &n) {
+    auto b = std::make_unique<BatchTask>();
+    uint64_t batch_bytes = 0;
+    while(!pending.empty() && is_batched(pending.begin()->fi, opts) &&
+          b->entries.size() < opts.batch_max_files && batch_bytes < opts.batch_max_bytes) {
+        auto node = pending.extract(pending.begin());
+        batch_bytes += node.value().fi.fsize;
+        b->entries.push_back(BatchEntry{
+            node.value().index, std::move(node.value().fi), compressresult(), 0, 0, nullptr, {}});
+    }
+    BatchTask *b_ptr = b.get();
+    auto promise = std::make_shared<std::promise<bool>>();
+    b->written = promise->get_future();
+    n.job_started();
+    pool.submit([b_ptr, promise, use_lzma, &tc, &out, &n]() {
+        compress_batch(*b_ptr, use_lzma, tc);
+        try {
+            promise->set_value(!out.sequential() && write_batch(out, *b_ptr));
+        } catch(...) {
+            promise->set_exception(std::current_exception());
+        }
+        n.job_done();
+    });
+    batches.push_back(std::move(b));
+}
+
+void ZipCreator::run(FileQueue &files, ThreadPool &pool) {
+    const int num_threads = pool.size();
 #ifdef __linux__
     const bool use_lzma = true; // Temporary hack until lzma is fixed on OSX and Windows.
 #else
     const bool use_lzma = false;
 #endif
-    const int64_t queue_size = sizeof(void *) > 4 ? 100 * 1024 * 1024 : 10 * 1024 * 1024;
-    File ofile(fname, "wb");
+    // All queues share one memory budget, a single queue may use at most a tenth of it.
+    BufferPool buffers(BUFFER_BLOCK_SIZE, opts.memory_limit);
+    const int64_t queue_size =
+        std::max(buffers.block_size(), buffers.block_count() * buffers.block_size() / 10);
+    File ofile = open_output(fname);
+    // The standard output may be anything, so it is never seeked.
+    const bool sequential = fname == "-" || ofile.seek(0, SEEK_CUR) != 0;
+    // Spilled data is copied into the archive, which the kernel can do best
+    // within one file system. A pipe gets no spill files, the point of
+    // writing into one is to not need local disk space.
+    const auto last_slash = fname.find_last_of("/\\");
+    const std::string spill_dir = sequential ? ""
+                                  : last_slash == std::string::npos
+                                      ? "."
+                                      : fname.substr(0, last_slash + 1);
     endrecord ed;
-    std::vector<centralheader> chs;
+    header_array chs;
     task_array tasks;
+    batch_array batches;
     assert(num_threads > 0);
     tasks.reserve(num_threads);
+    Notifier n;
+    // The scan may still be going on, it must not use the notifier after this
+    // function is done.
+    files.set_listener(&n);
+    std::unique_ptr<FileQueue, void (*)(FileQueue *)> fcloser(&files,
+                                                            [](FileQueue *q) { q->cancel(); });
+    ArchiveWriter out(ofile, sequential);
+    // The pool may outlive this function, its jobs use the locals above.
+    std::unique_ptr<Notifier, void (*)(Notifier *)> jobs_waiter(
+        &n, [](Notifier *notifier) { notifier->wait_for_jobs(); });
     /*
      * Try to always keep as many compression jobs running as there are processors.
      *
-     * - a task that is finished is written to the output file
+     * - entries are launched while the input is still being scanned, in
+     *   priority order among the ones that have been found so far
+     *
+     * - a task that is finished is written to the output file by its worker
+     *   right away, several of them can be written at the same time
      *
-     * - a task that has filled its buffer is written to the output file in a streaming fashion
+     * - runs of small entries are taken as one batch, which goes to the
+     *   output file in one piece when all of it is done
      *
-     * - only one file is being written to the output file at a time
+     * - a task whose data does not fit in memory goes on in a spill file rather
+     *   than waiting, so new tasks can be launched meanwhile
      *
-     * The problem comes when a huge file blocks and must be written to the result file.
-     * In this case ongoing tasks either finish or fill their buffer and wait. New tasks
-     * can not be launched until the big file is fully written.
+     * - once there is nothing left to launch the oldest running task is
+     *   written to the output file in a streaming fashion, so that the last
+     *   big file does not have to go through a spill file
+     *
+     * A task that can not spill blocks until the writer gets to it. It is then
+     * written out in a streaming fashion like before. While an entry is being
+     * streamed the workers leave their finished entries to the writer.
      */
-    for(const auto &f : files) {
-        if(tc.should_stop()) {
+    pending_set pending;
+    size_t next_index = 0;
+    while(true) {
+        // Workers tell the notifier when they are done and queues when they
+        // have to wait. A stopped task finishes quickly, so it is handled here too.
+        const auto seen = n.generation();
+        auto done = std::find_if(
+            tasks.begin(), tasks.end(), [](const auto &up) { return up->finished(); });
+        if(done != tasks.end()) {
+            CompressionTask &t = **done;
+            handle_entry(t, chs, tc, [&out, &t] { return finish_entry(out, t); });
+            tasks.erase(done);
+            continue;
+        }
+        auto done_batch = std::find_if(
+            batches.begin(), batches.end(), [](const auto &up) { return up->finished(); });
+        if(done_batch != batches.end()) {
+            finish_batch(out, **done_batch, chs, tc);
+            batches.erase(done_batch);
+            continue;
+        }
+        // Take in what the scan has found meanwhile.
+        fileinfo found;
+        while(pending.size() < std::max<uint64_t>(opts.scan_window, 1) && files.try_pop(found)) {
+            pending.insert(PendingEntry{next_index++, std::move(found)});
+        }
+        const bool can_launch = !pending.empty() && !tc.should_stop();
+        const bool scan_done = files.finished() || tc.should_stop();
+        if(can_launch && tasks.size() + batches.size() < (size_t)num_threads) {
+            if(is_batched(pending.begin()->fi, opts)) {
+                launch_batch(pool, batches, pending, use_lzma, opts, tc, out, n);
+                continue;
+            }
+            auto node = pending.extract(pending.begin());
+            launch_task(pool,
+                        tasks,
+                        node.value().index,
+                        node.value().fi,
+                        buffers,
+                        queue_size,
+                        spill_dir,
+                        use_lzma,
+                        opts,
+                        tc,
+                        out,
+                        n);
+            continue;
+        }
+        if(tasks.empty() && batches.empty() && !can_launch && scan_done) {
             break;
         }
-        while((int)tasks.size() >= num_threads) {
-            pop_future(ofile, tasks, chs, tc);
+        auto streamed = std::find_if(tasks.begin(), tasks.end(), [](const auto &up) {
+            return up->queue.state() == QueueState::FULL;
+        });
+        if(streamed == tasks.end() && !can_launch && scan_done) {
+            streamed = std::find_if(tasks.begin(), tasks.end(), [](const auto &up) {
+                return up->queue.state() != QueueState::SHUTDOWN;
+            });
         }
-        launch_task(tasks, f, queue_size, use_lzma, tc);
-    }
-    while(!tasks.empty()) {
-        pop_future(ofile, tasks, chs, tc);
+        // The worker may have claimed it after shutting down the queue.
+        if(streamed != tasks.end() && (*streamed)->claim()) {
+            CompressionTask &t = **streamed;
+            handle_entry(t, chs, tc, [&out, &t] {
+                return out.sequential() ? stream_entry_with_descriptor(out, t)
+                                        : stream_entry(out, t);
+            });
+            tasks.erase(streamed);
+            continue;
+        }
+        n.wait_for_change(seen);
     }
     if(chs.empty()) {
         throw std::runtime_error("All files failed to compress.");
     }
     if(!tc.should_stop()) {
-        uint64_t ch_offset = ofile.tell();
+        // Always in the order of the input files, however the entries were written.
+        std::sort(chs.begin(), chs.end(), [](const auto &a, const auto &b) {
+            return a.first < b.first;
+        });
+        const uint64_t ch_offset = out.end();
+        if(!out.sequential()) {
+            ofile.seek(ch_offset, SEEK_SET);
+        }
+        uint64_t ch_end_offset = ch_offset;
         for(const auto &ch : chs) {
-            write_central_header(ofile, ch);
+            const std::string packed = pack_central_header(ch.second);
+            ofile.write(packed);
+            ch_end_offset += packed.size();
         }
-        uint64_t ch_end_offset = ofile.tell();
 
         // ZIP64 eod record
         zip64endrecord z64r;
         z64r.recordsize = 2 + 2 + 4 + 4 + 8 + 8 + 8 + 8;
-        z64r.version_made_by = chs[0].version_made_by;
+        z64r.version_made_by = chs[0].second.version_made_by;
         z64r.version_needed = NEEDED_VERSION;
         z64r.disk_number = 0;
         z64r.dir_start_disk_number = 0;
@@ -396,6 +1067,7 @@ void ZipCreator::run(const std::vector<fileinfo> &files, const int num_threads)
         ed.dir_size = 0xFFFFFFFF;
         ed.dir_offset_start_disk = 0xFFFFFFFF;
         write_end_record(ofile, ed);
+        // A write error on a pipe may only show up here.
+        ofile.flush();
     }
-    tc.set_state(TASK_FINISHED);
 }
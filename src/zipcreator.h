@@ -16,6 +16,7 @@
  */
 
 #pragma once
+#include "compress.h"
 #include "taskcontrol.h"
 #include "zipdefs.h"
 #include <cstdio>
@@ -24,18 +25,40 @@
 #include <thread>
 #include <vector>
 
+class FileQueue;
+class ThreadPool;
+
 class ZipCreator final {
 
 public:
-    ZipCreator(const std::string fname);
+    // A file name of - writes the archive to the standard output. It and any
+    // other output that can not seek, like a pipe, are written strictly in
+    // order, with data descriptors after entries whose size is not known
+    // when they are started.
+    ZipCreator(const std::string fname, const PackOptions &opts = PackOptions());
     ~ZipCreator();
 
     TaskControl *create(const std::vector<fileinfo> &files, int num_threads);
+    // Packs entries as they come out of the queue, until it is closed. The
+    // queue must outlive the packing.
+    TaskControl *create(FileQueue &files, int num_threads);
+    // These compress on a pool that may be shared with other work, like the
+    // scan of the input. It must outlive the packing.
+    TaskControl *create(const std::vector<fileinfo> &files, ThreadPool &pool);
+    TaskControl *create(FileQueue &files, ThreadPool &pool);
+
+    // Blocks until the packing is done, for callers with nothing to report
+    // meanwhile.
+    void wait();
 
 private:
-    void run(const std::vector<fileinfo> &files, const int num_threads);
+    void check_not_started() const;
+    void run(FileQueue &files, ThreadPool &pool);
 
+    std::unique_ptr<FileQueue> own_files;
+    std::unique_ptr<ThreadPool> own_pool;
     std::unique_ptr<std::thread> t;
     std::string fname;
+    PackOptions opts;
     TaskControl tc;
 };
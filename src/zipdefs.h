@@ -19,20 +19,35 @@
 
 #include <cstdint>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #define ZIP_NO_COMPRESSION 0
 #define ZIP_DEFLATE 8
 #define ZIP_LZMA 14
 
+// The CRC and sizes are in a data descriptor after the data.
+#define ZIP_FLAG_DATA_DESCRIPTOR 0x08
+
 #define ZIP_EXTRA_ZIP64 1
 #define ZIP_EXTRA_UNIX 0xd
+// Parzip's own block, in the central header only. It lists the segments of
+// a deflated entry that were compressed independently of each other: every
+// segment but the last ends in a sync flush and decompresses to exactly
+// segment_size bytes. The data is
+//   uint8  version, 1
+//   uint64 segment_size
+//   uint32 compressed size and uint32 CRC-32 of every segment
+#define ZIP_EXTRA_SEGMENTS 0x7a70
 
 const constexpr uint32_t LOCAL_SIG = 0x04034b50;
 const constexpr uint32_t CENTRAL_SIG = 0x02014b50;
 const constexpr uint32_t CENTRAL_END_SIG = 0x06054b50;
 const constexpr uint32_t ZIP64_CENTRAL_END_SIG = 0x06064b50;
 const constexpr uint32_t ZIP64_CENTRAL_LOCATOR_SIG = 0x07064b50;
+const constexpr uint32_t DATA_DESCRIPTOR_SIG = 0x08074b50;
 const constexpr uint32_t NEEDED_VERSION = 63; // LZMA
+const constexpr uint32_t ZIP64_NEEDED_VERSION = 45;
 
 const constexpr uint16_t MADE_BY_UNIX = 3;
 
@@ -49,6 +64,16 @@ enum filetype {
     UNKNOWN_ENTRY,
 };
 
+struct deflatesegment {
+    uint32_t compressed_size;
+    uint32_t crc32;
+};
+
+struct segmentindex {
+    uint64_t segment_size;
+    std::vector<deflatesegment> segments;
+};
+
 struct unixextra {
     uint32_t atime;
     uint32_t mtime;
@@ -131,3 +156,39 @@ struct endrecord {
     uint32_t dir_offset_start_disk;
     std::string comment;
 };
+
+// Parsed headers that point straight into the archive's memory mapping.
+// Sizes and offsets have the ZIP64 extension already applied.
+
+struct localview {
+    uint16_t needed_version;
+    uint16_t gp_bitflag;
+    uint16_t compression;
+    uint16_t last_mod_time;
+    uint16_t last_mod_date;
+    uint32_t crc32;
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    std::string_view fname;
+    std::string_view extra;
+    uint64_t data_offset;
+};
+
+struct centralview {
+    uint16_t version_made_by;
+    uint16_t version_needed;
+    uint16_t bit_flag;
+    uint16_t compression_method;
+    uint16_t last_mod_time;
+    uint16_t last_mod_date;
+    uint32_t crc32;
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    uint16_t disk_number_start;
+    uint16_t internal_file_attributes;
+    uint32_t external_file_attributes;
+    uint64_t local_header_rel_offset;
+    std::string_view fname;
+    std::string_view extra_field;
+    std::string_view comment;
+};
@@ -17,9 +17,11 @@
 
 #pragma once
 
-#include "file.h"
 #include "taskcontrol.h"
 #include "zipdefs.h"
+#include "decompress.h"
+#include "zipreader.h"
+#include <memory>
 #include <string>
 #include <thread>
 #include <vector>
@@ -42,29 +44,42 @@ public:
     ZipFile(const char *fname);
     ~ZipFile();
 
-    size_t size() const { return entries.size(); }
+    size_t size() const { return archive.size(); }
 
-    TaskControl *unzip(const std::string &prefix, int num_threads) const;
+    // For reading entries from many threads at once.
+    const ZipReader &reader() const { return archive; }
 
-    const std::vector<localheader> localheaders() const { return entries; }
+    TaskControl *unzip(const std::string &prefix,
+                       int num_threads,
+                       const UnpackOptions &opts = UnpackOptions()) const;
+
+    // Unpacks only the entry with the given name on the calling thread,
+    // reading nothing of the archive but its headers and data.
+    UnpackResult extract(const std::string &name,
+                         const std::string &prefix,
+                         const UnpackOptions &opts = UnpackOptions()) const;
+
+    // See ZipReader.
+    std::string read(const std::string &name) const { return archive.read(name); }
+    void read(const std::string &name, OutputSink &out) const { archive.read(name, out); }
+    std::unique_ptr<EntryReader> open_entry(const std::string &name) const {
+        return archive.open_entry(name);
+    }
+
+    // For listing the entries, see EntryTable.
+    const EntryTable &entries() const { return archive.entries(); }
 
     DirectoryDisplayInfo build_tree() const;
 
 private:
-    void run(const std::string &prefix, int num_threads) const;
-
-    void readLocalFileHeaders();
-    void readCentralDirectory();
+    void run(const std::string &prefix, int num_threads, const UnpackOptions &opts) const;
 
-    File zipfile;
-    std::vector<localheader> entries;
-    std::vector<centralheader> centrals;
-    std::vector<long> data_offsets;
+    UnpackResult unpack(const std::string &prefix,
+                        size_t i,
+                        const UnpackOptions &opts,
+                        ThreadPool *pool) const;
 
-    zip64endrecord z64end;
-    zip64locator z64loc;
-    endrecord endloc;
-    size_t fsize;
+    ZipReader archive;
 
     mutable std::unique_ptr<std::thread> t;
     mutable TaskControl tc;
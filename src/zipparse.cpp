@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "zipparse.h"
+#include "fileutils.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+const constexpr uint64_t END_RECORD_SIZE = 22;
+const constexpr uint64_t Z64_LOCATOR_SIZE = 20;
+const constexpr uint64_t Z64_END_SIZE = 56;
+const constexpr uint64_t MAX_COMMENT_SIZE = 0xFFFF;
+
+// In the central directory only those fields that have overflowed
+// are stored in the ZIP64 extra field, in a fixed order.
+void unpack_central_zip64(const uint32_t raw_compressed,
+                          const uint32_t raw_uncompressed,
+                          const uint32_t raw_offset,
+                          centralview &c) {
+    std::string_view block;
+    if(!find_extra_block(c.extra_field, ZIP_EXTRA_ZIP64, block)) {
+        if(raw_compressed == 0xFFFFFFFF || raw_uncompressed == 0xFFFFFFFF ||
+           raw_offset == 0xFFFFFFFF) {
+            throw std::runtime_error(
+                "Entry extra field did not contain ZIP64 extension, file can not be parsed.");
+        }
+        return;
+    }
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(block.data());
+    size_t remaining = block.size();
+    auto next = [&p, &remaining]() {
+        if(remaining < 8) {
+            throw std::runtime_error("Malformed ZIP64 extra data.");
+        }
+        uint64_t v = load64le(p);
+        p += 8;
+        remaining -= 8;
+        return v;
+    };
+    if(raw_uncompressed == 0xFFFFFFFF) {
+        c.uncompressed_size = next();
+    }
+    if(raw_compressed == 0xFFFFFFFF) {
+        c.compressed_size = next();
+    }
+    // Older versions of parzip always stored the header offset here
+    // without marking the header field as overflowed.
+    const bool legacy_offset =
+        raw_uncompressed == 0xFFFFFFFF && raw_compressed == 0xFFFFFFFF && remaining >= 8;
+    if(raw_offset == 0xFFFFFFFF || legacy_offset) {
+        c.local_header_rel_offset = next();
+    }
+}
+
+// Local headers store both sizes in the ZIP64 field if either overflows.
+void unpack_local_zip64(localview &l) {
+    std::string_view block;
+    if(!find_extra_block(l.extra, ZIP_EXTRA_ZIP64, block) || block.size() < 16) {
+        throw std::runtime_error(
+            "Entry extra field did not contain ZIP64 extension, file can not be parsed.");
+    }
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(block.data());
+    l.uncompressed_size = load64le(p);
+    l.compressed_size = load64le(p + 8);
+}
+
+} // namespace
+
+const unsigned char *HeaderParser::at(uint64_t offset, uint64_t size) const {
+    if(offset > data_size || size > data_size - offset) {
+        throw std::runtime_error("Tried to read past end of file.");
+    }
+    return data + offset;
+}
+
+std::string_view HeaderParser::view(uint64_t offset, uint64_t size) const {
+    return std::string_view(reinterpret_cast<const char *>(at(offset, size)), size);
+}
+
+directorylocation HeaderParser::find_directory(endrecord &endloc,
+                                               zip64locator &z64loc,
+                                               zip64endrecord &z64end) const {
+    if(data_size < END_RECORD_SIZE) {
+        throw std::runtime_error("Zip file broken, too small to hold an end of central directory.");
+    }
+    // The end record is the only thing in the archive at a known location.
+    // Look for it from the back within the largest area it can be in.
+    const uint64_t lowest = data_size - std::min(data_size, END_RECORD_SIZE + MAX_COMMENT_SIZE);
+    uint64_t end_pos = data_size - END_RECORD_SIZE + 1;
+    const unsigned char *p = nullptr;
+    while(end_pos-- > lowest) {
+        p = data + end_pos;
+        if(load32le(p) == CENTRAL_END_SIG &&
+           end_pos + END_RECORD_SIZE + load16le(p + 20) == data_size) {
+            break;
+        }
+        p = nullptr;
+    }
+    if(!p) {
+        throw std::runtime_error("Zip file broken, missing end of central directory.");
+    }
+    endloc.disk_number = load16le(p + 4);
+    endloc.central_dir_disk_number = load16le(p + 6);
+    endloc.this_disk_num_entries = load16le(p + 8);
+    endloc.total_entries = load16le(p + 10);
+    endloc.dir_size = load32le(p + 12);
+    endloc.dir_offset_start_disk = load32le(p + 16);
+    endloc.comment = std::string(view(end_pos + END_RECORD_SIZE, load16le(p + 20)));
+
+    directorylocation loc{
+        endloc.dir_offset_start_disk, endloc.dir_size, endloc.total_entries, false};
+    // The ZIP64 locator, if any, sits right before the end record.
+    if(end_pos < Z64_LOCATOR_SIZE) {
+        return loc;
+    }
+    const uint64_t locator_pos = end_pos - Z64_LOCATOR_SIZE;
+    p = at(locator_pos, Z64_LOCATOR_SIZE);
+    if(load32le(p) != ZIP64_CENTRAL_LOCATOR_SIG) {
+        return loc;
+    }
+    z64loc.central_dir_disk_number = load32le(p + 4);
+    z64loc.central_dir_offset = load64le(p + 8);
+    z64loc.num_disks = load32le(p + 16);
+    if(z64loc.central_dir_offset > locator_pos ||
+       locator_pos - z64loc.central_dir_offset < Z64_END_SIZE) {
+        throw std::runtime_error("Zip file broken, zip64 locator points to an invalid location.");
+    }
+    p = at(z64loc.central_dir_offset, Z64_END_SIZE);
+    if(load32le(p) != ZIP64_CENTRAL_END_SIG) {
+        throw std::runtime_error("Zip file broken, zip64 end of central directory missing.");
+    }
+    z64end.recordsize = load64le(p + 4);
+    z64end.version_made_by = load16le(p + 12);
+    z64end.version_needed = load16le(p + 14);
+    z64end.disk_number = load32le(p + 16);
+    z64end.dir_start_disk_number = load32le(p + 20);
+    z64end.this_disk_num_entries = load64le(p + 24);
+    z64end.total_entries = load64le(p + 32);
+    z64end.dir_size = load64le(p + 40);
+    z64end.dir_offset = load64le(p + 48);
+    if(z64end.recordsize < Z64_END_SIZE - 12) {
+        throw std::runtime_error("Zip file broken, zip64 end of central directory too small.");
+    }
+    z64end.extensible = std::string(
+        view(z64loc.central_dir_offset + Z64_END_SIZE, z64end.recordsize - (Z64_END_SIZE - 12)));
+    return directorylocation{z64end.dir_offset, z64end.dir_size, z64end.total_entries, true};
+}
+
+uint64_t HeaderParser::read_central(uint64_t offset, centralview &c) const {
+    const unsigned char *p = at(offset, CENTRAL_HEADER_SIZE);
+    if(load32le(p) != CENTRAL_SIG) {
+        throw std::runtime_error("Zip file broken, central header signature missing.");
+    }
+    c.version_made_by = load16le(p + 4);
+    c.version_needed = load16le(p + 6);
+    c.bit_flag = load16le(p + 8);
+    c.compression_method = load16le(p + 10);
+    c.last_mod_time = load16le(p + 12);
+    c.last_mod_date = load16le(p + 14);
+    c.crc32 = load32le(p + 16);
+    const uint32_t raw_compressed = load32le(p + 20);
+    const uint32_t raw_uncompressed = load32le(p + 24);
+    const uint16_t fname_length = load16le(p + 28);
+    const uint16_t extra_length = load16le(p + 30);
+    const uint16_t comment_length = load16le(p + 32);
+    c.disk_number_start = load16le(p + 34);
+    c.internal_file_attributes = load16le(p + 36);
+    c.external_file_attributes = load32le(p + 38);
+    const uint32_t raw_offset = load32le(p + 42);
+
+    offset += CENTRAL_HEADER_SIZE;
+    c.fname = view(offset, fname_length);
+    offset += fname_length;
+    c.extra_field = view(offset, extra_length);
+    offset += extra_length;
+    c.comment = view(offset, comment_length);
+    offset += comment_length;
+
+    c.compressed_size = raw_compressed;
+    c.uncompressed_size = raw_uncompressed;
+    c.local_header_rel_offset = raw_offset;
+    unpack_central_zip64(raw_compressed, raw_uncompressed, raw_offset, c);
+    return offset;
+}
+
+uint64_t HeaderParser::read_local(uint64_t offset, localview &l) const {
+    const unsigned char *p = at(offset, LOCAL_HEADER_SIZE);
+    if(load32le(p) != LOCAL_SIG) {
+        throw std::runtime_error("Zip file broken, local header signature missing.");
+    }
+    l.needed_version = load16le(p + 4);
+    l.gp_bitflag = load16le(p + 6);
+    l.compression = load16le(p + 8);
+    l.last_mod_time = load16le(p + 10);
+    l.last_mod_date = load16le(p + 12);
+    l.crc32 = load32le(p + 14);
+    l.compressed_size = load32le(p + 18);
+    l.uncompressed_size = load32le(p + 22);
+    const uint16_t fname_length = load16le(p + 26);
+    const uint16_t extra_length = load16le(p + 28);
+
+    offset += LOCAL_HEADER_SIZE;
+    l.fname = view(offset, fname_length);
+    offset += fname_length;
+    l.extra = view(offset, extra_length);
+    offset += extra_length;
+    l.data_offset = offset;
+    if(l.compressed_size == 0xFFFFFFFF || l.uncompressed_size == 0xFFFFFFFF) {
+        unpack_local_zip64(l);
+    }
+    return offset;
+}
+
+bool find_extra_block(std::string_view extra, uint16_t header_id, std::string_view &block) {
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(extra.data());
+    size_t offset = 0;
+    while(offset + 4 <= extra.size()) {
+        const uint16_t id = load16le(p + offset);
+        const uint16_t block_size = load16le(p + offset + 2);
+        offset += 4;
+        if(block_size > extra.size() - offset) {
+            throw std::runtime_error("Malformed extra data.");
+        }
+        if(id == header_id) {
+            block = extra.substr(offset, block_size);
+            return true;
+        }
+        offset += block_size;
+    }
+    return false;
+}
+
+void unpack_unix(std::string_view extra, unixextra &unix) {
+    std::string_view block;
+    if(!find_extra_block(extra, ZIP_EXTRA_UNIX, block)) {
+        unix.atime = 0;
+        return;
+    }
+    if(block.size() < 12) {
+        throw std::runtime_error("Malformed Unix extra data.");
+    }
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(block.data());
+    unix.atime = load32le(p);
+    unix.mtime = load32le(p + 4);
+    unix.uid = load16le(p + 8);
+    unix.gid = load16le(p + 10);
+    unix.data = std::string(block.substr(12));
+}
+
+bool unpack_segments(const centralview &c, segmentindex &index) {
+    std::string_view block;
+    if(c.compression_method != ZIP_DEFLATE ||
+       !find_extra_block(c.extra_field, ZIP_EXTRA_SEGMENTS, block)) {
+        return false;
+    }
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(block.data());
+    if(block.size() < 9 || p[0] != 1 || (block.size() - 9) % 8 != 0) {
+        return false;
+    }
+    index.segment_size = load64le(p + 1);
+    const uint64_t num_segments = (block.size() - 9) / 8;
+    if(index.segment_size == 0 || num_segments == 0 ||
+       (c.uncompressed_size + index.segment_size - 1) / index.segment_size != num_segments) {
+        return false;
+    }
+    index.segments.clear();
+    uint64_t compressed_size = 0;
+    for(uint64_t i = 0; i < num_segments; ++i) {
+        const deflatesegment s{load32le(p + 9 + 8 * i), load32le(p + 13 + 8 * i)};
+        compressed_size += s.compressed_size;
+        index.segments.push_back(s);
+    }
+    return compressed_size == c.compressed_size;
+}
+
+void check_filename(std::string_view fname) {
+    if(fname.size() == 0) {
+        throw std::runtime_error("Empty filename in directory");
+    }
+    if(is_absolute_path(fname)) {
+        throw std::runtime_error("Archive has an absolute filename which is forbidden.");
+    }
+}
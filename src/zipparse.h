@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "zipdefs.h"
+#include <portable_endian.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+// Fixed part sizes of the on-disk headers, signatures included.
+const constexpr uint64_t LOCAL_HEADER_SIZE = 30;
+const constexpr uint64_t CENTRAL_HEADER_SIZE = 46;
+
+// Unaligned little endian loads. Compilers turn these into single moves.
+
+inline uint16_t load16le(const unsigned char *p) {
+    uint16_t r;
+    memcpy(&r, p, sizeof(r));
+    return le16toh(r);
+}
+
+inline uint32_t load32le(const unsigned char *p) {
+    uint32_t r;
+    memcpy(&r, p, sizeof(r));
+    return le32toh(r);
+}
+
+inline uint64_t load64le(const unsigned char *p) {
+    uint64_t r;
+    memcpy(&r, p, sizeof(r));
+    return le64toh(r);
+}
+
+// Where the central directory is, as declared by the end records.
+struct directorylocation {
+    uint64_t dir_offset;
+    uint64_t dir_size;
+    uint64_t num_entries;
+    bool is_zip64;
+};
+
+/*
+ * Parses zip headers directly from an in-memory view of the whole archive,
+ * usually a memory mapping. Every access is checked against the size of
+ * the archive. Names, extra fields and comments in the returned structs
+ * point into the view and are valid for as long as it is.
+ */
+class HeaderParser final {
+public:
+    HeaderParser(const unsigned char *data, uint64_t data_size)
+        : data(data), data_size(data_size) {}
+
+    directorylocation find_directory(endrecord &endloc,
+                                     zip64locator &z64loc,
+                                     zip64endrecord &z64end) const;
+
+    // Both return the offset just past the parsed header.
+    uint64_t read_central(uint64_t offset, centralview &c) const;
+    uint64_t read_local(uint64_t offset, localview &l) const;
+
+private:
+    const unsigned char *at(uint64_t offset, uint64_t size) const;
+    std::string_view view(uint64_t offset, uint64_t size) const;
+
+    const unsigned char *data;
+    uint64_t data_size;
+};
+
+// Returns false if the extra field does not have a block with the given id.
+bool find_extra_block(std::string_view extra, uint16_t header_id, std::string_view &block);
+
+void unpack_unix(std::string_view extra, unixextra &unix);
+
+// Returns false if the entry has no segment index or the index does not
+// add up to the sizes of the entry, which is then inflated as usual.
+bool unpack_segments(const centralview &c, segmentindex &index);
+
+// Throws if the name is not safe to unpack.
+void check_filename(std::string_view fname);
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "zipreader.h"
+#include "taskcontrol.h"
+#include "zipparse.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+// Reads are not part of a task, nothing ever stops them.
+const TaskControl never_stopped;
+
+} // namespace
+
+ZipReader::ZipReader(const char *fname)
+    : zipfile(fname, "rb"), map(zipfile), table(map.data()) {
+    fsize = map.size();
+    HeaderParser parser(map.data(), fsize);
+    endrecord endloc;
+    zip64locator z64loc;
+    zip64endrecord z64end;
+    const auto loc = parser.find_directory(endloc, z64loc, z64end);
+    if(loc.dir_offset > fsize || loc.dir_size > fsize - loc.dir_offset) {
+        throw std::runtime_error("Zip file broken, central directory is outside of file.");
+    }
+    // Entry count is only a hint until we have actually parsed the directory.
+    table.reserve(std::min(loc.num_entries, loc.dir_size / CENTRAL_HEADER_SIZE));
+    const uint64_t dir_end = loc.dir_offset + loc.dir_size;
+    uint64_t offset = loc.dir_offset;
+    centralview c;
+    while(offset + 4 <= dir_end && load32le(map.data() + offset) == CENTRAL_SIG) {
+        const uint64_t header_offset = offset;
+        offset = parser.read_central(offset, c);
+        if(offset > dir_end) {
+            throw std::runtime_error("Zip file broken, central header crosses directory end.");
+        }
+        if(c.bit_flag & 1) {
+            throw std::runtime_error(
+                "This file is encrypted. Encrypted ZIP archives are not supported.");
+        }
+        if(c.local_header_rel_offset >= fsize) {
+            throw std::runtime_error("Zip file broken, entry starts past end of file.");
+        }
+        check_filename(c.fname);
+        table.add(c, header_offset);
+    }
+    if((loc.is_zip64 || loc.num_entries != 0xFFFF) && table.size() != loc.num_entries) {
+        std::string msg("Mismatch. End record lists ");
+        msg += std::to_string(loc.num_entries);
+        msg += " entries but central directory has ";
+        msg += std::to_string(table.size());
+        msg += ".";
+        throw std::runtime_error(msg);
+    }
+    names.build(table.size(), [this](size_t i) { return table.name(i); });
+}
+
+size_t ZipReader::find(std::string_view name) const {
+    return names.find(name, [this](size_t i) { return table.name(i); });
+}
+
+// Local headers are only looked at when the entry is extracted.
+EntryData ZipReader::entry_data(size_t i, localview &lh) const {
+    const uint64_t compressed_size = table.compressed_size(i);
+    HeaderParser parser(map.data(), fsize);
+    parser.read_local(table.local_header_offset(i), lh);
+    if(compressed_size > fsize - lh.data_offset) {
+        throw std::runtime_error("Zip file broken, entry data extends past end of file.");
+    }
+    return EntryData{
+        map.data() + lh.data_offset, compressed_size, zipfile.fileno(), lh.data_offset};
+}
+
+size_t ZipReader::find_file(const std::string &name) const {
+    const size_t i = find(name);
+    if(i == npos) {
+        throw std::runtime_error("No entry named " + name + " in archive.");
+    }
+    if(name.back() == '/') {
+        throw std::runtime_error("Entry " + name + " is a directory.");
+    }
+    return i;
+}
+
+std::string ZipReader::read(const std::string &name) const { return read_entry(find_file(name)); }
+
+std::string ZipReader::read_entry(size_t i) const {
+    if(i >= table.size()) {
+        throw std::out_of_range("Entry index is out of range.");
+    }
+    if(table.is_dir(i)) {
+        throw std::runtime_error("Entry " + std::string(table.name(i)) + " is a directory.");
+    }
+    localview lh;
+    const EntryData entry = entry_data(i, lh);
+    return unpack_to_memory(table.header(i), entry, never_stopped);
+}
+
+void ZipReader::read(const std::string &name, OutputSink &out) const {
+    const size_t i = find_file(name);
+    localview lh;
+    const EntryData entry = entry_data(i, lh);
+    decode_entry(table.header(i), entry, out, never_stopped);
+}
+
+std::unique_ptr<EntryReader> ZipReader::open_entry(const std::string &name) const {
+    const size_t i = find_file(name);
+    localview lh;
+    const EntryData entry = entry_data(i, lh);
+    return std::unique_ptr<EntryReader>(new EntryReader(table.header(i), entry));
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "decompress.h"
+#include "entrytable.h"
+#include "file.h"
+#include "mmapper.h"
+#include "nameindex.hpp"
+#include "zipdefs.h"
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * An opened archive that does not change after its constructor, so any
+ * number of threads can read entries from it at once without locking.
+ * The archive is mapped once and all reads go through the mapping. Each
+ * read has its own decoder, the buffers of which are kept per thread.
+ */
+class ZipReader final {
+public:
+    static const constexpr size_t npos = NameIndex::npos;
+
+    explicit ZipReader(const char *fname);
+
+    size_t size() const { return table.size(); }
+    // The central header of an entry, pieced together from the table.
+    centralview entry(size_t i) const { return table.header(i); }
+    // For going through the entries without touching their headers.
+    const EntryTable &entries() const { return table; }
+
+    // Returns the index of the first entry with the name or npos.
+    size_t find(std::string_view name) const;
+
+    // Parses the local header of an entry. Throws if its data is not
+    // within the archive.
+    EntryData entry_data(size_t i, localview &lh) const;
+
+    // The contents of a file entry. These throw if there is no such entry
+    // or it is broken.
+    std::string read(const std::string &name) const;
+    std::string read_entry(size_t i) const;
+    void read(const std::string &name, OutputSink &out) const;
+
+    // Decodes a file entry as it is read. The reader must not outlive
+    // the ZipReader.
+    std::unique_ptr<EntryReader> open_entry(const std::string &name) const;
+
+    int fileno() const { return zipfile.fileno(); }
+
+private:
+    size_t find_file(const std::string &name) const;
+
+    File zipfile;
+    // The whole archive stays mapped so headers can be parsed in place.
+    MMapper map;
+    uint64_t fsize;
+    EntryTable table;
+    NameIndex names;
+};
@@ -0,0 +1,605 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "zipstream.h"
+#include "fileutils.h"
+#include "threadpool.h"
+#include "utils.h"
+#include "zipparse.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+using std::max;
+#endif
+
+namespace {
+
+const constexpr size_t READ_BUFFER_SIZE = 1024 * 1024;
+
+const char *const TRUNCATED = "Zip file broken, it ends in the middle of an entry.";
+
+File open_input(const char *fname) {
+    if(strcmp(fname, "-") != 0) {
+        return File(fname, "rb");
+    }
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    return File(stdin);
+}
+
+// Returns zero at the end of the input.
+size_t read_some(int fd, unsigned char *buf, size_t size) {
+    while(true) {
+#ifdef _WIN32
+        const int r = _read(fd, buf, (unsigned int)std::min<size_t>(size, INT_MAX));
+#else
+        const ssize_t r = read(fd, buf, size);
+#endif
+        if(r >= 0) {
+            return (size_t)r;
+        }
+        if(errno != EINTR) {
+            throw_system("Could not read archive:");
+        }
+    }
+}
+
+/*
+ * Reads the input from start to end through a buffer. Data can be looked
+ * at before it is consumed, which is how the end of an entry is found
+ * without reading past it.
+ */
+class StreamReader final {
+public:
+    explicit StreamReader(int fd) : fd(fd), buf(READ_BUFFER_SIZE) {}
+
+    // Buffers at least n bytes, unless the input ends first, and returns
+    // how many there are.
+    size_t fill(size_t n) {
+        if(start == end) {
+            start = end = 0;
+        }
+        if(end - start >= n) {
+            return end - start;
+        }
+        if(buf.size() - start < n) {
+            memmove(buf.data(), buf.data() + start, end - start);
+            end -= start;
+            start = 0;
+            if(buf.size() < n) {
+                buf.resize(n);
+            }
+        }
+        while(end - start < n) {
+            const size_t r = read_some(fd, buf.data() + end, buf.size() - end);
+            if(r == 0) {
+                break;
+            }
+            end += r;
+        }
+        return end - start;
+    }
+
+    const unsigned char *data() const { return buf.data() + start; }
+
+    void consume(size_t n) {
+        start += n;
+        consumed += n;
+    }
+
+    // How much has been consumed since the start of the input.
+    uint64_t position() const { return consumed; }
+
+    void read(unsigned char *out, uint64_t n) {
+        while(n > 0) {
+            if(start == end && n >= buf.size()) {
+                // Big reads skip the buffer.
+                const size_t r = read_some(fd, out, (size_t)std::min<uint64_t>(n, SIZE_MAX));
+                if(r == 0) {
+                    throw std::runtime_error(TRUNCATED);
+                }
+                consumed += r;
+                out += r;
+                n -= r;
+                continue;
+            }
+            const size_t got = fill(1);
+            if(got == 0) {
+                throw std::runtime_error(TRUNCATED);
+            }
+            const size_t step = (size_t)std::min<uint64_t>(got, n);
+            memcpy(out, data(), step);
+            consume(step);
+            out += step;
+            n -= step;
+        }
+    }
+
+    std::string read(size_t n) {
+        std::string result(n, '\0');
+        read(reinterpret_cast<unsigned char *>(&result[0]), n);
+        return result;
+    }
+
+    std::string read_all() {
+        std::string result;
+        while(fill(READ_BUFFER_SIZE) > 0) {
+            result.append(reinterpret_cast<const char *>(data()), end - start);
+            consume(end - start);
+        }
+        return result;
+    }
+
+private:
+    int fd;
+    std::vector<unsigned char> buf;
+    size_t start = 0;
+    size_t end = 0;
+    uint64_t consumed = 0;
+};
+
+// What the stream said about an entry, checked against its central header
+// at the end.
+struct StreamedEntry {
+    uint64_t offset;
+    std::string fname;
+    uint32_t crc32;
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    // On disk and waiting for its central header.
+    bool unpacked;
+};
+
+// An entry that is read into memory and unpacked on a worker thread.
+struct BufferedEntry {
+    std::string header;
+    localview lh;
+    unixextra unix;
+    std::unique_ptr<unsigned char[]> data;
+};
+
+typedef std::pair<size_t, UnpackResult> StreamResult;
+
+// The views of lh point into header.
+void read_local_header(StreamReader &in, std::string &header, localview &lh) {
+    header = in.read(LOCAL_HEADER_SIZE);
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(header.data());
+    header += in.read(load16le(p + 26) + load16le(p + 28));
+    HeaderParser(reinterpret_cast<const unsigned char *>(header.data()), header.size())
+        .read_local(0, lh);
+    if(lh.gp_bitflag & 1) {
+        throw std::runtime_error(
+            "This file is encrypted. Encrypted ZIP archives are not supported.");
+    }
+    check_filename(lh.fname);
+}
+
+// Until the central header comes the entry is unpacked as a plain file or
+// a directory without permissions.
+centralview local_to_central(const localview &l) {
+    centralview c;
+    c.version_made_by = 0;
+    c.version_needed = l.needed_version;
+    c.bit_flag = l.gp_bitflag;
+    c.compression_method = l.compression;
+    c.last_mod_time = l.last_mod_time;
+    c.last_mod_date = l.last_mod_date;
+    c.crc32 = l.crc32;
+    c.compressed_size = l.compressed_size;
+    c.uncompressed_size = l.uncompressed_size;
+    c.disk_number_start = 0;
+    c.internal_file_attributes = 0;
+    c.external_file_attributes = 0;
+    c.local_header_rel_offset = 0;
+    c.fname = l.fname;
+    c.extra_field = l.extra;
+    return c;
+}
+
+// If the local header has a zip64 block the data descriptor has 64 bit sizes.
+bool has_zip64(const localview &lh) {
+    std::string_view block;
+    return find_extra_block(lh.extra, ZIP_EXTRA_ZIP64, block);
+}
+
+// The signature of a data descriptor is optional.
+void read_data_descriptor(StreamReader &in, bool zip64, StreamedEntry &e) {
+    if(in.fill(4) >= 4 && load32le(in.data()) == DATA_DESCRIPTOR_SIG) {
+        in.consume(4);
+    }
+    const std::string d = in.read(zip64 ? 20 : 12);
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(d.data());
+    e.crc32 = load32le(p);
+    e.compressed_size = zip64 ? load64le(p + 4) : load32le(p + 4);
+    e.uncompressed_size = zip64 ? load64le(p + 12) : load32le(p + 8);
+}
+
+// Stored data has no end of its own. It ends where a data descriptor that
+// matches it starts, which only works if the descriptor has its signature.
+void feed_stored(StreamReader &in, StreamDecoder &dec, bool zip64, const TaskControl &tc) {
+    const size_t descriptor_size = zip64 ? 24 : 16;
+    while(true) {
+        const size_t got = in.fill(descriptor_size);
+        if(got < descriptor_size) {
+            throw std::runtime_error(TRUNCATED);
+        }
+        const unsigned char *p = in.data();
+        // The last bytes are looked at again once more data is buffered.
+        const size_t limit = got - descriptor_size + 1;
+        size_t i = 0;
+        while(i < limit && load32le(p + i) != DATA_DESCRIPTOR_SIG) {
+            const void *next = memchr(p + i + 1, DATA_DESCRIPTOR_SIG & 0xFF, limit - i - 1);
+            i = next ? static_cast<const unsigned char *>(next) - p : limit;
+        }
+        dec.feed(p, i, tc);
+        in.consume(i);
+        if(i == limit) {
+            continue;
+        }
+        const unsigned char *d = in.data() + 4;
+        const uint64_t csize = zip64 ? load64le(d + 4) : load32le(d + 4);
+        const uint64_t usize = zip64 ? load64le(d + 12) : load32le(d + 8);
+        if(load32le(d) == dec.crc() && csize == dec.total() && usize == dec.total()) {
+            return;
+        }
+        dec.feed(in.data(), 1, tc);
+        in.consume(1);
+    }
+}
+
+/*
+ * Unpacks an entry while reading it, for entries whose size is not known
+ * before their data ends and ones too big to be kept in memory. A file is
+ * left under its temporary name until its central header is known. Failing
+ * to write the entry is returned as its result, the rest of its data is
+ * still read. Throws if the input is broken so that the next entry can not
+ * be found.
+ */
+UnpackResult unpack_from_stream(StreamReader &in,
+                                const std::string &prefix,
+                                const localview &lh,
+                                StreamedEntry &e,
+                                const TaskControl &tc) {
+    const bool has_descriptor = lh.gp_bitflag & ZIP_FLAG_DATA_DESCRIPTOR;
+    const bool is_dir = e.fname.back() == '/';
+    const std::string ofname = output_name(prefix, e.fname);
+    std::string tmpname;
+    File ofile;
+    std::string error;
+    try {
+        if(is_dir) {
+            mkdirp(ofname);
+        } else {
+            if(exists_on_fs(ofname)) {
+                throw std::runtime_error("Already exists, will not overwrite.");
+            }
+            create_dirs_for_file(ofname);
+            tmpname = temporary_name(ofname);
+            ofile = File(tmpname, "w+b");
+        }
+    } catch(const std::exception &ex) {
+        error = ex.what();
+    }
+    try {
+        FileSink out(error.empty() ? ofile.get() : nullptr);
+        FileSink discard(nullptr);
+        std::unique_ptr<StreamDecoder> dec;
+        try {
+            dec.reset(new StreamDecoder(lh.compression, out));
+        } catch(const std::exception &ex) {
+            if(has_descriptor) {
+                throw;
+            }
+            error = ex.what();
+            dec.reset(new StreamDecoder(ZIP_NO_COMPRESSION, discard));
+        }
+        const uint64_t data_start = in.position();
+        if(!has_descriptor) {
+            uint64_t remaining = lh.compressed_size;
+            while(remaining > 0) {
+                tc.throw_if_stopped();
+                const size_t got = in.fill(1);
+                if(got == 0) {
+                    throw std::runtime_error(TRUNCATED);
+                }
+                const size_t step = (size_t)std::min<uint64_t>(got, remaining);
+                if(error.empty()) {
+                    try {
+                        dec->feed(in.data(), step, tc);
+                    } catch(const std::exception &ex) {
+                        error = ex.what();
+                    }
+                }
+                in.consume(step);
+                remaining -= step;
+            }
+        } else if(lh.compression == ZIP_NO_COMPRESSION) {
+            feed_stored(in, *dec, has_zip64(lh), tc);
+        } else {
+            while(!dec->ended()) {
+                const size_t got = in.fill(1);
+                if(got == 0) {
+                    throw std::runtime_error(TRUNCATED);
+                }
+                const size_t used = dec->feed(in.data(), got, tc);
+                if(used == 0 && !dec->ended()) {
+                    throw std::runtime_error("Zip file broken, could not decode entry.");
+                }
+                in.consume(used);
+            }
+        }
+        const uint64_t data_size = in.position() - data_start;
+        if(has_descriptor) {
+            read_data_descriptor(in, has_zip64(lh), e);
+            if(data_size != e.compressed_size) {
+                throw std::runtime_error("Zip file broken, data descriptor has the wrong size.");
+            }
+        }
+        // Directories are recorded with whatever size, their data is not used.
+        if(error.empty() && !is_dir) {
+            if(dec->crc() != e.crc32) {
+                error = "CRC32 checksum is invalid.";
+            } else if(dec->total() != e.uncompressed_size) {
+                error = "Entry is not the size its header says.";
+            }
+        }
+    } catch(...) {
+        if(!tmpname.empty()) {
+            unlink(tmpname.c_str());
+        }
+        throw;
+    }
+    if(!tmpname.empty()) {
+        if(ofile.get()) {
+            ofile.close();
+        }
+        if(!error.empty()) {
+            unlink(tmpname.c_str());
+        }
+    }
+    if(!error.empty()) {
+        return UnpackResult{false, "FAIL: " + e.fname + "\n" + error};
+    }
+    return UnpackResult{true, "OK: " + e.fname};
+}
+
+// Removes what was unpacked of an entry that did not make it into the archive.
+void discard_entry(const std::string &prefix, const StreamedEntry &e) {
+    const std::string ofname = output_name(prefix, e.fname);
+    if(e.fname.back() == '/') {
+        // Only goes if nothing else was unpacked into it.
+        remove(ofname.c_str());
+    } else {
+        unlink(temporary_name(ofname).c_str());
+    }
+}
+
+} // namespace
+
+ZipStream::ZipStream(const char *fname) : in(open_input(fname)) {}
+
+ZipStream::~ZipStream() {
+    if(t) {
+        t->join();
+    }
+}
+
+TaskControl *ZipStream::unzip(const std::string &prefix,
+                              int num_threads,
+                              const UnpackOptions &opts) {
+    if(num_threads < 0) {
+        num_threads = max((int)std::thread::hardware_concurrency(), 1);
+    }
+    if(tc.state() != TASK_NOT_STARTED) {
+        throw std::logic_error("Tried to start an already used packing process.");
+    }
+    tc.set_state(TASK_RUNNING);
+    t.reset(new std::thread(
+        [this](const std::string prefix, int num_threads, const UnpackOptions opts) {
+            try {
+                this->run(prefix, num_threads, opts);
+            } catch(const std::exception &e) {
+                tc.add_failure(std::string("Fail: ") + e.what());
+            } catch(...) {
+                tc.add_failure("Unknown fail.");
+            }
+            tc.set_state(TASK_FINISHED);
+        },
+        prefix,
+        num_threads,
+        opts));
+    return &tc;
+}
+
+void ZipStream::run(const std::string &prefix, int num_threads, const UnpackOptions &opts) {
+    StreamReader reader(in.fileno());
+    std::vector<StreamedEntry> entries;
+    CompletionQueue<StreamResult> done;
+    ThreadPool pool(num_threads);
+    // Files get their real names only once the central directory says so.
+    UnpackOptions entry_opts = opts;
+    entry_opts.keep_temporary_names = true;
+    const size_t max_in_flight = 4 * (size_t)num_threads;
+    const uint64_t max_buffered_entry = opts.stream_memory_limit / 10;
+    size_t in_flight = 0;
+    uint64_t buffered = 0;
+    auto collect = [&]() {
+        StreamResult r = done.pop();
+        --in_flight;
+        buffered -= entries[r.first].compressed_size;
+        if(r.second.success) {
+            entries[r.first].unpacked = true;
+        } else {
+            tc.add_failure(r.second.msg);
+        }
+    };
+    // Nothing is left behind that was not matched with a central header.
+    auto discard_unreconciled = [&]() {
+        for(auto &e : entries) {
+            if(e.unpacked) {
+                discard_entry(prefix, e);
+                e.unpacked = false;
+            }
+        }
+    };
+    std::string directory;
+    try {
+        while(true) {
+            if(reader.fill(4) < 4) {
+                throw std::runtime_error("Zip file broken, central directory missing.");
+            }
+            const uint32_t sig = load32le(reader.data());
+            if(sig == CENTRAL_SIG || sig == CENTRAL_END_SIG || sig == ZIP64_CENTRAL_END_SIG) {
+                break;
+            }
+            if(sig != LOCAL_SIG) {
+                throw std::runtime_error("Zip file broken, local header signature missing.");
+            }
+            tc.throw_if_stopped();
+            const uint64_t offset = reader.position();
+            auto b = std::make_shared<BufferedEntry>();
+            read_local_header(reader, b->header, b->lh);
+            const localview &lh = b->lh;
+            entries.push_back(StreamedEntry{offset,
+                                            std::string(lh.fname),
+                                            lh.crc32,
+                                            lh.compressed_size,
+                                            lh.uncompressed_size,
+                                            false});
+            const size_t index = entries.size() - 1;
+            if((lh.gp_bitflag & ZIP_FLAG_DATA_DESCRIPTOR) ||
+               lh.compressed_size > max_buffered_entry) {
+                const UnpackResult r = unpack_from_stream(reader, prefix, lh, entries[index], tc);
+                entries[index].unpacked = r.success;
+                if(!r.success) {
+                    tc.add_failure(r.msg);
+                }
+                continue;
+            }
+            while(in_flight > 0 && (in_flight >= max_in_flight ||
+                                    buffered + lh.compressed_size > opts.stream_memory_limit)) {
+                collect();
+            }
+            b->data.reset(new unsigned char[lh.compressed_size]);
+            reader.read(b->data.get(), lh.compressed_size);
+            buffered += lh.compressed_size;
+            ++in_flight;
+            pool.submit([this, b, index, &prefix, &entry_opts, &pool, &done]() {
+                UnpackResult r;
+                try {
+                    unpack_unix(b->lh.extra, b->unix);
+                    const EntryData entry{b->data.get(), b->lh.compressed_size, -1, 0};
+                    r = unpack_entry(prefix,
+                                     local_to_central(b->lh),
+                                     b->unix,
+                                     entry,
+                                     entry_opts,
+                                     &pool,
+                                     tc);
+                } catch(const std::exception &e) {
+                    r = UnpackResult{false,
+                                     "FAIL: " + std::string(b->lh.fname) + "\n" + e.what()};
+                }
+                done.push(StreamResult(index, std::move(r)));
+            });
+        }
+        directory = reader.read_all();
+    } catch(...) {
+        while(in_flight > 0) {
+            collect();
+        }
+        discard_unreconciled();
+        throw;
+    }
+    while(in_flight > 0) {
+        collect();
+    }
+
+    // The central directory has the final say, including on what type
+    // each entry is. Entries it does not list are not part of the archive.
+    try {
+        HeaderParser parser(reinterpret_cast<const unsigned char *>(directory.data()),
+                            directory.size());
+        std::vector<bool> listed(entries.size(), false);
+        uint64_t pos = 0;
+        while(pos + 4 <= directory.size() &&
+              load32le(reinterpret_cast<const unsigned char *>(directory.data()) + pos) ==
+                  CENTRAL_SIG) {
+            tc.throw_if_stopped();
+            centralview ch;
+            pos = parser.read_central(pos, ch);
+            const std::string fname(ch.fname);
+            auto it = std::lower_bound(
+                entries.begin(),
+                entries.end(),
+                ch.local_header_rel_offset,
+                [](const StreamedEntry &e, uint64_t offset) { return e.offset < offset; });
+            if(it == entries.end() || it->offset != ch.local_header_rel_offset) {
+                tc.add_failure("FAIL: " + fname + "\nNo local header at the offset the central "
+                               "directory gives.");
+                continue;
+            }
+            listed[it - entries.begin()] = true;
+            if(!it->unpacked) {
+                continue;
+            }
+            it->unpacked = false;
+            if(it->fname != fname || it->crc32 != ch.crc32 ||
+               it->compressed_size != ch.compressed_size ||
+               it->uncompressed_size != ch.uncompressed_size) {
+                discard_entry(prefix, *it);
+                tc.add_failure("FAIL: " + fname +
+                               "\nCentral directory does not match the local header.");
+                continue;
+            }
+            unixextra unix;
+            unpack_unix(ch.extra_field, unix);
+            const UnpackResult r = reconcile_entry(prefix, ch, unix);
+            if(r.success) {
+                tc.add_success(r.msg);
+            } else {
+                tc.add_failure(r.msg);
+            }
+        }
+        for(size_t i = 0; i < entries.size(); i++) {
+            if(!listed[i]) {
+                tc.add_failure("FAIL: " + entries[i].fname +
+                               "\nEntry is not in the central directory.");
+            }
+        }
+    } catch(...) {
+        discard_unreconciled();
+        throw;
+    }
+    discard_unreconciled();
+}
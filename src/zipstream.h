@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "decompress.h"
+#include "file.h"
+#include "taskcontrol.h"
+
+#include <memory>
+#include <string>
+#include <thread>
+
+/*
+ * Unpacks an archive that can only be read from start to end, such as one
+ * that is being downloaded into a pipe. Entries are unpacked as their local
+ * headers and data come in and the central directory at the end decides
+ * what they turn into.
+ */
+class ZipStream final {
+public:
+    // A file name of - is the standard input.
+    explicit ZipStream(const char *fname);
+    ~ZipStream();
+
+    TaskControl *unzip(const std::string &prefix,
+                       int num_threads,
+                       const UnpackOptions &opts = UnpackOptions());
+
+private:
+    void run(const std::string &prefix, int num_threads, const UnpackOptions &opts);
+
+    File in;
+    std::unique_ptr<std::thread> t;
+    TaskControl tc;
+};
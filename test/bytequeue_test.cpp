@@ -19,6 +19,9 @@
 #include <array>
 #include <bytequeue.hpp>
 #include <cstdint>
+#include <cstdio>
+#include <file.h>
+#include <memory>
 #include <smalltest.hpp>
 #include <vector>
 
@@ -170,10 +173,86 @@ void multibuf_test() {
     ST_ASSERT(inmsg == outmsg);
 }
 
+void shared_pool_test() {
+    // Fewer blocks than queues. Like the archive writer, pick a queue that is
+    // full or done and then drain it to the end.
+    const int num_queues = 6;
+    const int test_size = 100 * 1000;
+    BufferPool pool(64, 4 * 64);
+    Notifier n;
+    std::vector<std::unique_ptr<ByteQueue>> queues;
+    std::vector<std::future<void>> pushers;
+    for(int i = 0; i < num_queues; ++i) {
+        queues.emplace_back(new ByteQueue(pool, 1000));
+        queues.back()->set_listener(&n);
+        pushers.emplace_back(std::async(std::launch::async, [&bq = *queues.back(), i] {
+            std::string data(test_size, (char)('a' + i));
+            for(int pos = 0; pos < test_size; pos += 333) {
+                bq.push(data.c_str() + pos, std::min(333, test_size - pos));
+            }
+            bq.shutdown();
+        }));
+    }
+    std::vector<bool> done(num_queues, false);
+    for(int finished = 0; finished < num_queues;) {
+        const auto seen = n.generation();
+        int ready = 0;
+        while(ready < num_queues &&
+              (done[ready] || !(queues[ready]->state() == QueueState::FULL ||
+                                queues[ready]->state() == QueueState::SHUTDOWN))) {
+            ++ready;
+        }
+        if(ready == num_queues) {
+            n.wait_for_change(seen);
+            continue;
+        }
+        std::string result = get_all(queues[ready].get());
+        ST_ASSERT(result == std::string(test_size, (char)('a' + ready)));
+        done[ready] = true;
+        ++finished;
+    }
+    std::for_each(pushers.begin(), pushers.end(), [](auto &f) { f.get(); });
+    queues.clear();
+    ST_ASSERT(pool.peak_usage() <= pool.block_count());
+}
+
+void spill_test() {
+    // Nobody reads the queue until everything is in, which only works if
+    // the data that does not fit goes to a spill file.
+    const int test_size = 10 * 1000;
+    BufferPool pool(64, 2 * 64);
+    ByteQueue bq(pool, 2 * 64);
+    bq.set_spill_dir(".");
+    std::string data;
+    for(int i = 0; i < test_size; ++i) {
+        data += (char)('a' + i % 26);
+    }
+    for(int pos = 0; pos < test_size; pos += 333) {
+        bq.push(data.c_str() + pos, std::min(333, test_size - pos));
+    }
+    bq.shutdown();
+    ST_ASSERT(bq.spilled());
+
+    File out(tmpfile());
+    while(bq.drain([&out](const QueueBlock *blocks, size_t count) {
+        for(size_t i = 0; i < count; ++i) {
+            out.write(blocks[i].data, blocks[i].size);
+        }
+    })) {
+    }
+    out.flush();
+    const uint64_t end = bq.spilled()->copy_to(out, out.tell());
+    ST_ASSERT(end == (uint64_t)test_size);
+    out.seek(0, SEEK_SET);
+    ST_ASSERT(out.read(test_size) == data);
+}
+
 int main(int, char **) {
     ST_TEST(simple_data_test);
     ST_TEST(split_data_test);
     ST_TEST(big_buf_test);
     ST_TEST(multibuf_test);
+    ST_TEST(shared_pool_test);
+    ST_TEST(spill_test);
     return 0;
 }
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures how fast data moves through a ByteQueue from one thread to
+// another, both when copied in with push() and when written in place.
+// Usage: bytequeuebench [data size in MiB] [push size in KiB]
+
+#include <bytequeue.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <vector>
+
+namespace {
+
+template<typename P> double run(const uint64_t total, P &&produce) {
+    BufferPool pool(1024 * 1024, 64 * 1024 * 1024);
+    ByteQueue bq(pool, 16 * 1024 * 1024);
+    uint64_t received = 0;
+    const auto start = std::chrono::steady_clock::now();
+    auto consumer = std::async(std::launch::async, [&bq, &received] {
+        while(bq.drain([&received](const QueueBlock *blocks, size_t count) {
+            for(size_t i = 0; i < count; ++i) {
+                received += blocks[i].size;
+            }
+        })) {
+        }
+    });
+    produce(bq);
+    bq.shutdown();
+    consumer.get();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if(received != total) {
+        printf("Lost data: %llu of %llu bytes.\n",
+               (unsigned long long)received,
+               (unsigned long long)total);
+        exit(1);
+    }
+    return double(total) / (1024 * 1024 * 1024) / elapsed.count();
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    const uint64_t total = (argc > 1 ? strtoull(argv[1], nullptr, 10) : 4096) * 1024 * 1024;
+    const int64_t step = (argc > 2 ? atoi(argv[2]) : 64) * 1024;
+    std::vector<char> data(step, 'x');
+
+    const double push_speed = run(total, [&](ByteQueue &bq) {
+        for(uint64_t pos = 0; pos < total; pos += step) {
+            bq.push(data.data(), std::min<uint64_t>(step, total - pos));
+        }
+    });
+    printf("push       %8.2f GiB/s\n", push_speed);
+
+    const double commit_speed = run(total, [&](ByteQueue &bq) {
+        for(uint64_t pos = 0; pos < total;) {
+            unsigned char *space = bq.space();
+            const uint64_t size = std::min<uint64_t>({(uint64_t)step, total - pos,
+                                                      (uint64_t)bq.space_size()});
+            memset(space, 'x', size);
+            bq.commit(size);
+            pos += size;
+        }
+    });
+    printf("in place   %8.2f GiB/s\n", commit_speed);
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <crc.h>
+#include <random>
+#include <smalltest.hpp>
+#include <vector>
+#include <zlib.h>
+
+std::vector<unsigned char> random_data(size_t size) {
+    std::mt19937 gen(42);
+    std::vector<unsigned char> data(size);
+    for(auto &c : data) {
+        c = gen() & 0xFF;
+    }
+    return data;
+}
+
+void known_value_test() {
+    const unsigned char text[] = "123456789";
+    for(const auto &e : crc32_engines()) {
+        ST_ASSERT(e.func(0, text, 9) == 0xCBF43926);
+    }
+}
+
+// Every length and alignment around the block sizes of the kernels.
+void zlib_match_test() {
+    const auto data = random_data(4096 + 64);
+    for(const auto &e : crc32_engines()) {
+        for(size_t offset = 0; offset < 16; ++offset) {
+            for(size_t size = 0; size <= 1024; ++size) {
+                const uint32_t expected = crc32(0x12345678, data.data() + offset, size);
+                ST_ASSERT(e.func(0x12345678, data.data() + offset, size) == expected);
+            }
+        }
+    }
+}
+
+void continuation_test() {
+    const auto data = random_data(1024 * 1024 + 13);
+    const uint32_t expected = crc32(0, data.data(), data.size());
+    for(const auto &e : crc32_engines()) {
+        ST_ASSERT(e.func(0, data.data(), data.size()) == expected);
+        uint32_t crc = 0;
+        for(size_t pos = 0; pos < data.size(); pos += 1000) {
+            crc = e.func(crc, data.data() + pos, std::min<size_t>(1000, data.size() - pos));
+        }
+        ST_ASSERT(crc == expected);
+    }
+    ST_ASSERT(crc32_update(0, data.data(), data.size()) == expected);
+}
+
+int main(int, char **) {
+    ST_TEST(known_value_test);
+    ST_TEST(zlib_match_test);
+    ST_TEST(continuation_test);
+    return 0;
+}
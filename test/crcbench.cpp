@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures the throughput of every CRC-32 engine this CPU supports.
+// Usage: crcbench [buffer size in MiB] [rounds]
+
+#include <crc.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+int main(int argc, char **argv) {
+    const size_t mib = argc > 1 ? strtoul(argv[1], nullptr, 10) : 64;
+    const int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    std::vector<unsigned char> data(mib * 1024 * 1024);
+    for(size_t i = 0; i < data.size(); ++i) {
+        data[i] = (i * 2654435761u) >> 24;
+    }
+    for(const auto &e : crc32_engines()) {
+        uint32_t crc = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < rounds; ++i) {
+            crc = e.func(crc, data.data(), data.size());
+        }
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        const double gbytes = double(data.size()) * rounds / (1024 * 1024 * 1024);
+        printf("%-10s %8.2f GiB/s  (crc %08x)\n", e.name, gbytes / elapsed.count(), crc);
+    }
+    return 0;
+}
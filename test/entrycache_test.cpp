@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <entrycache.h>
+#include <smalltest.hpp>
+#include <testarchive.hpp>
+#include <zipreader.h>
+
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const int NUM_FILES = 20;
+const size_t FILE_SIZE = 10000;
+
+const fs::path test_dir = fs::temp_directory_path() / "parzip_entrycache_test";
+
+std::string file_name(int i) { return "files/f" + std::to_string(i); }
+
+std::string file_contents(int i) { return std::string(FILE_SIZE, 'a' + i); }
+
+// Packs the test files in a fresh directory and leaves it as the working
+// directory.
+void create_archive() {
+    enter_test_dir(test_dir);
+    for(int i = 0; i < NUM_FILES; ++i) {
+        write_test_file(file_name(i), file_contents(i));
+    }
+    pack_test_archive({"files"});
+}
+
+} // namespace
+
+void hit_test() {
+    const ZipReader r("test.zip");
+    EntryCache cache(r, 1024 * 1024);
+    auto d1 = cache.get(file_name(3));
+    auto d2 = cache.get(file_name(3));
+    ST_ASSERT(*d1 == file_contents(3));
+    ST_ASSERT(d1 == d2);
+    const auto s = cache.stats();
+    ST_ASSERT(s.hits == 1);
+    ST_ASSERT(s.misses == 1);
+    ST_ASSERT(s.bytes == FILE_SIZE);
+    bool thrown = false;
+    try {
+        cache.get("files/nothere");
+    } catch(const std::exception &) {
+        thrown = true;
+    }
+    ST_ASSERT(thrown);
+}
+
+void eviction_test() {
+    const ZipReader r("test.zip");
+    // Room for three entries in one shard.
+    EntryCache cache(r, 3 * FILE_SIZE, 1);
+    for(int i = 0; i < NUM_FILES; ++i) {
+        ST_ASSERT(*cache.get(file_name(i)) == file_contents(i));
+        ST_ASSERT(cache.stats().bytes <= 3 * FILE_SIZE);
+    }
+    ST_ASSERT(cache.stats().evictions == NUM_FILES - 3);
+    // The most recent ones are still there, the first one is not.
+    cache.get(file_name(NUM_FILES - 1));
+    ST_ASSERT(cache.stats().hits == 1);
+    cache.get(file_name(0));
+    ST_ASSERT(cache.stats().hits == 1);
+
+    // Too big for the budget, read every time and never kept.
+    EntryCache tiny(r, FILE_SIZE - 1, 1);
+    tiny.get(file_name(1));
+    tiny.get(file_name(1));
+    ST_ASSERT(tiny.stats().misses == 2);
+    ST_ASSERT(tiny.stats().bytes == 0);
+}
+
+// However many threads ask for an entry at once, it is decoded once.
+void concurrent_test() {
+    const ZipReader r("test.zip");
+    EntryCache cache(r, 1024 * 1024, 4);
+    std::vector<std::thread> threads;
+    std::vector<int> errors(8, 0);
+    for(int t = 0; t < 8; ++t) {
+        threads.emplace_back([&cache, &errors, t]() {
+            for(int i = 0; i < NUM_FILES; ++i) {
+                if(*cache.get(file_name(i)) != file_contents(i)) {
+                    ++errors[t];
+                }
+            }
+        });
+    }
+    for(auto &t : threads) {
+        t.join();
+    }
+    for(const int e : errors) {
+        ST_ASSERT(e == 0);
+    }
+    const auto s = cache.stats();
+    ST_ASSERT(s.misses == NUM_FILES);
+    ST_ASSERT(s.hits == 7 * NUM_FILES);
+}
+
+int main(int, char **) {
+    create_archive();
+    ST_TEST(hit_test);
+    ST_TEST(eviction_test);
+    ST_TEST(concurrent_test);
+    fs::current_path(test_dir.parent_path());
+    fs::remove_all(test_dir);
+    return 0;
+}
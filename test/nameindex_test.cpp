@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <nameindex.hpp>
+#include <smalltest.hpp>
+#include <string>
+#include <vector>
+
+namespace {
+
+size_t lookup(const NameIndex &index, const std::vector<std::string> &names, const char *name) {
+    return index.find(name, [&names](size_t i) { return std::string_view(names[i]); });
+}
+
+} // namespace
+
+void basic_test() {
+    const std::vector<std::string> names{"a.txt", "dir/", "dir/b.txt", "", "dir/c.txt"};
+    NameIndex index;
+    index.build(names.size(), [&names](size_t i) { return std::string_view(names[i]); });
+    for(size_t i = 0; i < names.size(); ++i) {
+        ST_ASSERT(lookup(index, names, names[i].c_str()) == i);
+    }
+    ST_ASSERT(lookup(index, names, "b.txt") == NameIndex::npos);
+    ST_ASSERT(lookup(index, names, "dir") == NameIndex::npos);
+}
+
+void empty_test() {
+    const std::vector<std::string> names;
+    NameIndex index;
+    ST_ASSERT(lookup(index, names, "a") == NameIndex::npos);
+    index.build(0, [&names](size_t i) { return std::string_view(names[i]); });
+    ST_ASSERT(lookup(index, names, "a") == NameIndex::npos);
+}
+
+// The first of the entries with the same name is found.
+void duplicate_test() {
+    const std::vector<std::string> names{"x", "y", "x", "x"};
+    NameIndex index;
+    index.build(names.size(), [&names](size_t i) { return std::string_view(names[i]); });
+    ST_ASSERT(lookup(index, names, "x") == 0);
+    ST_ASSERT(lookup(index, names, "y") == 1);
+}
+
+void many_test() {
+    std::vector<std::string> names;
+    for(int i = 0; i < 100000; ++i) {
+        names.push_back("dir" + std::to_string(i % 100) + "/file" + std::to_string(i));
+    }
+    NameIndex index;
+    index.build(names.size(), [&names](size_t i) { return std::string_view(names[i]); });
+    for(size_t i = 0; i < names.size(); ++i) {
+        ST_ASSERT(lookup(index, names, names[i].c_str()) == i);
+    }
+    ST_ASSERT(lookup(index, names, "dir0/file1") == NameIndex::npos);
+}
+
+int main(int, char **) {
+    ST_TEST(basic_test);
+    ST_TEST(empty_test);
+    ST_TEST(duplicate_test);
+    ST_TEST(many_test);
+    return 0;
+}
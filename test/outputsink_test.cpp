@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <decompress.h>
+#include <smalltest.hpp>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+namespace {
+
+std::vector<unsigned char> test_data(size_t size) {
+    std::mt19937 gen(42);
+    std::vector<unsigned char> data(size);
+    for(auto &c : data) {
+        // Compressible, but not too much.
+        c = 'a' + gen() % 8;
+    }
+    return data;
+}
+
+std::vector<unsigned char> raw_deflate(const std::vector<unsigned char> &data) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    deflateInit2(&strm, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    std::vector<unsigned char> out(deflateBound(&strm, data.size()));
+    strm.next_in = const_cast<unsigned char *>(data.data());
+    strm.avail_in = data.size();
+    strm.next_out = out.data();
+    strm.avail_out = out.size();
+    deflate(&strm, Z_FINISH);
+    out.resize(strm.total_out);
+    deflateEnd(&strm);
+    return out;
+}
+
+centralview make_header(uint16_t method,
+                        const std::vector<unsigned char> &data,
+                        const std::vector<unsigned char> &compressed) {
+    centralview ch{};
+    ch.compression_method = method;
+    ch.crc32 = crc32(0, data.data(), data.size());
+    ch.compressed_size = compressed.size();
+    ch.uncompressed_size = data.size();
+    return ch;
+}
+
+EntryData entry_of(const std::vector<unsigned char> &compressed) {
+    return EntryData{compressed.data(), compressed.size(), -1, 0};
+}
+
+} // namespace
+
+void vector_sink_test() {
+    const auto data = test_data(3 * 1024 * 1024 + 17);
+    const auto compressed = raw_deflate(data);
+    const auto ch = make_header(ZIP_DEFLATE, data, compressed);
+    TaskControl tc;
+    std::vector<unsigned char> result{'x'};
+    {
+        VectorSink out(result);
+        decode_entry(ch, entry_of(compressed), out, tc);
+    }
+    ST_ASSERT(result.size() == data.size() + 1);
+    ST_ASSERT(result[0] == 'x');
+    ST_ASSERT(memcmp(result.data() + 1, data.data(), data.size()) == 0);
+}
+
+void callback_sink_test() {
+    const auto data = test_data(2 * 1024 * 1024);
+    const auto ch = make_header(ZIP_NO_COMPRESSION, data, data);
+    TaskControl tc;
+    std::vector<unsigned char> result;
+    CallbackSink out([&result](const unsigned char *d, size_t size) {
+        result.insert(result.end(), d, d + size);
+    });
+    decode_entry(ch, entry_of(data), out, tc);
+    ST_ASSERT(result == data);
+}
+
+void buffer_sink_test() {
+    const auto data = test_data(100000);
+    const auto compressed = raw_deflate(data);
+    auto ch = make_header(ZIP_DEFLATE, data, compressed);
+    TaskControl tc;
+    std::vector<unsigned char> buf(data.size());
+    BufferSink out(buf.data(), buf.size());
+    decode_entry(ch, entry_of(compressed), out, tc);
+    ST_ASSERT(buf == data);
+
+    // An entry bigger than its header says does not fit.
+    ch.uncompressed_size -= 10;
+    BufferSink small(buf.data(), ch.uncompressed_size);
+    bool thrown = false;
+    try {
+        decode_entry(ch, entry_of(compressed), small, tc);
+    } catch(const std::runtime_error &) {
+        thrown = true;
+    }
+    ST_ASSERT(thrown);
+}
+
+void entry_reader_test() {
+    const auto data = test_data(1024 * 1024 + 3);
+    const auto compressed = raw_deflate(data);
+    for(const uint16_t method : {ZIP_DEFLATE, ZIP_NO_COMPRESSION}) {
+        const auto &packed = method == ZIP_DEFLATE ? compressed : data;
+        const auto ch = make_header(method, data, packed);
+        for(const size_t step : {1, 1000, 65536, 4 * 1024 * 1024}) {
+            EntryReader reader(ch, entry_of(packed));
+            std::vector<unsigned char> result;
+            std::vector<unsigned char> buf(step);
+            size_t got;
+            while((got = reader.read(buf.data(), buf.size())) > 0) {
+                result.insert(result.end(), buf.begin(), buf.begin() + got);
+            }
+            ST_ASSERT(result == data);
+            ST_ASSERT(reader.position() == data.size());
+        }
+    }
+}
+
+void entry_reader_crc_test() {
+    const auto data = test_data(5000);
+    const auto compressed = raw_deflate(data);
+    auto ch = make_header(ZIP_DEFLATE, data, compressed);
+    ch.crc32 ^= 1;
+    EntryReader reader(ch, entry_of(compressed));
+    unsigned char buf[1024];
+    bool thrown = false;
+    try {
+        while(reader.read(buf, sizeof(buf)) > 0) {
+        }
+    } catch(const std::runtime_error &) {
+        thrown = true;
+    }
+    ST_ASSERT(thrown);
+}
+
+int main(int, char **) {
+    ST_TEST(vector_sink_test);
+    ST_TEST(callback_sink_test);
+    ST_TEST(buffer_sink_test);
+    ST_TEST(entry_reader_test);
+    ST_TEST(entry_reader_crc_test);
+    return 0;
+}
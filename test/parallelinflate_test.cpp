@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <file.h>
+#include <parallelinflate.h>
+#include <smalltest.hpp>
+#include <taskcontrol.h>
+#include <testarchive.hpp>
+#include <threadpool.h>
+#include <zipparse.h>
+#include <zipreader.h>
+
+#include <filesystem>
+#include <string>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const uint64_t BLOCK_SIZE = 64 * 1024;
+
+const fs::path test_dir = fs::temp_directory_path() / "parzip_parallelinflate_test";
+
+std::string make_data(size_t size) {
+    std::string s;
+    uint32_t x = 54321;
+    while(s.size() < size) {
+        x = x * 1103515245 + 12345;
+        s += "word" + std::to_string(x >> 16 & 0x3ff);
+        s += (x >> 8 & 7) ? ' ' : '\n';
+    }
+    s.resize(size);
+    return s;
+}
+
+std::string read_all(File &f) {
+    f.seek(0);
+    return f.read(f.size());
+}
+
+} // namespace
+
+// An entry packed in independent blocks lists them in its central header
+// and decodes from that list alone, one block per task.
+void segmented_test() {
+    enter_test_dir(test_dir);
+    // Not a whole number of blocks, so the last one is short.
+    const std::string data = make_data(10 * BLOCK_SIZE + 1234);
+    write_test_file("data.txt", data);
+    PackOptions opts;
+    opts.parallel_threshold = BLOCK_SIZE;
+    opts.parallel_block_size = BLOCK_SIZE;
+    opts.independent_blocks = true;
+    pack_test_archive({"data.txt"}, opts);
+
+    const ZipReader r("test.zip");
+    const size_t i = r.find("data.txt");
+    ST_ASSERT(i != ZipReader::npos);
+    const centralview ch = r.entry(i);
+    ST_ASSERT(ch.compression_method == ZIP_DEFLATE);
+    segmentindex index;
+    ST_ASSERT(unpack_segments(ch, index));
+    ST_ASSERT(index.segment_size == BLOCK_SIZE);
+    ST_ASSERT(index.segments.size() == 11);
+    localview lh;
+    const EntryData entry = r.entry_data(i, lh);
+    uint64_t total = 0;
+    for(const auto &s : index.segments) {
+        total += s.compressed_size;
+    }
+    ST_ASSERT(total == entry.size);
+
+    ThreadPool pool(4);
+    TaskControl tc;
+    {
+        File out("out.bin", "w+b");
+        const uint32_t crc =
+            segmented_inflate(entry.start, ch.uncompressed_size, index, out.fileno(), pool, tc);
+        ST_ASSERT(crc == ch.crc32);
+        ST_ASSERT(read_all(out) == data);
+    }
+
+    // A segment that does not match its CRC is an error.
+    segmentindex broken = index;
+    broken.segments[3].crc32 ^= 1;
+    bool thrown = false;
+    try {
+        File out("broken.bin", "w+b");
+        segmented_inflate(entry.start, ch.uncompressed_size, broken, out.fileno(), pool, tc);
+    } catch(const std::exception &) {
+        thrown = true;
+    }
+    ST_ASSERT(thrown);
+    fs::current_path(test_dir.parent_path());
+    fs::remove_all(test_dir);
+}
+
+int main(int, char **) {
+    ST_TEST(segmented_test);
+    return 0;
+}
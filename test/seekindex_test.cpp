@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fileutils.h>
+#include <seekindex.h>
+#include <smalltest.hpp>
+#include <taskcontrol.h>
+#include <testarchive.hpp>
+#include <utils.h>
+#include <zipreader.h>
+
+#include <zlib.h>
+
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Text with enough randomness in it that deflate makes many blocks whose
+// boundaries are not at byte boundaries.
+std::string make_data(size_t size) {
+    std::string s;
+    uint32_t x = 12345;
+    while(s.size() < size) {
+        x = x * 1103515245 + 12345;
+        s += std::to_string(x >> 16 & 0x3ff);
+        s += (x >> 8 & 7) ? ' ' : '\n';
+        if((x & 0xff) == 0) {
+            s += std::to_string(x);
+        }
+    }
+    s.resize(size);
+    return s;
+}
+
+std::string raw_deflate(const std::string &data) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    ST_ASSERT(deflateInit2(&strm, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+    std::string out(deflateBound(&strm, data.size()), '\0');
+    strm.next_in = (Bytef *)data.data();
+    strm.avail_in = data.size();
+    strm.next_out = (Bytef *)&out[0];
+    strm.avail_out = out.size();
+    ST_ASSERT(deflate(&strm, Z_FINISH) == Z_STREAM_END);
+    out.resize(strm.total_out);
+    deflateEnd(&strm);
+    return out;
+}
+
+// Checks reads of a few sizes around every point and at some other places.
+void check_reads(const SeekIndex &index, const EntryData &entry, const std::string &data) {
+    std::vector<uint64_t> offsets{0, 1, data.size() / 3, data.size() - 1, data.size() + 10};
+    for(const auto &p : index.points()) {
+        offsets.push_back(p.out);
+        if(p.out > 0) {
+            offsets.push_back(p.out - 1);
+        }
+    }
+    std::vector<unsigned char> buf(70000);
+    for(const auto offset : offsets) {
+        for(const size_t size : {size_t(1), size_t(1000), buf.size()}) {
+            const size_t got = index.read_at(entry, offset, buf.data(), size);
+            const std::string expected = offset < data.size() ? data.substr(offset, size) : "";
+            ST_ASSERT(got == expected.size());
+            ST_ASSERT(std::string((const char *)buf.data(), got) == expected);
+        }
+    }
+}
+
+const fs::path test_dir = fs::temp_directory_path() / "parzip_seekindex_test";
+
+} // namespace
+
+void raw_test() {
+    const std::string data = make_data(3 * 1024 * 1024);
+    const std::string compressed = raw_deflate(data);
+    centralview ch{};
+    ch.compression_method = ZIP_DEFLATE;
+    ch.crc32 = CRC32((const unsigned char *)data.data(), data.size());
+    ch.compressed_size = compressed.size();
+    ch.uncompressed_size = data.size();
+    const EntryData entry{(const unsigned char *)compressed.data(), compressed.size(), -1, 0};
+    TaskControl tc;
+    const SeekIndex index = SeekIndex::build(ch, entry, 256 * 1024, tc);
+    ST_ASSERT(index.size() == data.size());
+    ST_ASSERT(index.points().size() > 5);
+    ST_ASSERT(index.matches(ch));
+    bool unaligned = false;
+    for(const auto &p : index.points()) {
+        unaligned |= p.bits != 0;
+    }
+    ST_ASSERT(unaligned);
+    check_reads(index, entry, data);
+
+    ch.crc32 ^= 1;
+    bool thrown = false;
+    try {
+        SeekIndex::build(ch, entry, 256 * 1024, tc);
+    } catch(const std::exception &) {
+        thrown = true;
+    }
+    ST_ASSERT(thrown);
+}
+
+// Indexes of an archive go to the sidecar and are used from there when
+// the archive is opened again.
+void store_test() {
+    enter_test_dir(test_dir);
+    const std::string big = make_data(3 * 1024 * 1024);
+    write_test_file("big", big);
+    write_test_file("small", "tiny");
+    PackOptions opts;
+    // Makes the big file deflated, in blocks that end in flushes.
+    opts.parallel_threshold = 1024 * 1024;
+    opts.parallel_block_size = 256 * 1024;
+    pack_test_archive({"big", "small"}, opts);
+    const ZipReader r("test.zip");
+    const size_t big_i = r.find("big");
+    const size_t small_i = r.find("small");
+    ST_ASSERT(r.entry(big_i).compression_method == ZIP_DEFLATE);
+    std::vector<unsigned char> buf(100000);
+    {
+        SeekIndexStore store(r, "test.zip.seek", 512 * 1024);
+        ST_ASSERT(store.read_at(small_i, 1, buf.data(), buf.size()) == 3);
+        ST_ASSERT(std::string((const char *)buf.data(), 3) == "iny");
+        const uint64_t offset = 2 * 1024 * 1024 + 17;
+        ST_ASSERT(store.read_at(big_i, offset, buf.data(), buf.size()) == buf.size());
+        ST_ASSERT(std::string((const char *)buf.data(), buf.size()) ==
+                  big.substr(offset, buf.size()));
+        // One new index is not a batch yet.
+        ST_ASSERT(!exists_on_fs("test.zip.seek"));
+    }
+    ST_ASSERT(exists_on_fs("test.zip.seek"));
+    const auto saved_size = fs::file_size("test.zip.seek");
+    {
+        SeekIndexStore store(r, "test.zip.seek", 512 * 1024);
+        const uint64_t offset = big.size() - 50;
+        ST_ASSERT(store.read_at(big_i, offset, buf.data(), buf.size()) == 50);
+        ST_ASSERT(std::string((const char *)buf.data(), 50) == big.substr(offset));
+        ST_ASSERT(store.read_at(big_i, big.size(), buf.data(), buf.size()) == 0);
+    }
+    // Nothing new was built, so nothing was written.
+    ST_ASSERT(fs::file_size("test.zip.seek") == saved_size);
+
+    // Threads that read an entry whose index is not built yet wait for the
+    // one that builds it. A store without a sidecar writes nothing.
+    {
+        SeekIndexStore store(r, "", 512 * 1024);
+        std::atomic<int> errors{0};
+        std::vector<std::thread> threads;
+        for(int t = 0; t < 4; ++t) {
+            threads.emplace_back([&store, &big, &errors, big_i, t]() {
+                std::vector<unsigned char> tbuf(1000);
+                const uint64_t offset = 700 * 1024 * (t + 1);
+                if(store.read_at(big_i, offset, tbuf.data(), tbuf.size()) != tbuf.size() ||
+                   std::string((const char *)tbuf.data(), tbuf.size()) !=
+                       big.substr(offset, tbuf.size())) {
+                    ++errors;
+                }
+            });
+        }
+        for(auto &t : threads) {
+            t.join();
+        }
+        ST_ASSERT(errors == 0);
+        store.save();
+    }
+    ST_ASSERT(!exists_on_fs(".seek"));
+    ST_ASSERT(!exists_on_fs("$ZIPTMP"));
+
+    // A broken sidecar is ignored.
+    write_test_file("test.zip.seek", "PZSEEK01garbage");
+    {
+        SeekIndexStore store(r, "test.zip.seek", 512 * 1024);
+        ST_ASSERT(store.read_at(big_i, 5, buf.data(), 10) == 10);
+        ST_ASSERT(std::string((const char *)buf.data(), 10) == big.substr(5, 10));
+    }
+    fs::current_path(test_dir.parent_path());
+    fs::remove_all(test_dir);
+}
+
+int main(int, char **) {
+    ST_TEST(raw_test);
+    ST_TEST(store_test);
+    return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <fileutils.h>
+#include <smalltest.hpp>
+#include <zipcreator.h>
+
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Shared setup of the tests that read archives made by parzip itself.
+
+// Empties the directory, creating it if needed, and makes it the working
+// directory.
+inline void enter_test_dir(const std::filesystem::path &dir) {
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directory(dir);
+    std::filesystem::current_path(dir);
+}
+
+// Writes a test input file, creating the directories it is in.
+inline void write_test_file(const std::string &fname, const std::string &data) {
+    create_dirs_for_file(fname);
+    FILE *f = fopen(fname.c_str(), "wb");
+    ST_ASSERT(f);
+    ST_ASSERT(fwrite(data.data(), 1, data.size(), f) == data.size());
+    fclose(f);
+}
+
+// Packs the inputs into test.zip with parzip's own creator and waits until
+// it is done.
+inline void pack_test_archive(const std::vector<std::string> &inputs,
+                              const PackOptions &opts = PackOptions()) {
+    ZipCreator zc("test.zip", opts);
+    TaskControl *tc = zc.create(expand_files(inputs), 2);
+    zc.wait();
+    ST_ASSERT(tc->failures() == 0);
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <smalltest.hpp>
+#include <threadpool.h>
+#include <vector>
+
+void many_tasks_test() {
+    std::atomic<int> counter{0};
+    {
+        ThreadPool pool(4);
+        for(int i = 0; i < 10000; ++i) {
+            pool.submit([&counter]() { ++counter; });
+        }
+    }
+    ST_ASSERT(counter == 10000);
+}
+
+void completion_test() {
+    ThreadPool pool(3);
+    CompletionQueue<int> done;
+    for(int i = 0; i < 100; ++i) {
+        pool.submit([i, &done]() { done.push(i); });
+    }
+    int sum = 0;
+    for(int i = 0; i < 100; ++i) {
+        sum += done.pop();
+    }
+    ST_ASSERT(sum == 99 * 100 / 2);
+}
+
+// Every worker waits for subtasks. This deadlocks unless
+// joining runs subtasks that have not been started yet.
+void nested_fork_test() {
+    ThreadPool pool(2);
+    std::vector<ForkedTask<int>> outer;
+    for(int i = 0; i < 8; ++i) {
+        outer.emplace_back(pool.fork([&pool, i]() {
+            std::vector<ForkedTask<int>> inner;
+            for(int j = 0; j < 8; ++j) {
+                inner.emplace_back(pool.fork([i, j]() { return i * j; }));
+            }
+            int sum = 0;
+            for(auto &t : inner) {
+                sum += t.join();
+            }
+            return sum;
+        }));
+    }
+    int total = 0;
+    for(auto &t : outer) {
+        total += t.join();
+    }
+    ST_ASSERT(total == 28 * 28);
+}
+
+int main(int, char **) {
+    ST_TEST(many_tasks_test);
+    ST_TEST(completion_test);
+    ST_TEST(nested_fork_test);
+    return 0;
+}
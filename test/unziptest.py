@@ -16,9 +16,9 @@
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 
-import os, sys, stat, unittest, tempfile, subprocess
-import platform
-from zipfile import ZipFile
+import io, os, sys, stat, unittest, tempfile, subprocess
+import platform, random
+from zipfile import ZipFile, ZipInfo, ZIP_DEFLATED, ZIP_STORED
 
 datadir = None
 unzip_exe = None
@@ -62,6 +62,19 @@ class ZipTestBase(unittest.TestCase):
         self.is_dir_subset(dir1, dir2)
         self.is_dir_subset(dir2, dir1)
 
+class Unseekable(io.RawIOBase):
+    """Makes zipfile write data descriptors, as it does into a pipe."""
+
+    def __init__(self):
+        self.data = bytearray()
+
+    def writable(self):
+        return True
+
+    def write(self, b):
+        self.data += b
+        return len(b)
+
 class TestUnzip(ZipTestBase):
 
     def check_same(self, zipname):
@@ -122,6 +135,155 @@ class TestUnzip(ZipTestBase):
                 self.assertTrue(stat.S_ISLNK(lstats.st_mode))
                 self.assertEqual(os.readlink(outsymlink), 'source.txt')
 
+    def test_parallel_inflate(self):
+        words = ['word%d ' % i for i in range(1000)]
+        data = ''.join(random.choice(words) for i in range(300000)).encode()
+        with tempfile.TemporaryDirectory() as packdir:
+            with tempfile.TemporaryDirectory() as testdir:
+                zfile = os.path.join(packdir, 'big.zip')
+                info = ZipInfo('big.txt')
+                info.external_attr = 0o100644 << 16
+                info.compress_type = ZIP_DEFLATED
+                with ZipFile(zfile, 'w') as zf:
+                    zf.writestr(info, data)
+                subprocess.check_call([unzip_exe,
+                                       '--threads=4',
+                                       '--parallel-threshold=64k',
+                                       '--parallel-chunk-size=64k',
+                                       zfile], cwd=testdir)
+                with open(os.path.join(testdir, 'big.txt'), 'rb') as f:
+                    self.assertEqual(f.read(), data)
+
+    def test_parallel_inflate_runs(self):
+        # Long runs inflate to far more than the chunks' speculative
+        # output limit and are decoded sequentially in pieces.
+        words = ['word%d ' % i for i in range(1000)]
+        text = ''.join(random.choice(words) for i in range(50000)).encode()
+        data = text + bytes(20 * 1024 * 1024) + text + bytes(5 * 1024 * 1024) + text
+        with tempfile.TemporaryDirectory() as packdir:
+            with tempfile.TemporaryDirectory() as testdir:
+                zfile = os.path.join(packdir, 'runs.zip')
+                info = ZipInfo('runs.bin')
+                info.external_attr = 0o100644 << 16
+                info.compress_type = ZIP_DEFLATED
+                with ZipFile(zfile, 'w') as zf:
+                    zf.writestr(info, data)
+                subprocess.check_call([unzip_exe,
+                                       '--threads=4',
+                                       '--parallel-threshold=64k',
+                                       '--parallel-chunk-size=64k',
+                                       zfile], cwd=testdir)
+                with open(os.path.join(testdir, 'runs.bin'), 'rb') as f:
+                    self.assertEqual(f.read(), data)
+
+    def test_large_stored(self):
+        data = os.urandom(1024 * 1024)
+        with tempfile.TemporaryDirectory() as packdir:
+            zfile = os.path.join(packdir, 'stored.zip')
+            info = ZipInfo('stored.bin')
+            info.external_attr = 0o100644 << 16
+            info.compress_type = ZIP_STORED
+            with ZipFile(zfile, 'w') as zf:
+                zf.writestr(info, data)
+            for args in ([], ['--trust-stored']):
+                with tempfile.TemporaryDirectory() as testdir:
+                    subprocess.check_call([unzip_exe] + args + [zfile], cwd=testdir)
+                    with open(os.path.join(testdir, 'stored.bin'), 'rb') as f:
+                        self.assertEqual(f.read(), data)
+
+    def test_extract_named(self):
+        with tempfile.TemporaryDirectory() as packdir:
+            zfile = os.path.join(packdir, 'named.zip')
+            with ZipFile(zfile, 'w', compression=ZIP_DEFLATED) as zf:
+                for i in range(100):
+                    info = ZipInfo('dir%d/file%d.txt' % (i % 10, i))
+                    info.external_attr = 0o100644 << 16
+                    zf.writestr(info, b'contents %d\n' % i * 100)
+            with tempfile.TemporaryDirectory() as testdir:
+                subprocess.check_call([unzip_exe, zfile, 'dir3/file53.txt', 'dir0/file0.txt'],
+                                      cwd=testdir)
+                self.assertEqual(sorted(os.listdir(testdir)), ['dir0', 'dir3'])
+                self.assertEqual(os.listdir(os.path.join(testdir, 'dir3')), ['file53.txt'])
+                with open(os.path.join(testdir, 'dir3/file53.txt'), 'rb') as f:
+                    self.assertEqual(f.read(), b'contents 53\n' * 100)
+                r = subprocess.call([unzip_exe, zfile, 'dir1/file2.txt'], cwd=testdir)
+                self.assertNotEqual(r, 0)
+
+    def test_stream(self):
+        for zipname in ('basic.zip', 'subdirs.zip', 'zip64.zip', 'lzma.zip'):
+            zfile = os.path.join(datadir, zipname)
+            with tempfile.TemporaryDirectory() as pdir:
+                with tempfile.TemporaryDirectory() as testdir:
+                    with ZipFile(zfile) as zf:
+                        zf.extractall(path=pdir)
+                    with open(zfile, 'rb') as f:
+                        subprocess.check_call([unzip_exe, '-'], stdin=f, cwd=testdir)
+                    self.dirs_equal(pdir, testdir)
+
+    def test_stream_descriptors(self):
+        data = os.urandom(300 * 1024)
+        text = b'line of text\n' * 10000
+        stream = Unseekable()
+        with ZipFile(stream, 'w') as zf:
+            info = ZipInfo('dir/')
+            info.external_attr = 0o40755 << 16
+            zf.writestr(info, b'')
+            info = ZipInfo('dir/stored.bin')
+            info.external_attr = 0o100640 << 16
+            info.compress_type = ZIP_STORED
+            zf.writestr(info, data)
+            info = ZipInfo('dir/text.txt')
+            info.external_attr = 0o100755 << 16
+            info.compress_type = ZIP_DEFLATED
+            zf.writestr(info, text)
+            info = ZipInfo('link')
+            info.create_system = 3
+            info.external_attr = 0o120777 << 16
+            zf.writestr(info, 'dir/text.txt')
+        for args in ([], ['--memory-limit=1']):
+            with tempfile.TemporaryDirectory() as testdir:
+                p = subprocess.Popen([unzip_exe] + args + ['-'],
+                                     stdin=subprocess.PIPE,
+                                     cwd=testdir)
+                p.communicate(bytes(stream.data))
+                self.assertEqual(p.returncode, 0)
+                with open(os.path.join(testdir, 'dir/stored.bin'), 'rb') as f:
+                    self.assertEqual(f.read(), data)
+                textfile = os.path.join(testdir, 'dir/text.txt')
+                with open(textfile, 'rb') as f:
+                    self.assertEqual(f.read(), text)
+                if platform.system() != 'Windows':
+                    self.assertEqual(stat.S_IMODE(os.stat(textfile).st_mode), 0o755)
+                    link = os.path.join(testdir, 'link')
+                    self.assertTrue(stat.S_ISLNK(os.lstat(link).st_mode))
+                    self.assertEqual(os.readlink(link), 'dir/text.txt')
+
+    def test_stream_unlisted(self):
+        stream = io.BytesIO()
+        with ZipFile(stream, 'w') as zf:
+            for name in ('kept.txt', 'dropped.txt', 'changed.txt'):
+                info = ZipInfo(name)
+                info.external_attr = 0o100644 << 16
+                info.compress_type = ZIP_DEFLATED
+                zf.writestr(info, name.encode() * 1000)
+            info = ZipInfo('gone/')
+            info.external_attr = 0o40755 << 16
+            zf.writestr(info, b'')
+            # Local entries that the central directory leaves out or
+            # contradicts are not part of the archive.
+            zf.filelist = [i for i in zf.filelist if i.filename in ('kept.txt', 'changed.txt')]
+            zf.filelist[1].CRC ^= 1
+        for args in ([], ['--memory-limit=1']):
+            with tempfile.TemporaryDirectory() as testdir:
+                p = subprocess.Popen([unzip_exe] + args + ['-'],
+                                     stdin=subprocess.PIPE,
+                                     cwd=testdir)
+                p.communicate(stream.getvalue())
+                self.assertNotEqual(p.returncode, 0)
+                self.assertEqual(os.listdir(testdir), ['kept.txt'])
+                with open(os.path.join(testdir, 'kept.txt'), 'rb') as f:
+                    self.assertEqual(f.read(), b'kept.txt' * 1000)
+
 if __name__ == '__main__':
     datadir = os.path.join(sys.argv[1], 'testdata')
     unzip_exe = os.path.join(sys.argv[2], 'parunzip')
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2019 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <outputsink.h>
+#include <smalltest.hpp>
+#include <testarchive.hpp>
+#include <zipreader.h>
+
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const int NUM_FILES = 200;
+
+std::string file_name(int i) { return "dir" + std::to_string(i % 7) + "/f" + std::to_string(i); }
+
+std::string file_contents(int i) {
+    std::string s;
+    for(int j = 0; j < i * 37; ++j) {
+        s += "line " + std::to_string(j * i) + "\n";
+    }
+    return s;
+}
+
+const fs::path test_dir = fs::temp_directory_path() / "parzip_zipreader_test";
+
+// Packs the test files with parzip's own creator in a fresh directory
+// and leaves it as the working directory.
+void create_archive() {
+    enter_test_dir(test_dir);
+    for(int i = 0; i < NUM_FILES; ++i) {
+        write_test_file(file_name(i), file_contents(i));
+    }
+    std::vector<std::string> dirs;
+    for(int i = 0; i < 7; ++i) {
+        dirs.push_back("dir" + std::to_string(i));
+    }
+    pack_test_archive(dirs);
+}
+
+} // namespace
+
+void lookup_test() {
+    ZipReader r("test.zip");
+    ST_ASSERT(r.size() == NUM_FILES + 7);
+    ST_ASSERT(r.find("dir4/f10") == ZipReader::npos);
+    ST_ASSERT(r.find(file_name(10)) != ZipReader::npos);
+    ST_ASSERT(r.read(file_name(10)) == file_contents(10));
+    bool thrown = false;
+    try {
+        r.read("nothere");
+    } catch(const std::exception &) {
+        thrown = true;
+    }
+    ST_ASSERT(thrown);
+}
+
+// The table agrees with the headers and can be walked with iterators.
+void entries_test() {
+    const ZipReader r("test.zip");
+    const EntryTable &t = r.entries();
+    ST_ASSERT(t.size() == r.size());
+    size_t count = 0;
+    size_t dirs = 0;
+    for(const auto &e : t) {
+        const centralview ch = r.entry(e.index());
+        ST_ASSERT(e.name() == ch.fname);
+        ST_ASSERT(e.compressed_size() == ch.compressed_size);
+        ST_ASSERT(e.uncompressed_size() == ch.uncompressed_size);
+        ST_ASSERT(e.crc32() == ch.crc32);
+        ST_ASSERT(e.compression_method() == ch.compression_method);
+        ST_ASSERT(r.find(e.name()) == e.index());
+        if(e.is_dir()) {
+            ++dirs;
+        } else {
+            const int i = std::stoi(std::string(e.name().substr(e.name().find("/f") + 2)));
+            ST_ASSERT(e.uncompressed_size() == file_contents(i).size());
+        }
+        ++count;
+    }
+    ST_ASSERT(count == t.size());
+    ST_ASSERT(dirs == 7);
+    ST_ASSERT(t.end() - t.begin() == (std::ptrdiff_t)t.size());
+    ST_ASSERT(t[3].name() == (*(t.begin() + 3)).name());
+}
+
+// An entry whose header claims more than its data can expand to is
+// refused before any memory is taken for it.
+void lying_size_test() {
+    std::string data;
+    {
+        FILE *f = fopen("test.zip", "rb");
+        char buf[4096];
+        size_t n;
+        while((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            data.append(buf, n);
+        }
+        fclose(f);
+    }
+    const std::string name = file_name(10);
+    const char huge[4] = {0, (char)0xff, (char)0xff, (char)0xff};
+    for(size_t i = data.find(name); i != std::string::npos; i = data.find(name, i + 1)) {
+        if(i >= 30 && data.compare(i - 30, 4, "PK\3\4") == 0) {
+            data.replace(i - 30 + 22, 4, huge, 4);
+        } else if(i >= 46 && data.compare(i - 46, 4, "PK\1\2") == 0) {
+            data.replace(i - 46 + 24, 4, huge, 4);
+        }
+    }
+    write_test_file("lie.zip", data);
+    const ZipReader r("lie.zip");
+    ST_ASSERT(r.entry(r.find(name)).uncompressed_size == 0xffffff00);
+    bool thrown = false;
+    try {
+        r.read(name);
+    } catch(const std::exception &) {
+        thrown = true;
+    }
+    ST_ASSERT(thrown);
+    ST_ASSERT(r.read(file_name(11)) == file_contents(11));
+}
+
+// One reader shared by many threads, each reading every entry in its own
+// order through all three ways of reading.
+void concurrent_test() {
+    const ZipReader r("test.zip");
+    std::atomic<int> errors{0};
+    std::vector<std::thread> threads;
+    for(int t = 0; t < 8; ++t) {
+        threads.emplace_back([&r, &errors, t]() {
+            for(int n = 0; n < NUM_FILES; ++n) {
+                const int i = (n * 13 + t * 29) % NUM_FILES;
+                const std::string expected = file_contents(i);
+                std::string got;
+                if(n % 3 == 0) {
+                    got = r.read(file_name(i));
+                } else if(n % 3 == 1) {
+                    CallbackSink out([&got](const unsigned char *d, size_t size) {
+                        got.append((const char *)d, size);
+                    });
+                    r.read(file_name(i), out);
+                } else {
+                    auto reader = r.open_entry(file_name(i));
+                    unsigned char buf[4000];
+                    size_t size;
+                    while((size = reader->read(buf, sizeof(buf))) > 0) {
+                        got.append((const char *)buf, size);
+                    }
+                }
+                if(got != expected) {
+                    ++errors;
+                }
+            }
+        });
+    }
+    for(auto &t : threads) {
+        t.join();
+    }
+    ST_ASSERT(errors == 0);
+}
+
+int main(int, char **) {
+    create_archive();
+    ST_TEST(lookup_test);
+    ST_TEST(entries_test);
+    ST_TEST(concurrent_test);
+    ST_TEST(lying_size_test);
+    fs::current_path(test_dir.parent_path());
+    fs::remove_all(test_dir);
+    return 0;
+}
@@ -16,7 +16,7 @@
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 
-import os, sys, stat, unittest, tempfile, subprocess
+import os, sys, io, stat, struct, unittest, tempfile, subprocess
 import random
 import platform
 from zipfile import ZipFile
@@ -95,6 +95,116 @@ class TestUnzip(ZipTestBase):
                 os.unlink(zf_abs)
                 self.dirs_equal(packdir, unpackdir)
 
+    def test_parallel_deflate(self):
+        zfile = 'zfile.zip'
+        datafile = 'inputdata.txt'
+        words = ['word%d ' % i for i in range(1000)]
+        with tempfile.TemporaryDirectory() as packdir:
+            with tempfile.TemporaryDirectory() as unpackdir:
+                with open(os.path.join(packdir, datafile), 'w') as dfile:
+                    for i in range(100000):
+                        dfile.write(random.choice(words))
+                zf_abs = os.path.join(packdir, zfile)
+                # The archive must not depend on the number of threads.
+                sizes = []
+                for threads in ['--threads=1', '--threads=4']:
+                    subprocess.check_call([zip_exe,
+                                           threads,
+                                           '--parallel-threshold=64k',
+                                           '--parallel-block-size=64k',
+                                           zfile, datafile], cwd=packdir)
+                    z = ZipFile(zf_abs)
+                    self.assertEqual(len(z.namelist()), 1)
+                    self.assertEqual(z.infolist()[0].compress_type, 8)
+                    sizes.append(z.infolist()[0].compress_size)
+                    z.close()
+                    os.unlink(zf_abs)
+                self.assertEqual(sizes[0], sizes[1])
+                subprocess.check_call([zip_exe,
+                                       '--threads=4',
+                                       '--parallel-threshold=64k',
+                                       '--parallel-block-size=64k',
+                                       zfile, datafile], cwd=packdir)
+                z = ZipFile(zf_abs)
+                z.extractall(unpackdir)
+                z.close()
+                os.unlink(zf_abs)
+                self.dirs_equal(packdir, unpackdir)
+
+    def test_independent_blocks(self):
+        zfile = 'zfile.zip'
+        datafile = 'inputdata.txt'
+        words = ['word%d ' % i for i in range(1000)]
+        with tempfile.TemporaryDirectory() as packdir:
+            with tempfile.TemporaryDirectory() as unpackdir:
+                with open(os.path.join(packdir, datafile), 'w') as dfile:
+                    for i in range(100000):
+                        dfile.write(random.choice(words))
+                subprocess.check_call([zip_exe,
+                                       '--threads=4',
+                                       '--parallel-threshold=64k',
+                                       '--parallel-block-size=64k',
+                                       '--independent-blocks',
+                                       zfile, datafile], cwd=packdir)
+                zf_abs = os.path.join(packdir, zfile)
+                z = ZipFile(zf_abs)
+                info = z.infolist()[0]
+                self.assertEqual(info.compress_type, 8)
+                # The segment index lists one block per 64k of input.
+                blocks = {}
+                pos = 0
+                while pos + 4 <= len(info.extra):
+                    block_id, size = struct.unpack_from('<HH', info.extra, pos)
+                    blocks[block_id] = info.extra[pos + 4:pos + 4 + size]
+                    pos += 4 + size
+                self.assertEqual(pos, len(info.extra))
+                self.assertIn(0x7a70, blocks)
+                segments = blocks[0x7a70]
+                version, block_size = struct.unpack_from('<BQ', segments)
+                self.assertEqual(version, 1)
+                self.assertEqual(block_size, 64 * 1024)
+                self.assertEqual(len(segments) % 8, 1)
+                self.assertEqual((len(segments) - 9) // 8, (info.file_size + 65535) // 65536)
+                self.assertGreater(info.file_size, 64 * 1024)
+                # Other tools see one ordinary deflate stream.
+                with z.open(datafile) as f:
+                    with open(os.path.join(packdir, datafile), 'rb') as orig:
+                        self.assertEqual(f.read(), orig.read())
+                z.close()
+                subprocess.check_call([unzip_exe, '--threads=4', zf_abs], cwd=unpackdir)
+                os.unlink(zf_abs)
+                self.dirs_equal(packdir, unpackdir)
+
+    def test_many_small(self):
+        zfile = 'zfile.zip'
+        datadir = 'subdir'
+        with tempfile.TemporaryDirectory() as packdir:
+            with tempfile.TemporaryDirectory() as unpackdir:
+                os.mkdir(os.path.join(packdir, datadir))
+                # More than fit in one batch, with a big file in between.
+                for i in range(600):
+                    with open(os.path.join(packdir, datadir, 'file%d.txt' % i), 'w') as dfile:
+                        dfile.write('This is small file number %d.\n' % i * (i % 50))
+                with open(os.path.join(packdir, datadir, 'file300.txt'), 'w') as dfile:
+                    dfile.write('This is the big file.\n' * 10000)
+                namelists = []
+                for threads in ['--threads=1', '--threads=4']:
+                    subprocess.check_call([zip_exe, threads, zfile, datadir], cwd=packdir)
+                    zf_abs = os.path.join(packdir, zfile)
+                    z = ZipFile(zf_abs)
+                    self.assertEqual(len(z.namelist()), 601)
+                    namelists.append(z.namelist())
+                    z.close()
+                    os.unlink(zf_abs)
+                self.assertEqual(namelists[0], namelists[1])
+                subprocess.check_call([zip_exe, '--threads=4', zfile, datadir], cwd=packdir)
+                zf_abs = os.path.join(packdir, zfile)
+                z = ZipFile(zf_abs)
+                z.extractall(unpackdir)
+                z.close()
+                os.unlink(zf_abs)
+                self.dirs_equal(packdir, unpackdir)
+
     def test_two(self):
         zfile = 'zfile.zip'
         datafile1 = 'inputdata.txt'
@@ -156,6 +266,47 @@ class TestUnzip(ZipTestBase):
                 os.unlink(zf_abs)
                 self.dirs_equal(packdir, unpackdir)
 
+    def test_files0_from(self):
+        zfile = 'zfile.zip'
+        with tempfile.TemporaryDirectory() as packdir:
+            with tempfile.TemporaryDirectory() as unpackdir:
+                os.makedirs(os.path.join(packdir, 'subdir/subsubdir'))
+                with open(os.path.join(packdir, 'subdir/subfile.txt'), 'w') as dfile:
+                    dfile.write('This is a file in the subdirectory.\n')
+                with open(os.path.join(packdir, 'subdir/subsubdir/sub file.txt'), 'w') as dfile:
+                    dfile.write('This is a file with a space in its name.\n')
+                names = b'subdir\0subdir/subsubdir\0subdir/subsubdir/sub file.txt\0'
+                subprocess.run([zip_exe, '--files0-from=-', zfile],
+                               input=names, cwd=packdir, check=True)
+                zf_abs = os.path.join(packdir, zfile)
+                z = ZipFile(zf_abs)
+                # Listed directories are not recursed into.
+                self.assertEqual(len(z.namelist()), 3)
+                z.extractall(unpackdir)
+                z.close()
+                os.unlink(zf_abs)
+                os.unlink(os.path.join(packdir, 'subdir/subfile.txt'))
+                self.dirs_equal(packdir, unpackdir)
+
+    def test_stdout(self):
+        datadir = 'subdir'
+        with tempfile.TemporaryDirectory() as packdir:
+            with tempfile.TemporaryDirectory() as unpackdir:
+                os.mkdir(os.path.join(packdir, datadir))
+                with open(os.path.join(packdir, datadir, 'small.txt'), 'w') as dfile:
+                    dfile.write('This is a small file.\n')
+                # Does not fit in memory, so it is streamed with a data descriptor.
+                with open(os.path.join(packdir, datadir, 'random.bin'), 'wb') as dfile:
+                    dfile.write(os.urandom(3 * 1024 * 1024))
+                pz = subprocess.run([zip_exe, '--memory-limit=1', '-', datadir],
+                                    stdout=subprocess.PIPE, cwd=packdir, check=True)
+                z = ZipFile(io.BytesIO(pz.stdout))
+                self.assertEqual(len(z.namelist()), 3)
+                self.assertTrue(any(i.flag_bits & 0x08 for i in z.infolist()))
+                z.extractall(unpackdir)
+                z.close()
+                self.dirs_equal(packdir, unpackdir)
+
     def test_abs(self):
         self.assertNotEqual(subprocess.call([zip_exe, 'foobar.zip', __file__]), 0)
 